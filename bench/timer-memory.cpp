@@ -0,0 +1,97 @@
+// Measures the heap memory used per pending timer, for the figures in the
+// README. Allocations are counted by replacing the global allocation
+// functions, so the figures exclude the allocator's own overhead.
+//
+// Usage: timer-memory [timer count]
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "scheduler.hpp"
+
+namespace {
+
+std::size_t g_allocatedBytes = 0;
+
+// Each allocation is preceded by its size, padded to keep it aligned
+constexpr std::size_t HeaderSize = alignof(std::max_align_t);
+
+// Heap bytes per timer after scheduling `count` timers on a new scheduler
+template <typename Fn>
+double bytesPerTimer(std::size_t count, Fn&& scheduleTimers) {
+	Scheduler scheduler;
+	std::size_t before = g_allocatedBytes;
+	scheduleTimers(scheduler, count);
+	return static_cast<double>(g_allocatedBytes - before) / count;
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+	auto* block = static_cast<unsigned char*>(std::malloc(size + HeaderSize));
+	if (!block) {
+		throw std::bad_alloc();
+	}
+	*reinterpret_cast<std::size_t*>(block) = size;
+	g_allocatedBytes += size;
+	return block + HeaderSize;
+}
+
+void operator delete(void* ptr) noexcept {
+	if (ptr) {
+		auto* block = static_cast<unsigned char*>(ptr) - HeaderSize;
+		g_allocatedBytes -= *reinterpret_cast<std::size_t*>(block);
+		std::free(block);
+	}
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	operator delete(ptr);
+}
+
+void* operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void operator delete[](void* ptr) noexcept {
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+	operator delete(ptr);
+}
+
+int main(int argc, char** argv) {
+	std::size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	if (count == 0) {
+		std::fprintf(stderr, "usage: %s [timer count]\n", argv[0]);
+		return 1;
+	}
+
+	// Idle timeouts: the same delay for every timer
+	const Scheduler::DurationMs timeout(30000);
+
+	double shared = bytesPerTimer(count, [&](Scheduler& scheduler,
+											 std::size_t n) {
+		auto callback = scheduler.addTaskCallback([](Scheduler::TaskId) {});
+		for (std::size_t i = 0; i < n; i++) {
+			scheduler.scheduleAfter(timeout, callback);
+		}
+	});
+
+	// A capture the size of the Lua binding's, which stays inline in the
+	// function object
+	int counter = 0;
+	double own = bytesPerTimer(count, [&](Scheduler& scheduler,
+										  std::size_t n) {
+		for (std::size_t i = 0; i < n; i++) {
+			scheduler.scheduleAfter(
+				timeout, [&counter, i](Scheduler::TaskId) { counter += i; });
+		}
+	});
+
+	std::printf("%zu timers\n", count);
+	std::printf("shared callback: %.1f bytes per timer\n", shared);
+	std::printf("own callback:    %.1f bytes per timer\n", own);
+	return 0;
+}
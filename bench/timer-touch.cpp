@@ -0,0 +1,111 @@
+// Measures the cost of touching idle timeouts, for the figures in the README.
+// Pending 30 second timeouts are touched at random over a minute of simulated
+// time, ticking every simulated millisecond. Each timeout is touched every 10
+// seconds on average, so the number of touches grows with the number of
+// timeouts and a flat cost per touch means rearming doesn't depend on how
+// many timers are pending.
+//
+// Usage: timer-touch [largest timer count]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "scheduler-impl.hpp"
+
+// Simulated clock, advanced by the benchmark. It and the policy have external
+// linkage, so the scheduler instantiated with them does too.
+struct SimulatedClock {
+	using rep = std::chrono::steady_clock::rep;
+	using period = std::chrono::steady_clock::period;
+	using duration = std::chrono::steady_clock::duration;
+	using time_point = std::chrono::time_point<SimulatedClock>;
+	static constexpr bool is_steady = true;
+
+	static time_point now() { return s_now; }
+	static void advance(std::chrono::milliseconds ms) { s_now += ms; }
+
+	static inline time_point s_now{};
+};
+
+struct SimulatedPolicy : DefaultSchedulerPolicy {
+	using Clock = SimulatedClock;
+};
+
+namespace {
+
+using SimulatedScheduler = BasicScheduler<SimulatedPolicy>;
+using Ms = std::chrono::milliseconds;
+
+constexpr int SimulatedMs = 60000;
+constexpr std::size_t MsPerTouch = 10000;
+
+struct TouchResult {
+	std::size_t touches;
+	double seconds;
+};
+
+// Touch `count` timeouts at random while ticking through the simulated time
+TouchResult touchTimers(std::size_t count) {
+	SimulatedScheduler scheduler;
+	auto callback =
+		scheduler.addTaskCallback([](SimulatedScheduler::TaskId) {});
+	const SimulatedScheduler::DurationMs timeout(30000);
+
+	std::vector<SimulatedScheduler::TaskId> ids;
+	ids.reserve(count);
+	for (std::size_t i = 0; i < count; i++) {
+		ids.push_back(scheduler.scheduleAfter(timeout, callback));
+	}
+
+	// Spread the touches over the milliseconds, carrying the remainder
+	std::mt19937 random(1);
+	std::uniform_int_distribution<std::size_t> pick(0, count - 1);
+	std::size_t touches = 0;
+	std::size_t carry = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int ms = 0; ms < SimulatedMs; ms++) {
+		SimulatedClock::advance(Ms(1));
+		carry += count;
+		for (; carry >= MsPerTouch; carry -= MsPerTouch) {
+			// Timeouts that expired are scheduled again, as for a new
+			// connection
+			std::size_t i = pick(random);
+			if (!scheduler.touchTask(ids[i])) {
+				ids[i] = scheduler.scheduleAfter(timeout, callback);
+			}
+			touches++;
+		}
+		scheduler.tick();
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	return {touches, elapsed.count()};
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+	std::size_t largest =
+		argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	if (largest == 0) {
+		std::fprintf(stderr, "usage: %s [largest timer count]\n", argv[0]);
+		return 1;
+	}
+
+	std::printf("%10s %10s %10s %14s\n", "timers", "touches", "seconds",
+				"ns per touch");
+	for (std::size_t count = 30000;; count = count * 10 / 3) {
+		count = std::min(count, largest);
+		TouchResult result = touchTimers(count);
+		std::printf("%10zu %10zu %10.2f %14.1f\n", count, result.touches,
+					result.seconds, result.seconds * 1e9 / result.touches);
+		if (count == largest) {
+			break;
+		}
+	}
+	return 0;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lua.hpp>
+#include <stdint.h>
 #include "lua-rhythm-export.h"
 
 #ifdef __cplusplus
@@ -12,6 +13,35 @@ extern "C" {
  */
 LUA_RHYTHM_EXPORT int luaopen_rhythm(lua_State* L);
 
+/**
+ * Context for the LuaJIT FFI fast path, from `rhythm.get_ffi_context()`.
+ * These functions never touch the Lua state, so FFI calls to them can be JIT
+ * compiled. See lua/rhythm_ffi.lua for the shim that binds them.
+ */
+typedef struct rhythm_ffi_context rhythm_ffi_context;
+
+/**
+ * Schedule a one-shot task to run after a delay. The task runs the function
+ * stored under the returned task ID in the context's function table, which
+ * the caller must set before the next tick.
+ * @return The ID of the scheduled task.
+ */
+LUA_RHYTHM_EXPORT int rhythm_schedule_after_ref(rhythm_ffi_context* ctx,
+												int64_t delay_ms);
+
+/**
+ * Cancel a task scheduled with `rhythm_schedule_after_ref()`. The caller must
+ * clear the task's entry in the function table if this succeeds.
+ * @return Non-zero if the task was found and cancelled.
+ */
+LUA_RHYTHM_EXPORT int rhythm_cancel(rhythm_ffi_context* ctx, int id);
+
+/**
+ * Get the milliseconds until the next task is due.
+ * @return The milliseconds until the next task, or -1 if none are scheduled.
+ */
+LUA_RHYTHM_EXPORT int64_t rhythm_ms_until_next(rhythm_ffi_context* ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Opaque handle to a scheduler.
+ */
+typedef struct rhythm_scheduler rhythm_scheduler;
+
+typedef int rhythm_task_id;
+
+/**
+ * Native task callback.
+ * @param id The ID of the task.
+ * @param userdata The pointer passed when the task was scheduled.
+ */
+typedef void (*rhythm_task_fn)(rhythm_task_id id, void* userdata);
+
+/**
+ * Create a new scheduler.
+ * @return The scheduler, free it with `rhythm_scheduler_free()`.
+ */
+rhythm_scheduler* rhythm_scheduler_new(void);
+
+/**
+ * Destroy a scheduler created with `rhythm_scheduler_new()`.
+ */
+void rhythm_scheduler_free(rhythm_scheduler* scheduler);
+
+/**
+ * Schedule a one-shot task to run after a delay.
+ * @param scheduler The scheduler.
+ * @param delay_ms The delay in milliseconds.
+ * @param fn The task function to execute.
+ * @param cleanup Optional function called once the task is done or cancelled,
+ * may be NULL.
+ * @param userdata Pointer passed to `fn` and `cleanup`.
+ * @return The ID of the scheduled task.
+ */
+rhythm_task_id rhythm_scheduler_after(rhythm_scheduler* scheduler,
+									  int64_t delay_ms,
+									  rhythm_task_fn fn,
+									  rhythm_task_fn cleanup,
+									  void* userdata);
+
+/**
+ * Schedule a recurring task at the given interval.
+ * @param scheduler The scheduler.
+ * @param interval_ms The interval in milliseconds.
+ * @param fn The task function to execute.
+ * @param cleanup Optional function called once the task is cancelled, may be
+ * NULL.
+ * @param userdata Pointer passed to `fn` and `cleanup`.
+ * @param run_immediately Non-zero to run the task immediately.
+ * @param skip_if_late Non-zero to skip missed runs if late.
+ * @return The ID of the scheduled task.
+ */
+rhythm_task_id rhythm_scheduler_every(rhythm_scheduler* scheduler,
+									  int64_t interval_ms,
+									  rhythm_task_fn fn,
+									  rhythm_task_fn cleanup,
+									  void* userdata,
+									  int run_immediately,
+									  int skip_if_late);
+
+/**
+ * Cancel a scheduled task.
+ * @return Non-zero if the task was found and cancelled.
+ */
+int rhythm_scheduler_cancel(rhythm_scheduler* scheduler, rhythm_task_id id);
+
+/**
+ * Push back the deadline of a task scheduled with `rhythm_scheduler_after()` or
+ * `rhythm_scheduler_every()`, so it runs its delay or interval after now.
+ * @return Non-zero if the task was found and touched.
+ */
+int rhythm_scheduler_touch(rhythm_scheduler* scheduler, rhythm_task_id id);
+
+/**
+ * Run any tasks that are due.
+ */
+void rhythm_scheduler_tick(rhythm_scheduler* scheduler);
+
+/**
+ * Wait until the next task is due, but no longer than `max_wait_ms`, then run
+ * any tasks that are due. For hosts driving their own event loop.
+ * @param max_wait_ms The longest time to wait, zero to not wait.
+ * @return The number of tasks run.
+ */
+size_t rhythm_scheduler_run_once(rhythm_scheduler* scheduler,
+								 int64_t max_wait_ms);
+
+/**
+ * Run the scheduler loop until it is stopped or no tasks are left.
+ * @return Non-zero if the loop wasn't stopped.
+ */
+int rhythm_scheduler_loop(rhythm_scheduler* scheduler);
+
+/**
+ * Stop the scheduler loop.
+ */
+void rhythm_scheduler_stop(rhythm_scheduler* scheduler);
+
+/**
+ * Function posted to run on the scheduler's thread.
+ * @param userdata The pointer passed to `rhythm_scheduler_post()`.
+ */
+typedef void (*rhythm_post_fn)(void* userdata);
+
+/**
+ * Run a function on the scheduler's thread, at the start of the next tick.
+ * This is the only function that may be called from other threads. It wakes
+ * up `rhythm_scheduler_loop()` if it is waiting, and makes the poll
+ * descriptor readable.
+ */
+void rhythm_scheduler_post(rhythm_scheduler* scheduler,
+						   rhythm_post_fn fn,
+						   void* userdata);
+
+/**
+ * Get a file descriptor for waiting on the scheduler from an external event
+ * loop. It becomes readable when a task is due or a function was posted, and
+ * stays readable until the next `rhythm_scheduler_tick()`. The descriptor is
+ * owned by the scheduler.
+ * @return The descriptor, or -1 if it couldn't be created or isn't supported
+ * on this platform.
+ */
+int rhythm_scheduler_poll_fd(rhythm_scheduler* scheduler);
+
+/**
+ * Get the milliseconds until the next task is due.
+ * @return The milliseconds until the next task, or -1 if none are scheduled.
+ */
+int64_t rhythm_scheduler_ms_until_next(const rhythm_scheduler* scheduler);
+
+/**
+ * Get the number of scheduled tasks.
+ */
+size_t rhythm_scheduler_task_count(const rhythm_scheduler* scheduler);
+
+#ifdef __cplusplus
+}
+#endif
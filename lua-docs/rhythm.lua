@@ -12,11 +12,26 @@ local rhythm = {}
 --- @return TaskId The ID of the scheduled task.
 function rhythm.schedule_at(time, fn) end
 
+--- @class ScheduleOptions
+--- @field after? TaskId[] Tasks to wait for. The delay starts once all of them have completed.
+
 --- Schedule a one-shot task to run after a delay.
+--- With `options.after`, the task is held until the listed tasks have run;
+--- tasks that are no longer scheduled count as done. If one of them is
+--- cancelled, the held task is cancelled too, so a pipeline is cancelled by
+--- cancelling its first step.
+---
+--- Example:
+--- ```lua
+--- local snapshot = rhythm.schedule_after(0, take_snapshot)
+--- local flush = rhythm.schedule_after(0, flush, {after = {snapshot}})
+--- rhythm.schedule_after(1000, compact, {after = {flush}})
+--- ```
 --- @param delayMs integer Delay in milliseconds before running the task.
 --- @param fn TaskFn The task function to execute.
+--- @param options? ScheduleOptions
 --- @return TaskId The ID of the scheduled task.
-function rhythm.schedule_after(delayMs, fn) end
+function rhythm.schedule_after(delayMs, fn, options) end
 
 --- Schedule a recurring task at the given itnerval.
 --- @param intervalMs integer Interval in milliseconds between task executions.
@@ -25,11 +40,116 @@ function rhythm.schedule_after(delayMs, fn) end
 --- @return TaskId taskId The ID of the scheduled task.
 function rhythm.schedule_every(intervalMs, fn, runImmediately) end)
 
+--- @class RetryOptions
+--- @field base? integer Delay after the first failed attempt in milliseconds (default 100).
+--- @field factor? number Factor the delay grows by after each further failed attempt (default 2).
+--- @field max_delay? integer Longest delay between attempts in milliseconds (default 30000).
+--- @field max_attempts? integer Most attempts made (default: no limit).
+--- @field jitter? number Largest fraction randomly taken off each delay, from 0 to 1 (default 0).
+
+--- Schedule a task that is retried with exponential backoff until it
+--- succeeds. The first attempt runs on the next tick. `fn` is called with the
+--- task ID and the attempt number, from 1, and returns a true value once it
+--- succeeded; returning nothing, false or raising an error makes it retried.
+--- The same task is rearmed for each attempt, so its ID stays valid for
+--- `rhythm.cancel_task()` until it succeeds or runs out of attempts.
+---
+--- Example:
+--- ```lua
+--- rhythm.schedule_retry(function(taskId, attempt)
+---     return connect()
+--- end, {base = 200, max_delay = 10000, jitter = 0.2})
+--- ```
+--- @param fn fun(taskId: integer, attempt: integer): any The attempt function.
+--- @param options? RetryOptions
+--- @return TaskId taskId The ID of the scheduled task.
+function rhythm.schedule_retry(fn, options) end
+
 --- Cancel a scheduled task.
 --- @param taskId TaskId
 --- @return boolean True if the task was found and cancelled, false otherwise.
 function rhythm.cancel(taskId) end
 
+--- Records activity for a task, pushing its deadline back.
+--- A touched task doesn't run at its current deadline. Instead it is silently
+--- rearmed to run its delay (or interval, if recurring) after the last touch,
+--- without calling into Lua. This makes resetting an idle timeout a single
+--- store instead of a cancel and reschedule. Snapshots and the task log record
+--- the moved deadline, the log once per task at the end of the tick.
+--- @param taskId TaskId A task scheduled with `rhythm.schedule_after()` or `rhythm.schedule_every()`.
+--- @return boolean True if the task was found and touched, false otherwise.
+function rhythm.touch(taskId) end
+
+--- Attaches a snapshot key to a task.
+--- Only tasks with a key are written by `rhythm.save_snapshot()`. The key
+--- identifies the task's function when the snapshot is loaded again.
+--- @param taskId TaskId
+--- @param key string The key identifying the task's function.
+--- @return boolean True if the task was found, false otherwise.
+function rhythm.set_task_key(taskId, key) end
+
+--- Saves all pending tasks that have a key to a compact binary file.
+--- The deadline, interval and late policy of each task are saved, so
+--- recurring tasks keep their phase across restarts.
+--- @param path string The path of the snapshot file.
+--- @return boolean success
+--- @return string? err An error message if the snapshot could not be saved.
+function rhythm.save_snapshot(path) end
+
+--- Loads a snapshot written by `rhythm.save_snapshot()` and schedules its
+--- tasks. Each task's key is resolved to a function through `resolver`, either
+--- by indexing it if it is a table or by calling it with the key. Tasks whose
+--- key doesn't resolve to a function are skipped.
+--- @param path string The path of the snapshot file.
+--- @param resolver table<string, TaskFn>|fun(key: string): TaskFn?
+--- @return integer|nil restored The number of restored tasks, or nil on error.
+--- @return string? err An error message if the snapshot could not be loaded.
+function rhythm.load_snapshot(path, resolver) end
+
+--- Opens the durable task log and restores the one-shot tasks that were
+--- still pending when it was last used.
+--- While the log is open, keyed one-shot tasks (see `rhythm.set_task_key()`)
+--- are recorded when scheduled, cancelled or fired, so they survive a crash.
+--- Records are committed together at the end of each tick. Pending tasks are
+--- resolved to functions as in `rhythm.load_snapshot()`; tasks that can't be
+--- resolved are dropped from the log.
+--- The log file's space is allocated before records are written to it, so on
+--- a full filesystem records are lost instead of the process crashing.
+--- If RHYTHM_TASK_LOG is not enabled, this function returns nil and an error.
+--- @param path string The path of the log file.
+--- @param resolver table<string, TaskFn>|fun(key: string): TaskFn?
+--- @return integer|nil restored The number of restored tasks, or nil on error.
+--- @return string? err An error message if the log could not be opened.
+function rhythm.open_task_log(path, resolver) end
+
+--- Commits any outstanding records and closes the durable task log.
+--- @return nil
+function rhythm.close_task_log() end
+
+--- Adds a callback that only runs when the scheduler loop has slack.
+--- Idle callbacks are run by `rhythm.loop()` when no task is due within the
+--- idle horizon, including when none is scheduled, and only for as long as
+--- the per-iteration idle budget allows. Use them for low-priority housekeeping that shouldn't compete with
+--- timers.
+--- @param fn TaskFn The callback function to execute.
+--- @return TaskId taskId The ID of the callback, which can be passed to `rhythm.cancel_task()`.
+--- @see rhythm.set_idle_options
+function rhythm.on_idle(fn) end
+
+--- Configures when idle callbacks are run.
+--- @param horizonMs integer Idle callbacks only run if no task is due within this many milliseconds (default 10).
+--- @param budgetMs integer The maximum milliseconds spent running idle callbacks per loop iteration (default 5).
+--- @return nil
+function rhythm.set_idle_options(horizonMs, budgetMs) end
+
+--- Sets when cancelled and finished tasks are removed from storage.
+--- They are left in place and skipped until they make up more than the given
+--- fraction of the stored tasks, then all storage is compacted at once. Lower
+--- values use less memory, higher values compact less often.
+--- @param fraction number The fraction of dead tasks that triggers compaction, from 0 to 1 (default 0.25).
+--- @return nil
+function rhythm.set_tombstone_threshold(fraction) end
+
 --- Runs one iteration of the scheduler, executing any tasks that are due.
 --- @return nil
 function rhythm.tick() end
@@ -51,9 +171,280 @@ function rhythm.loop() end
 --- @return nil
 function rhythm.stop_loop() end
 
+--- Runs one step of the scheduler for hosts that drive their own event loop.
+--- Waits until the next task is due, but no longer than `maxWaitMs`, then runs
+--- the tasks that are due. Returns when to call again, so a frame needs only
+--- one call.
+---
+--- Example:
+--- ```lua
+--- local ran, nextMs = rhythm.run_once(0)
+--- ```
+--- @param maxWaitMs? integer The longest time to wait in milliseconds (default 0, don't wait).
+--- @return integer ran The number of tasks run.
+--- @return integer|nil nextMs The milliseconds until the next task, or nil if no tasks are scheduled.
+function rhythm.run_once(maxWaitMs) end
+
+--- Gets a file descriptor for waiting on the scheduler from the host's own
+--- event loop (epoll, libuv and the like) instead of running `rhythm.loop()`.
+--- The descriptor becomes readable when a task is due or a native thread
+--- posted a function through the C API, and stays readable until the next
+--- `rhythm.tick()`. It is owned by the scheduler, don't close it.
+---
+--- Example:
+--- ```lua
+--- local fd = rhythm.get_poll_fd()
+--- -- Register fd for reading with the host loop, then when it is readable:
+--- rhythm.tick()
+--- ```
+--- @return integer|nil fd The descriptor, or nil if it isn't supported on this platform.
+function rhythm.get_poll_fd() end
+
+--- Reads a whole file asynchronously through io_uring.
+--- Called from a coroutine without a callback, it suspends the coroutine until
+--- the file has been read and returns the result. Otherwise the result is
+--- passed to `callback` from the scheduler loop and this returns true once the
+--- read has started. Outside of a coroutine a callback is required.
+--- If RHYTHM_IO_URING is not enabled or io_uring isn't available, this
+--- function returns nil and an error.
+---
+--- Example:
+--- ```lua
+--- coroutine.wrap(function()
+---     local data, err = rhythm.read_file("config.json")
+--- end)()
+--- ```
+--- @param path string The path of the file.
+--- @param callback? fun(data: string|nil, err: string?) Called with the contents, or nil and an error.
+--- @return string|boolean|nil data The contents, or true if a callback was given, or nil on error.
+--- @return string? err An error message if the file could not be read.
+function rhythm.read_file(path, callback) end
+
+--- Replaces the contents of a file asynchronously through io_uring, creating
+--- it if needed. Completes like `rhythm.read_file()`.
+--- @param path string The path of the file.
+--- @param data string The new contents.
+--- @param callback? fun(ok: boolean|nil, err: string?) Called with true, or nil and an error.
+--- @return boolean|nil ok True on success, or nil on error.
+--- @return string? err An error message if the file could not be written.
+function rhythm.write_file(path, data, callback) end
+
+--- Flushes a file to storage asynchronously through io_uring. Completes like
+--- `rhythm.read_file()`.
+--- @param path string The path of the file.
+--- @param callback? fun(ok: boolean|nil, err: string?) Called with true, or nil and an error.
+--- @return boolean|nil ok True on success, or nil on error.
+--- @return string? err An error message if the file could not be flushed.
+function rhythm.fsync(path, callback) end
+
+--- @alias SpawnOptions { cwd: string?, env: table<string, string>?, stdout: fun(data: string)?, stderr: fun(data: string)? }
+
+--- Starts a process without blocking the loop.
+--- The program is looked up in PATH like a shell would. Its exit is watched
+--- through a pidfd on the scheduler's io_uring, so nothing polls `waitpid()`
+--- and `on_exit` runs as soon as the process ends. The process is reaped by
+--- the scheduler. Output is read from non-blocking pipes and passed to the
+--- `stdout` and `stderr` callbacks as it arrives; output that isn't captured
+--- goes to the parent's stdout and stderr.
+--- If RHYTHM_IO_URING is not enabled or io_uring isn't available, this
+--- function returns nil and an error.
+---
+--- Example:
+--- ```lua
+--- rhythm.spawn({"git", "pull"}, {stdout = io.write}, function(code, signal)
+---     print("git exited with", code or signal)
+--- end)
+--- ```
+--- @param argv string[] The program and its arguments.
+--- @param opts? SpawnOptions The working directory, the environment replacing the current one, and output callbacks.
+--- @param on_exit? fun(code: integer|nil, signal: integer|nil) Called with the exit code, or nil and the signal that killed the process, after its buffered output has been delivered.
+--- @return integer|nil pid The process ID, or nil on error.
+--- @return string? err An error message if the process could not be started.
+function rhythm.spawn(argv, opts, on_exit) end
+
+--- @alias PathEvent "access"|"modify"|"attrib"|"close_write"|"close_nowrite"|"open"|"moved_from"|"moved_to"|"create"|"delete"|"delete_self"|"move_self"
+
+--- @alias PathWatchFn fun(path: string, events: table<PathEvent|"ignored"|"overflow"|"unmount"|"isdir", true>, names: string[])
+
+--- Watches a file or directory for changes with inotify.
+--- The watch is on the same wait as the timers, so nothing polls the file.
+--- Events are coalesced: the first event of a burst opens a window of
+--- `windowMs`, and `fn` is called once when it closes with the set of events
+--- seen and, for a directory, the names of the entries involved. `ignored`
+--- means the path is gone and the watch sees no more events; `overflow` means
+--- events were lost.
+--- The inotify descriptor is waited on in the io_uring when it is available,
+--- and on its own otherwise. If RHYTHM_PATH_WATCH is not enabled, this
+--- function returns nil and an error.
+---
+--- Example:
+--- ```lua
+--- rhythm.watch_path("config.json", {"close_write"}, function()
+---     reload_config()
+--- end)
+--- ```
+--- @param path string The path of the file or directory.
+--- @param events? PathEvent[] The events to watch (default: anything that changes the contents).
+--- @param fn PathWatchFn Called with the path, the events and the entry names.
+--- @param windowMs? integer How long to collect events in milliseconds (default 50).
+--- @return integer|nil watchId The ID of the watch, or nil on error.
+--- @return string? err An error message if the path could not be watched.
+function rhythm.watch_path(path, events, fn, windowMs) end
+
+--- Stops a watch added by `rhythm.watch_path()`, dropping events not yet
+--- reported.
+--- @param watchId integer
+--- @return boolean True if the watch was found and removed, false otherwise.
+function rhythm.unwatch_path(watchId) end
+
+--- A function returned by `rhythm.debounce()` or `rhythm.throttle()`.
+--- Calling it triggers the wrapped function; arguments are ignored.
+--- @class Debouncer
+--- @overload fun()
+local Debouncer = {}
+
+--- Drops the pending call, if any.
+--- @return boolean True if a call was pending.
+function Debouncer:cancel() end
+
+--- Makes the pending call now instead of when it is due.
+--- @return boolean True if a call was pending.
+function Debouncer:flush() end
+
+--- Wraps a function so that a burst of triggers calls it once, `ms` after the
+--- last trigger. Each trigger only pushes the pending call back, without
+--- scheduling a new task, so debouncing frequent events is cheap.
+---
+--- Example:
+--- ```lua
+--- local save = rhythm.debounce(500, function(count)
+---     save_state()
+--- end)
+--- on_change(save)
+--- ```
+--- @param ms integer The quiet time before the call in milliseconds.
+--- @param fn fun(count: integer) Called with the number of triggers coalesced.
+--- @return Debouncer
+function rhythm.debounce(ms, fn) end
+
+--- Wraps a function so that it is called at most once every `ms`.
+--- A trigger outside the window calls `fn` right away; triggers inside it are
+--- coalesced into one call at the end of the window.
+--- @param ms integer The minimum time between calls in milliseconds.
+--- @param fn fun(count: integer) Called with the number of triggers coalesced.
+--- @return Debouncer
+function rhythm.throttle(ms, fn) end
+
+--- A token bucket returned by `rhythm.rate_limiter()`.
+--- @class RateLimiter
+local RateLimiter = {}
+
+--- Takes tokens if the bucket has them.
+--- @param tokens? number The tokens to take (default 1).
+--- @return boolean True if the tokens were taken.
+function RateLimiter:take(tokens) end
+
+--- Gets the tokens in the bucket, negative while waiters are owed tokens.
+--- @return number
+function RateLimiter:available() end
+
+--- Takes tokens as soon as they are available, after any earlier waiters.
+--- With a callback, `fn` is scheduled as a task for when the tokens are
+--- there and its ID returned; cancelling it doesn't give the tokens back.
+--- Without one, the calling coroutine is suspended until then.
+---
+--- Example:
+--- ```lua
+--- local limiter = rhythm.rate_limiter(10, 20)
+--- coroutine.wrap(function()
+---     for _, request in ipairs(requests) do
+---         limiter:wait()
+---         send(request)
+---     end
+--- end)()
+--- ```
+--- @param tokens? number The tokens to take (default 1).
+--- @param fn? fun(taskId: integer) Called when the tokens are available.
+--- @return integer? taskId The ID of the task calling `fn`, if given.
+function RateLimiter:wait(tokens, fn) end
+
+--- Creates a token bucket that refills at `rate` tokens per second, holding
+--- up to `burst` tokens. It starts full.
+--- The bucket is refilled lazily from the clock when used, so it needs no
+--- timer, and waiters are scheduled for exactly when their tokens come in.
+--- @param rate number Tokens gained per second.
+--- @param burst number Most tokens the bucket holds.
+--- @return RateLimiter
+function rhythm.rate_limiter(rate, burst) end
+
+--- A value that becomes available later, from `rhythm.future()`.
+--- A future settles once, either resolved with a value or rejected with an
+--- error. Its state lives in a pool in the module, so the future itself is a
+--- small handle and composing futures creates no Lua tables or closures.
+--- @class Future
+local Future = {}
+
+--- Resolves the future with a value.
+--- @param value any
+--- @return boolean True if the future wasn't settled yet.
+function Future:resolve(value) end
+
+--- Rejects the future with an error.
+--- @param err any The error, not nil.
+--- @return boolean True if the future wasn't settled yet.
+function Future:reject(err) end
+
+--- Adds a callback called with the value and error once the future has
+--- settled. Callbacks are queued on the scheduler's ready list and run on the
+--- next tick, also when the future has already settled.
+--- @param fn fun(value: any, err: any)
+--- @return Future self
+function Future:on_done(fn) end
+
+--- Suspends the calling coroutine until the future has settled.
+--- Returns right away if it already has.
+--- @return any value The value, or nil if the future was rejected.
+--- @return any err The error, or nil if the future was resolved.
+function Future:await() end
+
+--- Checks if the future has settled.
+--- @return boolean
+function Future:is_done() end
+
+--- Creates a future, to be settled with `resolve()` or `reject()`.
+---
+--- Example:
+--- ```lua
+--- local ready = rhythm.future()
+--- rhythm.schedule_after(100, function() ready:resolve("done") end)
+--- coroutine.wrap(function()
+---     local value, err = rhythm.timeout(ready, 1000):await()
+--- end)()
+--- ```
+--- @return Future
+function rhythm.future() end
+
+--- Creates a future resolved with the array of the values of all futures once
+--- they have resolved, or rejected with the first error.
+--- @param futures Future[]
+--- @return Future
+function rhythm.all(futures) end
+
+--- Creates a future settled like the first of the futures to settle.
+--- @param futures Future[]
+--- @return Future
+function rhythm.any(futures) end
+
+--- Creates a future settled like `future`, or rejected with "timeout" if it
+--- hasn't settled within `ms` milliseconds.
+--- @param future Future
+--- @param ms integer
+--- @return Future
+function rhythm.timeout(future, ms) end
+
 --- Gets the milliseconds until the next scheduled task.
 --- @return integer|nil The milliseconds until the next task, or nil if no tasks are scheduled.
-function rhythm.get_ms_until_next_task() end
+function rhythm.ms_until_next_task() end
 
 --- Gets the time of the next scheduled task, as returned by os.time().
 --- @return integer|nil The time of the next task, or nil if no tasks are scheduled.
@@ -63,7 +454,47 @@ function rhythm.get_next_task_time() end
 --- @return integer
 function rhythm.get_task_count() end
 
---- @alias SchedulerMetrics { totalRuns: integer, lateRuns: integer, totalRunTimeMs: integer, measurementWindowMs: integer, runTimeFraction: number }
+--- Enables batched dispatch of due tasks.
+--- Instead of calling into Lua once per task, each tick hands all due tasks
+--- scheduled from Lua to a single dispatcher call, which runs them in order.
+--- Errors are still isolated per task. A task cancelled by an earlier task in
+--- the same batch doesn't run. Tasks scheduled through `rhythm_ffi` and idle
+--- callbacks are not batched.
+--- @return nil
+function rhythm.enable_batch_dispatch() end
+
+--- Disables batched dispatch enabled by `rhythm.enable_batch_dispatch()`.
+--- @return nil
+function rhythm.disable_batch_dispatch() end
+
+--- Enables incremental garbage collection while the loop is idle.
+--- When the next task is at least `minIdleMs` away, `rhythm.loop()` performs
+--- bounded `collectgarbage("step", stepSize)` steps in the gap, stopping
+--- before the next task is due or once a full cycle has completed. This moves
+--- collection work out of task execution.
+--- @param stepSize? integer The size of each GC step (default 1).
+--- @param minIdleMs? integer The minimum idle gap in milliseconds needed to start collecting (default 2).
+--- @return nil
+function rhythm.enable_idle_gc(stepSize, minIdleMs) end
+
+--- Disables idle garbage collection enabled by `rhythm.enable_idle_gc()`.
+--- @return nil
+function rhythm.disable_idle_gc() end
+
+--- Gets the module's scheduler as a `rhythm_scheduler*` for the C API in
+--- `rhythm-core.h`, so native code can schedule native callbacks on the same
+--- loop as Lua tasks. The native code must be built against the same version
+--- and configuration of `rhythm_core` as the module.
+--- @return lightuserdata
+function rhythm.get_scheduler_handle() end
+
+--- Gets the context used by the LuaJIT FFI fast path in `rhythm_ffi.lua`.
+--- Prefer `require("rhythm_ffi")` over using this directly.
+--- @return lightuserdata ctx The `rhythm_ffi_context*` for the C API in `lua-rhythm.h`.
+--- @return table<TaskId, TaskFn> funcs The functions of FFI scheduled tasks, keyed by task ID.
+function rhythm.get_ffi_context() end
+
+--- @alias SchedulerMetrics { totalRuns: integer, lateRuns: integer, totalRunTimeMs: integer, measurementWindowMs: integer, runTimeFraction: number, gcSteps: integer, gcFreedBytes: integer, gcTimeMs: integer, tombstoneRatio: number, compactions: integer }
 
 --- Gets metrics about the scheduler's performance.
 --- If RHYTHM_SCHEDULER_METRICS is not enabled, this function returns nil.
@@ -0,0 +1,75 @@
+-- LuaJIT FFI fast path for the rhythm module.
+--
+-- Returns the rhythm module with schedule_after, cancel_task and
+-- ms_until_next_task replaced by versions that call the module's C ABI
+-- through the FFI, so calls to them can be JIT compiled. On interpreters
+-- without the FFI the plain rhythm module is returned.
+--
+-- Example:
+-- ```lua
+-- local rhythm = require("rhythm_ffi")
+-- rhythm.schedule_after(1000, function(taskId) print("Tick!", taskId) end)
+-- ```
+
+local rhythm = require("rhythm")
+
+local hasFfi, ffi = pcall(require, "ffi")
+if not hasFfi then
+	return rhythm
+end
+
+ffi.cdef[[
+typedef struct rhythm_ffi_context rhythm_ffi_context;
+int rhythm_schedule_after_ref(rhythm_ffi_context* ctx, int64_t delay_ms);
+int rhythm_cancel(rhythm_ffi_context* ctx, int id);
+int64_t rhythm_ms_until_next(rhythm_ffi_context* ctx);
+]]
+
+-- Loading the module's path again returns the already loaded library
+local lib = ffi.load(package.searchpath("rhythm", package.cpath))
+
+-- Task functions are stored in funcs, keyed by task ID
+local handle, funcs = rhythm.get_ffi_context()
+local ctx = ffi.cast("rhythm_ffi_context*", handle)
+
+local fast = setmetatable({}, { __index = rhythm })
+
+function fast.schedule_after(delayMs, fn, options)
+	-- Options, like dependencies, are only handled by the plain module
+	if options ~= nil then
+		return rhythm.schedule_after(delayMs, fn, options)
+	end
+	if type(fn) ~= "function" then
+		error("bad argument #2 to 'schedule_after' (function expected)", 2)
+	end
+	if delayMs < 0 then
+		error("Delay must be non-negative", 2)
+	end
+
+	local id = lib.rhythm_schedule_after_ref(ctx, delayMs)
+	funcs[id] = fn
+	return id
+end
+
+function fast.cancel_task(taskId)
+	-- Tasks not scheduled through the FFI are cancelled the classic way
+	if funcs[taskId] == nil then
+		return rhythm.cancel_task(taskId)
+	end
+
+	if lib.rhythm_cancel(ctx, taskId) == 0 then
+		return false
+	end
+	funcs[taskId] = nil
+	return true
+end
+
+function fast.ms_until_next_task()
+	local ms = lib.rhythm_ms_until_next(ctx)
+	if ms < 0 then
+		return nil
+	end
+	return tonumber(ms)
+end
+
+return fast
@@ -0,0 +1,372 @@
+#include "io-ring.hpp"
+
+#ifdef RHYTHM_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+// Operations carry their ID, the slot index in the low half and its
+// generation above. Timeouts and cancellations are told apart by the high
+// bits.
+constexpr std::uint64_t TimeoutTag = std::uint64_t(1) << 63;
+constexpr std::uint64_t RemoveTag = std::uint64_t(1) << 62;
+constexpr std::uint32_t GenerationMask = (1u << 30) - 1;
+
+// Reading and writing need IORING_OP_READ and IORING_OP_WRITE, added in 5.6
+// along with IORING_FEAT_RW_CUR_POS. Without IORING_FEAT_NODROP completions
+// could be lost if many finish between two reaps.
+constexpr unsigned RequiredFeatures =
+	IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+
+template <typename T>
+T* ringField(void* ring, unsigned offset) {
+	return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+}  // namespace
+
+IoRing::~IoRing() {
+	close();
+}
+
+bool IoRing::open(unsigned entries) {
+	close();
+
+	struct io_uring_params params = {};
+	int ringFd = static_cast<int>(
+		::syscall(__NR_io_uring_setup, entries, &params));
+	if (ringFd < 0) {
+		return false;
+	}
+	m_ringFd = ringFd;
+	if ((params.features & RequiredFeatures) != RequiredFeatures) {
+		close();
+		return false;
+	}
+
+	m_sqRingSize =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize =
+		params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap) {
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+	}
+
+	m_sqRing = ::mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		m_sqRing = nullptr;
+		close();
+		return false;
+	}
+	if (singleMmap) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing =
+			::mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			m_cqRing = nullptr;
+			close();
+			return false;
+		}
+	}
+	m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = ::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		m_sqes = nullptr;
+		close();
+		return false;
+	}
+
+	m_sqHead = ringField<unsigned>(m_sqRing, params.sq_off.head);
+	m_sqTail = ringField<unsigned>(m_sqRing, params.sq_off.tail);
+	m_sqArray = ringField<unsigned>(m_sqRing, params.sq_off.array);
+	m_sqMask = *ringField<unsigned>(m_sqRing, params.sq_off.ring_mask);
+	m_sqEntries = params.sq_entries;
+	m_cqHead = ringField<unsigned>(m_cqRing, params.cq_off.head);
+	m_cqTail = ringField<unsigned>(m_cqRing, params.cq_off.tail);
+	m_cqes = ringField<void>(m_cqRing, params.cq_off.cqes);
+	m_cqMask = *ringField<unsigned>(m_cqRing, params.cq_off.ring_mask);
+
+	return true;
+}
+
+void IoRing::close() {
+	if (m_ringFd >= 0 && m_sqes) {
+		// Some may never finish on their own, like polls
+		for (std::uint32_t slot = 0; slot < m_slots.size(); slot++) {
+			if (m_slots[slot].pending) {
+				cancel(std::uint64_t(m_slots[slot].generation) << 32 | slot);
+			}
+		}
+
+		// The kernel may still write to the buffers of operations in flight,
+		// so wait for them before their owners go away
+		while (m_pendingCount > 0) {
+			int result = enter(1, IORING_ENTER_GETEVENTS);
+			if (result < 0 && result != -EINTR) {
+				break;
+			}
+			reap(false);
+		}
+	}
+
+	if (m_sqes) {
+		::munmap(m_sqes, m_sqesSize);
+	}
+	if (m_cqRing && m_cqRing != m_sqRing) {
+		::munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing) {
+		::munmap(m_sqRing, m_sqRingSize);
+	}
+	if (m_ringFd >= 0) {
+		::close(m_ringFd);
+	}
+
+	m_ringFd = -1;
+	m_sqRing = m_cqRing = m_sqes = nullptr;
+	m_sqRingSize = m_cqRingSize = m_sqesSize = 0;
+	m_sqHead = m_sqTail = m_sqArray = m_cqHead = m_cqTail = nullptr;
+	m_cqes = nullptr;
+	m_sqQueued = 0;
+	m_slots.clear();
+	m_freeSlots.clear();
+	m_pendingCount = 0;
+}
+
+IoRing::OpId IoRing::read(int fd,
+				  void* buffer,
+				  std::size_t length,
+				  std::uint64_t offset,
+				  Completion done) {
+	auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+	if (!entry) {
+		return 0;
+	}
+	entry->opcode = IORING_OP_READ;
+	entry->fd = fd;
+	entry->addr = reinterpret_cast<std::uint64_t>(buffer);
+	entry->len = static_cast<std::uint32_t>(
+		std::min<std::size_t>(length, UINT32_MAX));
+	entry->off = offset;
+	return submitOperation(entry, std::move(done));
+}
+
+IoRing::OpId IoRing::write(int fd,
+				   const void* buffer,
+				   std::size_t length,
+				   std::uint64_t offset,
+				   Completion done) {
+	auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+	if (!entry) {
+		return 0;
+	}
+	entry->opcode = IORING_OP_WRITE;
+	entry->fd = fd;
+	entry->addr = reinterpret_cast<std::uint64_t>(buffer);
+	entry->len = static_cast<std::uint32_t>(
+		std::min<std::size_t>(length, UINT32_MAX));
+	entry->off = offset;
+	return submitOperation(entry, std::move(done));
+}
+
+IoRing::OpId IoRing::fsync(int fd, Completion done) {
+	auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+	if (!entry) {
+		return 0;
+	}
+	entry->opcode = IORING_OP_FSYNC;
+	entry->fd = fd;
+	return submitOperation(entry, std::move(done));
+}
+
+IoRing::OpId IoRing::pollOnce(int fd, unsigned events, Completion done) {
+	auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+	if (!entry) {
+		return 0;
+	}
+	entry->opcode = IORING_OP_POLL_ADD;
+	entry->fd = fd;
+	// The 16 bit field is understood by every kernel, unlike poll32_events
+	entry->poll_events = static_cast<std::uint16_t>(events);
+	return submitOperation(entry, std::move(done));
+}
+
+bool IoRing::cancel(OpId id) {
+	auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+	if (!entry) {
+		return false;
+	}
+	entry->opcode = IORING_OP_ASYNC_CANCEL;
+	entry->fd = -1;
+	entry->addr = id;
+	entry->user_data = RemoveTag;
+	enter(0, 0);
+	return true;
+}
+
+std::size_t IoRing::poll() {
+	return isOpen() ? reap() : 0;
+}
+
+std::size_t IoRing::wait(std::chrono::nanoseconds timeout) {
+	if (!isOpen()) {
+		return 0;
+	}
+
+	std::size_t ran = reap();
+	if (ran > 0 || timeout.count() == 0) {
+		return ran;
+	}
+
+	bool timed = timeout.count() > 0;
+	if (timed) {
+		auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+		if (!entry) {
+			return 0;
+		}
+		auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+		m_timeout.sec = seconds.count();
+		m_timeout.nsec = (timeout - seconds).count();
+		m_timedOut = false;
+		entry->opcode = IORING_OP_TIMEOUT;
+		entry->fd = -1;
+		entry->addr = reinterpret_cast<std::uint64_t>(&m_timeout);
+		entry->len = 1;
+		entry->user_data = TimeoutTag | ++m_timeoutSeq;
+	} else if (m_pendingCount == 0) {
+		// Nothing could ever wake us up
+		return 0;
+	}
+
+	for (;;) {
+		// Interrupted by a signal, let the caller handle it
+		if (enter(1, IORING_ENTER_GETEVENTS) < 0) {
+			break;
+		}
+		ran += reap();
+		if (ran > 0 || m_timedOut || (!timed && m_pendingCount == 0)) {
+			break;
+		}
+	}
+
+	if (timed && !m_timedOut) {
+		// Its completion is ignored when it arrives, as the sequence no longer
+		// matches
+		auto* entry = static_cast<struct io_uring_sqe*>(nextEntry());
+		if (entry) {
+			entry->opcode = IORING_OP_TIMEOUT_REMOVE;
+			entry->fd = -1;
+			entry->addr = TimeoutTag | m_timeoutSeq;
+			entry->user_data = RemoveTag;
+			enter(0, 0);
+		}
+	}
+
+	return ran;
+}
+
+void* IoRing::nextEntry() {
+	unsigned tail = *m_sqTail;
+	if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+		// Full, which only happens if earlier submissions failed
+		enter(0, 0);
+		if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+			return nullptr;
+		}
+	}
+
+	unsigned index = tail & m_sqMask;
+	auto* entry = static_cast<struct io_uring_sqe*>(m_sqes) + index;
+	std::memset(entry, 0, sizeof(*entry));
+	m_sqArray[index] = index;
+	// Published right away, the kernel only looks at it once entered
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	++m_sqQueued;
+	return entry;
+}
+
+IoRing::OpId IoRing::submitOperation(void* entry, Completion&& done) {
+	std::uint32_t slot;
+	if (!m_freeSlots.empty()) {
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	} else {
+		slot = static_cast<std::uint32_t>(m_slots.size());
+		m_slots.emplace_back();
+	}
+
+	Slot& pending = m_slots[slot];
+	pending.done = std::move(done);
+	pending.generation = (pending.generation + 1) & GenerationMask;
+	if (pending.generation == 0) {
+		pending.generation = 1;
+	}
+	pending.pending = true;
+	OpId id = std::uint64_t(pending.generation) << 32 | slot;
+	static_cast<struct io_uring_sqe*>(entry)->user_data = id;
+	++m_pendingCount;
+
+	// If this fails the entry stays queued and goes with the next enter
+	enter(0, 0);
+	return id;
+}
+
+int IoRing::enter(unsigned minComplete, unsigned flags) {
+	int result = static_cast<int>(::syscall(__NR_io_uring_enter, m_ringFd,
+											m_sqQueued, minComplete, flags,
+											nullptr, 0));
+	if (result < 0) {
+		return -errno;
+	}
+	m_sqQueued -= std::min(static_cast<unsigned>(result), m_sqQueued);
+	return result;
+}
+
+std::size_t IoRing::reap(bool runCompletions) {
+	std::size_t ran = 0;
+	auto* cqes = static_cast<struct io_uring_cqe*>(m_cqes);
+	for (;;) {
+		// Reloaded each time, as a completion may reap in turn
+		unsigned head = *m_cqHead;
+		if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		struct io_uring_cqe cqe = cqes[head & m_cqMask];
+		__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+
+		if (cqe.user_data & (TimeoutTag | RemoveTag)) {
+			if (cqe.user_data == (TimeoutTag | m_timeoutSeq)) {
+				m_timedOut = true;
+			}
+			continue;
+		}
+
+		auto slot = static_cast<std::uint32_t>(cqe.user_data);
+		Completion done = std::move(m_slots[slot].done);
+		m_slots[slot].done = nullptr;
+		m_slots[slot].pending = false;
+		m_freeSlots.push_back(slot);
+		--m_pendingCount;
+		if (runCompletions && done) {
+			done(cqe.res);
+			++ran;
+		}
+	}
+	return ran;
+}
+
+#endif	// RHYTHM_IO_URING
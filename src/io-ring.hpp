@@ -0,0 +1,168 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "rhythm-config.hpp"
+
+#ifdef RHYTHM_IO_URING
+
+/**
+ * Minimal io_uring instance for asynchronous file I/O and timeouts (Linux
+ * only).
+ *
+ * Operations are submitted as soon as they are queued; their completions run
+ * from `poll()` or `wait()` on the thread that owns the ring. `wait()` uses an
+ * `IORING_OP_TIMEOUT` for its deadline, so a single `io_uring_enter()` both
+ * sleeps until the next deadline and wakes up for completions.
+ */
+class IoRing {
+   public:
+	/**
+	 * Called with the result of an operation: the number of bytes
+	 * transferred, or a negated errno.
+	 */
+	using Completion = std::function<void(int result)>;
+
+	/** Identifies an operation in flight, 0 is never a valid ID. */
+	using OpId = std::uint64_t;
+
+	IoRing() = default;
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+	~IoRing();
+
+	/**
+	 * Create the ring.
+	 * @param entries The size of the submission queue.
+	 * @return True if the ring was created, false if io_uring isn't
+	 * available.
+	 */
+	bool open(unsigned entries = 256);
+
+	/**
+	 * Wait for operations in flight, dropping their completions, and close
+	 * the ring.
+	 */
+	void close();
+
+	bool isOpen() const { return m_ringFd >= 0; }
+
+	/** The ring's descriptor, readable while completions are ready. */
+	int fd() const { return m_ringFd; }
+
+	/**
+	 * Read from a file. The buffer must stay valid until the completion runs.
+	 * @return The ID of the operation, or 0 if it couldn't be submitted.
+	 */
+	OpId read(int fd,
+			  void* buffer,
+			  std::size_t length,
+			  std::uint64_t offset,
+			  Completion done);
+
+	/**
+	 * Write to a file. The buffer must stay valid until the completion runs.
+	 * @return The ID of the operation, or 0 if it couldn't be submitted.
+	 */
+	OpId write(int fd,
+			   const void* buffer,
+			   std::size_t length,
+			   std::uint64_t offset,
+			   Completion done);
+
+	/**
+	 * Flush a file to storage.
+	 * @return The ID of the operation, or 0 if it couldn't be submitted.
+	 */
+	OpId fsync(int fd, Completion done);
+
+	/**
+	 * Wait once for a file to become ready, like `poll()` on a single
+	 * descriptor. The completion gets the ready events.
+	 * @param events The `poll()` events to wait for, like `POLLIN`.
+	 * @return The ID of the operation, or 0 if it couldn't be submitted.
+	 */
+	OpId pollOnce(int fd, unsigned events, Completion done);
+
+	/**
+	 * Cancel an operation in flight. Its completion still runs, with
+	 * `-ECANCELED` unless it finished first. Stale IDs are ignored.
+	 * @return True if the cancellation was submitted.
+	 */
+	bool cancel(OpId id);
+
+	/** Number of operations whose completion hasn't run yet. */
+	std::size_t pendingCount() const { return m_pendingCount; }
+
+	/**
+	 * Run the completions that are ready, without waiting.
+	 * @return The number of completions run.
+	 */
+	std::size_t poll();
+
+	/**
+	 * Wait until a completion is ready or the timeout expires, then run the
+	 * completions that are ready.
+	 * @param timeout The longest time to wait, negative to wait for a
+	 * completion however long it takes.
+	 * @return The number of completions run.
+	 */
+	std::size_t wait(std::chrono::nanoseconds timeout);
+
+   private:
+	// Layout of struct __kernel_timespec
+	struct Timespec {
+		std::int64_t sec;
+		long long nsec;
+	};
+
+	int m_ringFd = -1;
+
+	// Mappings of the rings and submission entries
+	void* m_sqRing = nullptr;
+	std::size_t m_sqRingSize = 0;
+	void* m_cqRing = nullptr;
+	std::size_t m_cqRingSize = 0;
+	void* m_sqes = nullptr;
+	std::size_t m_sqesSize = 0;
+
+	// Fields of the rings shared with the kernel
+	unsigned* m_sqHead = nullptr;
+	unsigned* m_sqTail = nullptr;
+	unsigned* m_sqArray = nullptr;
+	unsigned m_sqMask = 0;
+	unsigned m_sqEntries = 0;
+	unsigned* m_cqHead = nullptr;
+	unsigned* m_cqTail = nullptr;
+	void* m_cqes = nullptr;
+	unsigned m_cqMask = 0;
+
+	// Entries filled in but not yet submitted
+	unsigned m_sqQueued = 0;
+
+	// Operations in flight, by slot. The generation tells apart operations
+	// that used the same slot.
+	struct Slot {
+		Completion done;
+		std::uint32_t generation = 0;
+		bool pending = false;
+	};
+	std::vector<Slot> m_slots;
+	std::vector<std::uint32_t> m_freeSlots;
+	std::size_t m_pendingCount = 0;
+
+	// The timeout of the current wait, read by the kernel on submission
+	Timespec m_timeout = {};
+	std::uint64_t m_timeoutSeq = 0;
+	bool m_timedOut = false;
+
+	void* nextEntry();
+	OpId submitOperation(void* entry, Completion&& done);
+	int enter(unsigned minComplete, unsigned flags);
+	std::size_t reap(bool runCompletions = true);
+};
+
+#endif	// RHYTHM_IO_URING
@@ -0,0 +1,153 @@
+#pragma once
+
+// Differences between the supported Lua versions: 5.1 (and LuaJIT), 5.2, 5.3
+// and 5.4. Where a newer version has a faster primitive it is used, with the
+// 5.1 equivalent as the fallback.
+
+#include <lua.hpp>
+
+#include <cmath>
+#include <limits>
+
+namespace lua_compat {
+
+/**
+ * Register the functions into the table below the `nup` upvalues on top of
+ * the stack, popping the upvalues.
+ */
+inline void setFuncs(lua_State* L, const luaL_Reg* funcs, int nup) {
+#if LUA_VERSION_NUM >= 502
+	luaL_setfuncs(L, funcs, nup);
+#else
+	luaL_openlib(L, nullptr, funcs, nup);
+#endif
+}
+
+/**
+ * Push the registry value stored under a C address.
+ */
+inline void registryGet(lua_State* L, const void* key) {
+#if LUA_VERSION_NUM >= 502
+	lua_rawgetp(L, LUA_REGISTRYINDEX, key);
+#else
+	lua_pushlightuserdata(L, const_cast<void*>(key));
+	lua_rawget(L, LUA_REGISTRYINDEX);
+#endif
+}
+
+/**
+ * Store the value on top of the stack in the registry under a C address,
+ * popping it.
+ */
+inline void registrySet(lua_State* L, const void* key) {
+#if LUA_VERSION_NUM >= 502
+	lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+#else
+	lua_pushlightuserdata(L, const_cast<void*>(key));
+	lua_insert(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+#endif
+}
+
+/**
+ * Create a full userdata of the given size without any user values.
+ */
+inline void* newUserdata(lua_State* L, size_t size) {
+#if LUA_VERSION_NUM >= 504
+	// Skip the user value slot 5.4 allocates by default
+	return lua_newuserdatauv(L, size, 0);
+#else
+	return lua_newuserdata(L, size);
+#endif
+}
+
+/**
+ * Like `luaL_checkinteger`, but numbers with a fractional part are truncated
+ * on every version instead of raising an error on 5.3 and later. NaN,
+ * infinities and numbers out of the range of `lua_Integer` raise an error.
+ */
+inline lua_Integer checkInteger(lua_State* L, int arg) {
+#if LUA_VERSION_NUM >= 503
+	// Integer subtype, no conversion needed
+	if (lua_isinteger(L, arg)) {
+		return lua_tointeger(L, arg);
+	}
+#endif
+	lua_Number number = luaL_checknumber(L, arg);
+
+	// The minimum is a power of two, so it and its negation, one past the
+	// maximum, are exact
+	constexpr lua_Number min =
+		static_cast<lua_Number>(std::numeric_limits<lua_Integer>::min());
+	if (!std::isfinite(number) || number < min || number >= -min) {
+		luaL_argerror(L, arg, "number has no integer representation");
+	}
+	return static_cast<lua_Integer>(number);
+}
+
+/**
+ * Length of the table or string at `index`, without metamethods.
+ */
+inline size_t rawLen(lua_State* L, int index) {
+#if LUA_VERSION_NUM >= 502
+	return static_cast<size_t>(lua_rawlen(L, index));
+#else
+	return lua_objlen(L, index);
+#endif
+}
+
+/**
+ * The userdata at `index` if its metatable is the one registered as `name`,
+ * otherwise null. `luaL_testudata` was added in 5.2.
+ */
+inline void* testUdata(lua_State* L, int index, const char* name) {
+#if LUA_VERSION_NUM >= 502
+	return luaL_testudata(L, index, name);
+#else
+	void* udata = lua_touserdata(L, index);
+	if (!udata || !lua_getmetatable(L, index)) {
+		return nullptr;
+	}
+	luaL_getmetatable(L, name);
+	bool matches = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return matches ? udata : nullptr;
+#endif
+}
+
+/**
+ * Raise an argument error for an unexpected type, `luaL_typerror` was
+ * removed in 5.2.
+ */
+inline int typeError(lua_State* L, int arg, const char* expected) {
+#if LUA_VERSION_NUM >= 502
+	return luaL_argerror(L, arg,
+						 lua_pushfstring(L, "%s expected, got %s", expected,
+										 luaL_typename(L, arg)));
+#else
+	return luaL_typerror(L, arg, expected);
+#endif
+}
+
+/**
+ * Resume a coroutine with the `nargs` arguments on top of its stack.
+ * @param nresults Set to the number of values it yielded or returned, which
+ * are on top of its stack.
+ * @return The status of the coroutine, `LUA_YIELD` if it yielded again.
+ */
+inline int resume(lua_State* co, lua_State* from, int nargs, int* nresults) {
+#if LUA_VERSION_NUM >= 504
+	return lua_resume(co, from, nargs, nresults);
+#else
+#if LUA_VERSION_NUM >= 502
+	int status = lua_resume(co, from, nargs);
+#else
+	(void)from;
+	int status = lua_resume(co, nargs);
+#endif
+	*nresults = lua_gettop(co);
+	return status;
+#endif
+}
+
+}  // namespace lua_compat
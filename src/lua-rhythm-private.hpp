@@ -5,28 +5,107 @@
 
 void lua_pop_extra_args(lua_State* L, int expected);
 
+/**
+ * State behind the opaque rhythm_ffi_context of the FFI fast path.
+ */
+struct rhythm_ffi_context {
+	lua_State* L;
+	Scheduler* scheduler;
+	/** Registry ref of the table of FFI task functions, keyed by task ID */
+	int funcsRef;
+	/** True while an FFI call is running, when the Lua state can't be used */
+	bool inFfiCall;
+};
+
 /**
  * Retrieves the Scheduler instance from the Lua registry.
  * If it doesn't exist, it creates a new one, stores it in the registry, and
  * returns it.
  */
-Scheduler& lua_get_scheduler(lua_State* L);
+Scheduler& lua_create_scheduler(lua_State* L);
+
+/**
+ * Retrieves the Scheduler instance bound as the first upvalue of the running
+ * module function, avoiding a registry lookup per call.
+ * Only valid inside functions registered by `luaopen_rhythm`.
+ */
+inline Scheduler& lua_get_scheduler(lua_State* L) {
+	return *static_cast<Scheduler*>(lua_touserdata(L, lua_upvalueindex(1)));
+}
 
 void call_lua_task_function(lua_State* L, int funcRef, Scheduler::TaskId id);
-void removee_lua_task_function(lua_State* L, int funcRef);
+void removee_lua_task_function(lua_State* L,
+							   int funcRef,
+							   Scheduler::TaskId id);
+
+/**
+ * Runs a batch of due Lua tasks through the batch dispatcher in one call.
+ */
+void call_lua_task_batch(lua_State* L,
+						 const std::vector<Scheduler::BatchEntry>& batch);
+
+/**
+ * Reports an error raised by a task run by the batch dispatcher.
+ */
+int lua_report_task_error(lua_State* L);
+void call_lua_ffi_task_function(rhythm_ffi_context* ctx,
+								Scheduler::TaskId id);
+void remove_lua_ffi_task_function(rhythm_ffi_context* ctx,
+								  Scheduler::TaskId id);
 
 void lua_push_error_func(lua_State* L);
 
+/**
+ * Schedules restored tasks, resolving each entry's key to a function through
+ * the table or function at the given stack index.
+ * @return The number of tasks restored.
+ */
+lua_Integer restore_lua_tasks(
+	lua_State* L,
+	int resolverIndex,
+	const std::vector<Scheduler::SnapshotEntry>& entries);
+
 int lua_schedule_at(lua_State* L);
 int lua_schedule_after(lua_State* L);
 int lua_schedule_every(lua_State* L);
+int lua_schedule_retry(lua_State* L);
 int lua_cancel_task(lua_State* L);
+int lua_touch_task(lua_State* L);
+int lua_set_task_key(lua_State* L);
+int lua_save_snapshot(lua_State* L);
+int lua_load_snapshot(lua_State* L);
+int lua_open_task_log(lua_State* L);
+int lua_close_task_log(lua_State* L);
+int lua_on_idle(lua_State* L);
+int lua_set_idle_options(lua_State* L);
+int lua_set_tombstone_threshold(lua_State* L);
 int lua_tick(lua_State* L);
 int lua_loop(lua_State* L);
 int lua_stop_loop(lua_State* L);
+int lua_run_once(lua_State* L);
+int lua_get_poll_fd(lua_State* L);
+int lua_read_file(lua_State* L);
+int lua_write_file(lua_State* L);
+int lua_fsync(lua_State* L);
+int lua_spawn(lua_State* L);
+int lua_watch_path(lua_State* L);
+int lua_unwatch_path(lua_State* L);
+int lua_debounce(lua_State* L);
+int lua_throttle(lua_State* L);
+int lua_rate_limiter(lua_State* L);
+int lua_future(lua_State* L);
+int lua_all(lua_State* L);
+int lua_any(lua_State* L);
+int lua_timeout(lua_State* L);
 int lua_get_ms_until_next_task(lua_State* L);
 int lua_get_next_task_time(lua_State* L);
 int lua_get_task_count(lua_State* L);
+int lua_get_scheduler_handle(lua_State* L);
+int lua_get_ffi_context(lua_State* L);
+int lua_enable_batch_dispatch(lua_State* L);
+int lua_disable_batch_dispatch(lua_State* L);
+int lua_enable_idle_gc(lua_State* L);
+int lua_disable_idle_gc(lua_State* L);
 
 int lua_get_scheduler_metrics(lua_State* L);
 int lua_reset_scheduler_metrics(lua_State* L);
@@ -1,7 +1,40 @@
 #include "lua-rhythm.h"
 #include "chrono-utils.hpp"
 #include "lauxlib.h"
+#include "lua-compat.hpp"
 #include "lua-rhythm-private.hpp"
+#include "rate-limiter.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <new>
+#include <vector>
+
+#ifdef RHYTHM_IO_URING
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#endif	// RHYTHM_IO_URING
+
+#ifdef RHYTHM_PATH_WATCH
+#include <sys/inotify.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#endif	// RHYTHM_PATH_WATCH
 
 #ifdef RHYTHM_STACK_CHECK
 #define STACK_START(fn_name, nargs)                         \
@@ -21,34 +54,127 @@
 
 static const char* RHYTHM_SCHEDULER_UDATA = "rhythm.scheduler";
 static const char* RHYTHM_SCHEDULER_METATABLE = "rhythm.scheduler_meta";
+static const char* RHYTHM_FFI_CONTEXT_UDATA = "rhythm.ffi_context";
+static const char* RHYTHM_DEBOUNCER_METATABLE = "rhythm.debouncer";
+static const char* RHYTHM_RATE_LIMITER_METATABLE = "rhythm.rate_limiter";
+static const char* RHYTHM_FUTURE_METATABLE = "rhythm.future";
+static const char* RHYTHM_FUTURE_POOL_METATABLE = "rhythm.future_pool";
+// Registry key of the cached debug.traceback, only its address matters
+static const char RHYTHM_TRACEBACK_KEY = 0;
+// Registry keys of the batch dispatcher and the batch it is running
+static const char RHYTHM_DISPATCHER_KEY = 0;
+static const char RHYTHM_BATCH_KEY = 0;
+// Registry key of the table of path watch callbacks, keyed by watch ID
+static const char RHYTHM_WATCHES_KEY = 0;
+// Registry key of the future pool
+static const char RHYTHM_FUTURES_KEY = 0;
+// Registry key of the thread stored callbacks are called on
+static const char RHYTHM_CALLBACK_THREAD_KEY = 0;
+
+// Runs a batch of due tasks, each in its own protected call. Called with
+// the array of task IDs, the table of functions by task ID and the count.
+// Plain Lua 5.1 can't pass arguments through xpcall, so it falls back to
+// pcall without a traceback.
+static const char RHYTHM_BATCH_DISPATCHER[] = R"lua(
+local report, traceback = ...
+local pcall, xpcall = pcall, xpcall
+
+local function identity(value)
+	return value
+end
+
+if select(2, xpcall(identity, traceback, true)) then
+	return function(ids, funcs, count)
+		for i = 1, count do
+			local id = ids[i]
+			local fn = funcs[id]
+			if fn then
+				funcs[id] = nil
+				local ok, err = xpcall(fn, traceback, id)
+				if not ok then
+					report(err)
+				end
+			end
+		end
+	end
+end
+
+return function(ids, funcs, count)
+	for i = 1, count do
+		local id = ids[i]
+		local fn = funcs[id]
+		if fn then
+			funcs[id] = nil
+			local ok, err = pcall(fn, id)
+			if not ok then
+				report(err)
+			end
+		end
+	end
+end
+)lua";
 
 const luaL_Reg rhythm_funcs[] = {
 	{"schedule_at", lua_schedule_at},
 	{"schedule_after", lua_schedule_after},
 	{"schedule_every", lua_schedule_every},
+	{"schedule_retry", lua_schedule_retry},
 	{"cancel_task", lua_cancel_task},
+	{"touch", lua_touch_task},
+	{"set_task_key", lua_set_task_key},
+	{"save_snapshot", lua_save_snapshot},
+	{"load_snapshot", lua_load_snapshot},
+	{"open_task_log", lua_open_task_log},
+	{"close_task_log", lua_close_task_log},
+	{"on_idle", lua_on_idle},
+	{"set_idle_options", lua_set_idle_options},
+	{"set_tombstone_threshold", lua_set_tombstone_threshold},
 	{"tick", lua_tick},
 	{"loop", lua_loop},
 	{"stop_loop", lua_stop_loop},
+	{"run_once", lua_run_once},
+	{"get_poll_fd", lua_get_poll_fd},
+	{"read_file", lua_read_file},
+	{"write_file", lua_write_file},
+	{"fsync", lua_fsync},
+	{"spawn", lua_spawn},
+	{"watch_path", lua_watch_path},
+	{"unwatch_path", lua_unwatch_path},
+	{"debounce", lua_debounce},
+	{"throttle", lua_throttle},
+	{"rate_limiter", lua_rate_limiter},
+	{"future", lua_future},
+	{"all", lua_all},
+	{"any", lua_any},
+	{"timeout", lua_timeout},
 	{"ms_until_next_task", lua_get_ms_until_next_task},
 	{"get_next_task_time", lua_get_next_task_time},
 	{"get_task_count", lua_get_task_count},
+	{"get_scheduler_handle", lua_get_scheduler_handle},
+	{"get_ffi_context", lua_get_ffi_context},
+	{"enable_batch_dispatch", lua_enable_batch_dispatch},
+	{"disable_batch_dispatch", lua_disable_batch_dispatch},
+	{"enable_idle_gc", lua_enable_idle_gc},
+	{"disable_idle_gc", lua_disable_idle_gc},
 	{"get_scheduler_metrics", lua_get_scheduler_metrics},
 	{"reset_scheduler_metrics", lua_reset_scheduler_metrics},
 	{NULL, NULL}  // Sentinel
 };
 
 int luaopen_rhythm(lua_State* L) {
-	STACK_START(luaopen_rhythm, 1);
+	// Drop the arguments from require, the module name and from 5.2 on also
+	// the loader data
+	lua_settop(L, 0);
 
-	// Get the module name from the first argument, popping it after
-	const char* modName = luaL_checkstring(L, 1);
-	lua_pop(L, 1);
+	STACK_START(luaopen_rhythm, 0);
 
 	// Create the module table
 	lua_newtable(L);
 
-	luaL_register(L, nullptr, rhythm_funcs);
+	// Bind the scheduler as an upvalue of every function, so calls reach it
+	// without a registry lookup. The registry keeps it alive.
+	lua_pushlightuserdata(L, &lua_create_scheduler(L));
+	lua_compat::setFuncs(L, rhythm_funcs, 1);
 
 	STACK_END(luaopen_rhythm, 1);
 
@@ -62,8 +188,28 @@ void lua_pop_extra_args(lua_State* L, int expected) {
 	}
 }
 
-Scheduler& lua_get_scheduler(lua_State* L) {
-	STACK_START(lua_get_scheduler, 0);
+// Gets the thread that callbacks stored for later are called on, creating it
+// on first use. They can't be called on the thread that stored them, it may
+// be a coroutine that is suspended or dead by then.
+static lua_State* get_lua_callback_thread(lua_State* L) {
+	STACK_START(get_lua_callback_thread, 0);
+
+	lua_compat::registryGet(L, &RHYTHM_CALLBACK_THREAD_KEY);
+	lua_State* thread = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	if (!thread) {
+		// The registry keeps it alive until the state is closed
+		thread = lua_newthread(L);
+		lua_compat::registrySet(L, &RHYTHM_CALLBACK_THREAD_KEY);
+	}
+
+	STACK_END(get_lua_callback_thread, 0);
+
+	return thread;
+}
+
+Scheduler& lua_create_scheduler(lua_State* L) {
+	STACK_START(lua_create_scheduler, 0);
 
 	// Get the scheduler from the registry if it exists
 	lua_getfield(L, LUA_REGISTRYINDEX, RHYTHM_SCHEDULER_UDATA);
@@ -72,14 +218,15 @@ Scheduler& lua_get_scheduler(lua_State* L) {
 		auto scheduler = *static_cast<Scheduler**>(lua_touserdata(L, -1));
 		lua_pop(L, 1);	// Pop the user data
 
-		STACK_END(lua_get_scheduler, 0);
+		STACK_END(lua_create_scheduler, 0);
 		return *scheduler;
 	} else {
 		// Not found, pop the nil value
 		lua_pop(L, 1);
 
 		// Create the user data to hold the scheduler
-		void** udata = static_cast<void**>(lua_newuserdata(L, sizeof(void*)));
+		void** udata =
+			static_cast<void**>(lua_compat::newUserdata(L, sizeof(void*)));
 
 		// Create the scheduler and store it in the user data
 		*udata = new Scheduler();
@@ -88,11 +235,10 @@ Scheduler& lua_get_scheduler(lua_State* L) {
 		if (luaL_newmetatable(L, RHYTHM_SCHEDULER_METATABLE)) {
 			// It only needs a __gc method for cleanup
 			lua_pushcfunction(L, [](lua_State* L) -> int {
-				// Get the scheduler instance
-				// We can convert it to a pointer directly since the metatable
-				// is only assigned to the scheduler user data
-				auto* scheduler = &lua_get_scheduler(L);
-				delete scheduler;
+				// Get the scheduler instance from the user data being
+				// collected, the metatable is only assigned to the scheduler
+				// user data
+				delete *static_cast<Scheduler**>(lua_touserdata(L, 1));
 
 				return 0;
 			});
@@ -105,7 +251,7 @@ Scheduler& lua_get_scheduler(lua_State* L) {
 		// Store the user data in the registry
 		lua_setfield(L, LUA_REGISTRYINDEX, RHYTHM_SCHEDULER_UDATA);
 
-		STACK_END(lua_get_scheduler, 0);
+		STACK_END(lua_create_scheduler, 0);
 		return *static_cast<Scheduler*>(*udata);
 	}
 }
@@ -134,22 +280,137 @@ void call_lua_task_function(lua_State* L, int funcRef, Scheduler::TaskId id) {
 	STACK_END(scheduled_task, 0);
 }
 
-void removee_lua_task_function(lua_State* L, int funcRef) {
+void removee_lua_task_function(lua_State* L,
+							   int funcRef,
+							   Scheduler::TaskId id) {
 	STACK_START(cleanup_func, 0);
 
 	// Cleanup function to remove the function reference
 	luaL_unref(L, LUA_REGISTRYINDEX, funcRef);
 
+	// Drop the task from a batch that is being dispatched, so a task
+	// cancelled by an earlier one in the same batch doesn't run
+	lua_compat::registryGet(L, &RHYTHM_BATCH_KEY);
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, id);
+	}
+	lua_pop(L, 1);
+
 	STACK_END(cleanup_func, 0);
 }
 
+void call_lua_task_batch(lua_State* L,
+						 const std::vector<Scheduler::BatchEntry>& batch) {
+	STACK_START(call_lua_task_batch, 0);
+
+	// Push the error function
+	lua_push_error_func(L);
+	int errFunc = lua_gettop(L);
+
+	// Keep the batch of an enclosing dispatch to restore it after
+	lua_compat::registryGet(L, &RHYTHM_BATCH_KEY);
+
+	// Push the dispatcher, the task IDs and their functions
+	lua_compat::registryGet(L, &RHYTHM_DISPATCHER_KEY);
+	int count = static_cast<int>(batch.size());
+	lua_createtable(L, count, 0);
+	lua_createtable(L, 0, count);
+	for (int i = 0; i < count; i++) {
+		lua_pushinteger(L, batch[i].id);
+		lua_rawseti(L, -3, i + 1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, batch[i].ref);
+		lua_rawseti(L, -2, batch[i].id);
+	}
+	lua_pushinteger(L, count);
+
+	// Make the functions visible to cleanups run by the batch
+	lua_pushvalue(L, -2);
+	lua_compat::registrySet(L, &RHYTHM_BATCH_KEY);
+
+	if (lua_pcall(L, 3, 0, errFunc) != 0) {
+		const char* err = lua_tostring(L, -1);
+		fprintf(stderr, "Error in batch dispatch: %s\n", err);
+		lua_pop(L, 1);	// Pop error message
+	}
+
+	// Restore the enclosing batch, then remove the error function
+	lua_compat::registrySet(L, &RHYTHM_BATCH_KEY);
+	lua_pop(L, 1);
+
+	STACK_END(call_lua_task_batch, 0);
+}
+
+int lua_report_task_error(lua_State* L) {
+	const char* err = lua_tostring(L, 1);
+	fprintf(stderr, "Error in scheduled task: %s\n",
+			err ? err : "(error object is not a string)");
+	return 0;
+}
+
+void call_lua_ffi_task_function(rhythm_ffi_context* ctx,
+								Scheduler::TaskId id) {
+	lua_State* L = ctx->L;
+
+	STACK_START(call_lua_ffi_task_function, 0);
+
+	// Push the error function
+	lua_push_error_func(L);
+
+	// Push the function from the FFI function table
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->funcsRef);
+	lua_rawgeti(L, -1, id);
+	lua_remove(L, -2);	// Remove the function table
+
+	// Push the task id as the first argument
+	lua_pushinteger(L, id);
+
+	if (lua_pcall(L, 1, 0, -3) != 0) {
+		const char* err = lua_tostring(L, -1);
+		fprintf(stderr, "Error in scheduled task: %s\n", err);
+		lua_pop(L, 1);	// Pop error message
+	}
+
+	// Remove the error function from the stack
+	lua_pop(L, 1);
+
+	STACK_END(call_lua_ffi_task_function, 0);
+}
+
+void remove_lua_ffi_task_function(rhythm_ffi_context* ctx,
+								  Scheduler::TaskId id) {
+	// During an FFI call the shim clears the function itself
+	if (ctx->inFfiCall) {
+		return;
+	}
+
+	lua_State* L = ctx->L;
+
+	STACK_START(remove_lua_ffi_task_function, 0);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->funcsRef);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, id);
+	lua_pop(L, 1);
+
+	STACK_END(remove_lua_ffi_task_function, 0);
+}
+
 void lua_push_error_func(lua_State* L) {
 	STACK_START(lua_push_error_func, 0);
 
-	// Push debug.traceback function
-	lua_getglobal(L, "debug");
-	lua_getfield(L, -1, "traceback");
-	lua_remove(L, -2);	// Remove 'debug' table, leaving only the function
+	// Push debug.traceback, cached in the registry after the first lookup
+	lua_compat::registryGet(L, &RHYTHM_TRACEBACK_KEY);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+
+		lua_getglobal(L, "debug");
+		lua_getfield(L, -1, "traceback");
+		lua_remove(L, -2);	// Remove 'debug' table, leaving only the function
+
+		lua_pushvalue(L, -1);
+		lua_compat::registrySet(L, &RHYTHM_TRACEBACK_KEY);
+	}
 
 	STACK_END(lua_push_error_func, 1);
 }
@@ -161,7 +422,8 @@ int lua_schedule_at(lua_State* L) {
 	STACK_START(lua_schedule_at, 2);
 
 	// Get the time (as time_t)
-	std::time_t time = static_cast<std::time_t>(luaL_checkinteger(L, 1));
+	std::time_t time =
+		static_cast<std::time_t>(lua_compat::checkInteger(L, 1));
 	Scheduler::TimePoint tp = chrono_utils::time_t_to_steady(time);
 
 	// Store the function as a ref in the registry and get its reference ID
@@ -178,8 +440,9 @@ int lua_schedule_at(lua_State* L) {
 			call_lua_task_function(L, funcRef, id);
 		},
 		[L, funcRef](Scheduler::TaskId id) {
-			removee_lua_task_function(L, funcRef);
-		});
+			removee_lua_task_function(L, funcRef, id);
+		},
+		funcRef);
 
 	// Return the task ID
 	lua_pushinteger(L, taskId);
@@ -190,18 +453,48 @@ int lua_schedule_at(lua_State* L) {
 }
 
 int lua_schedule_after(lua_State* L) {
-	lua_pop_extra_args(L, 2);
+	// The options are optional, make them nil if they are missing
+	lua_settop(L, 3);
+
+	STACK_START(lua_schedule_after, 3);
 
-	STACK_START(lua_schedule_after, 2);
+	// STACK: delayMs, function, options
 
 	// Get the delay in milliseconds
-	lua_Integer delayMs = luaL_checkinteger(L, 1);
+	lua_Integer delayMs = lua_compat::checkInteger(L, 1);
 	if (delayMs < 0) {
 		luaL_error(L, "Delay must be non-negative");
 	}
 	Scheduler::DurationMs tp(delayMs);
 
+	// Get the tasks to wait for, if any
+	bool hasPredecessors = false;
+	std::vector<Scheduler::TaskId> predecessors;
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "after");
+		hasPredecessors = !lua_isnil(L, -1);
+		if (hasPredecessors) {
+			if (!lua_istable(L, -1)) {
+				luaL_argerror(L, 3, "after must be a table of task IDs");
+			}
+			std::size_t count = lua_compat::rawLen(L, -1);
+			predecessors.reserve(count);
+			for (std::size_t i = 1; i <= count; i++) {
+				lua_rawgeti(L, -1, static_cast<int>(i));
+				if (lua_type(L, -1) != LUA_TNUMBER) {
+					luaL_argerror(L, 3, "after must be a table of task IDs");
+				}
+				predecessors.push_back(
+					static_cast<Scheduler::TaskId>(lua_tointeger(L, -1)));
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
 	// Store the function as a ref in the registry and get its reference ID
+	lua_settop(L, 2);
 	int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
 
 	// Pop the delay (Stack should be empty now)
@@ -209,14 +502,17 @@ int lua_schedule_after(lua_State* L) {
 
 	// Schedule the task
 	Scheduler& scheduler = lua_get_scheduler(L);
-	Scheduler::TaskId taskId = scheduler.scheduleAfter(
-		tp,
-		[L, funcRef](Scheduler::TaskId id) {
-			call_lua_task_function(L, funcRef, id);
-		},
-		[L, funcRef](Scheduler::TaskId id) {
-			removee_lua_task_function(L, funcRef);
-		});
+	lua_State* thread = get_lua_callback_thread(L);
+	auto func = [thread, funcRef](Scheduler::TaskId id) {
+		call_lua_task_function(thread, funcRef, id);
+	};
+	auto cleanup = [thread, funcRef](Scheduler::TaskId id) {
+		removee_lua_task_function(thread, funcRef, id);
+	};
+	Scheduler::TaskId taskId =
+		hasPredecessors ? scheduler.scheduleAfterTasks(predecessors, tp, func,
+														cleanup, funcRef)
+						: scheduler.scheduleAfter(tp, func, cleanup, funcRef);
 
 	// Return the task ID
 	lua_pushinteger(L, taskId);
@@ -232,7 +528,7 @@ int lua_schedule_every(lua_State* L) {
 	// STACK: function, intervalMs, [runImmediately]
 
 	// Get the delay in milliseconds
-	lua_Integer delayMs = luaL_checkinteger(L, 1);
+	lua_Integer delayMs = lua_compat::checkInteger(L, 1);
 	if (delayMs < 0) {
 		luaL_error(L, "Delay must be non-negative");
 	}
@@ -259,9 +555,9 @@ int lua_schedule_every(lua_State* L) {
 			call_lua_task_function(L, funcRef, id);
 		},
 		[L, funcRef](Scheduler::TaskId id) {
-			removee_lua_task_function(L, funcRef);
+			removee_lua_task_function(L, funcRef, id);
 		},
-		runImmediately);
+		runImmediately, false, funcRef);
 
 	// Return the task ID
 	lua_pushinteger(L, taskId);
@@ -271,6 +567,110 @@ int lua_schedule_every(lua_State* L) {
 	return 1;
 }
 
+// Makes an attempt of a retried task, returning whether it succeeded. Errors
+// are reported and count as failed attempts.
+static bool call_lua_retry_function(lua_State* L,
+									int funcRef,
+									Scheduler::TaskId id,
+									unsigned int attempt) {
+	STACK_START(call_lua_retry_function, 0);
+
+	lua_push_error_func(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, funcRef);
+	lua_pushinteger(L, id);
+	lua_pushinteger(L, attempt);
+
+	bool succeeded = false;
+	if (lua_pcall(L, 2, 1, -4) != 0) {
+		const char* err = lua_tostring(L, -1);
+		fprintf(stderr, "Error in retried task: %s\n", err);
+	} else {
+		succeeded = lua_toboolean(L, -1);
+	}
+	lua_pop(L, 2);	// Pop the result or error message, and the error function
+
+	STACK_END(call_lua_retry_function, 0);
+
+	return succeeded;
+}
+
+// Gets an optional number from the options table at index 2
+static double get_lua_retry_option(lua_State* L,
+								   const char* name,
+								   double defaultValue) {
+	lua_getfield(L, 2, name);
+	double value = defaultValue;
+	if (!lua_isnil(L, -1)) {
+		if (lua_type(L, -1) != LUA_TNUMBER) {
+			lua_pushfstring(L, "%s must be a number", name);
+			luaL_argerror(L, 2, lua_tostring(L, -1));
+		}
+		value = lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+	return value;
+}
+
+int lua_schedule_retry(lua_State* L) {
+	// The options are optional, make them nil if they are missing
+	lua_settop(L, 2);
+
+	STACK_START(lua_schedule_retry, 2);
+
+	// STACK: function, options
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	Scheduler::RetryOptions options;
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		double base = get_lua_retry_option(L, "base", options.base.count());
+		double factor = get_lua_retry_option(L, "factor", options.factor);
+		double maxDelay =
+			get_lua_retry_option(L, "max_delay", options.maxDelay.count());
+		double maxAttempts = get_lua_retry_option(L, "max_attempts", 0);
+		double jitter = get_lua_retry_option(L, "jitter", options.jitter);
+		luaL_argcheck(L, base >= 0 && maxDelay >= 0, 2,
+					  "delays must be non-negative");
+		luaL_argcheck(L, factor >= 1, 2, "factor must be at least 1");
+		luaL_argcheck(L, maxAttempts >= 0, 2,
+					  "max_attempts must be non-negative");
+		luaL_argcheck(L, jitter >= 0 && jitter <= 1, 2,
+					  "jitter must be between 0 and 1");
+
+		options.base =
+			Scheduler::DurationMs(static_cast<Scheduler::DurationMs::rep>(base));
+		options.factor = factor;
+		options.maxDelay = Scheduler::DurationMs(
+			static_cast<Scheduler::DurationMs::rep>(maxDelay));
+		options.maxAttempts = static_cast<unsigned int>(maxAttempts);
+		options.jitter = jitter;
+	}
+
+	// Store the function as a ref in the registry and get its reference ID
+	lua_settop(L, 1);
+	int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	// Schedule the task, never batched since its result is needed
+	Scheduler& scheduler = lua_get_scheduler(L);
+	lua_State* thread = get_lua_callback_thread(L);
+	Scheduler::TaskId taskId = scheduler.scheduleRetry(
+		[thread, funcRef](Scheduler::TaskId id, unsigned int attempt) {
+			return call_lua_retry_function(thread, funcRef, id, attempt);
+		},
+		options,
+		[thread, funcRef](Scheduler::TaskId id) {
+			removee_lua_task_function(thread, funcRef, id);
+		});
+
+	// Return the task ID
+	lua_pushinteger(L, taskId);
+
+	STACK_END(lua_schedule_retry, 1);
+
+	return 1;
+}
+
 int lua_cancel_task(lua_State* L) {
 	lua_pop_extra_args(L, 1);
 
@@ -292,97 +692,2417 @@ int lua_cancel_task(lua_State* L) {
 	return 1;
 }
 
-int lua_tick(lua_State* L) {
-	lua_pop_extra_args(L, 0);
+int lua_touch_task(lua_State* L) {
+	lua_pop_extra_args(L, 1);
 
-	STACK_START(lua_tick, 0);
+	STACK_START(lua_touch_task, 1);
+
+	// Get the task ID
+	Scheduler::TaskId taskId =
+		static_cast<Scheduler::TaskId>(luaL_checkinteger(L, 1));
+	lua_pop(L, 1);
 
+	// Push the task's deadline back
 	Scheduler& scheduler = lua_get_scheduler(L);
-	scheduler.tick();
+	bool success = scheduler.touchTask(taskId);
 
-	STACK_END(lua_tick, 0);
+	lua_pushboolean(L, success);
 
-	return 0;
+	STACK_END(lua_touch_task, 1);
+
+	return 1;
 }
 
-int lua_loop(lua_State* L) {
-	lua_pop_extra_args(L, 0);
+lua_Integer restore_lua_tasks(
+	lua_State* L,
+	int resolverIndex,
+	const std::vector<Scheduler::SnapshotEntry>& entries) {
+	STACK_START(restore_lua_tasks, 0);
 
-	STACK_START(lua_loop, 0);
+	bool resolverIsTable = lua_istable(L, resolverIndex);
 
 	Scheduler& scheduler = lua_get_scheduler(L);
-	bool keepRunning = scheduler.loop();
+	lua_State* thread = get_lua_callback_thread(L);
+	lua_Integer restored = 0;
+	for (const Scheduler::SnapshotEntry& entry : entries) {
+		// Resolve the key to the task's function
+		if (resolverIsTable) {
+			lua_pushlstring(L, entry.key.data(), entry.key.size());
+			lua_gettable(L, resolverIndex);
+		} else {
+			lua_pushvalue(L, resolverIndex);
+			lua_pushlstring(L, entry.key.data(), entry.key.size());
+			lua_call(L, 1, 1);
+		}
 
-	lua_pushboolean(L, keepRunning);
+		// Skip tasks whose key is no longer known
+		if (!lua_isfunction(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
 
-	STACK_END(lua_loop, 1);
+		// Store the function as a ref in the registry and get its reference
+		int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+		scheduler.restoreTask(
+			entry,
+			[thread, funcRef](Scheduler::TaskId id) {
+				call_lua_task_function(thread, funcRef, id);
+			},
+			[thread, funcRef](Scheduler::TaskId id) {
+				removee_lua_task_function(thread, funcRef, id);
+			},
+			funcRef);
+		restored++;
+	}
+
+	STACK_END(restore_lua_tasks, 0);
+
+	return restored;
+}
+
+int lua_set_task_key(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_set_task_key, 2);
+
+	// Get the task ID and key
+	Scheduler::TaskId taskId =
+		static_cast<Scheduler::TaskId>(luaL_checkinteger(L, 1));
+	size_t keyLength;
+	const char* key = luaL_checklstring(L, 2, &keyLength);
+	if (keyLength == 0 || keyLength > Scheduler::MaxKeyLength) {
+		luaL_argerror(L, 2, "key must be 1 to 65535 bytes long");
+	}
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	bool success = scheduler.setTaskKey(taskId, std::string(key, keyLength));
+
+	lua_pop(L, 2);
+	lua_pushboolean(L, success);
+
+	STACK_END(lua_set_task_key, 1);
 
 	return 1;
 }
 
-int lua_stop_loop(lua_State* L) {
+int lua_save_snapshot(lua_State* L) {
+	lua_pop_extra_args(L, 1);
+
+	STACK_START(lua_save_snapshot, 1);
+
+	const char* path = luaL_checkstring(L, 1);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	if (!scheduler.saveSnapshot(path)) {
+		lua_pushboolean(L, false);
+		lua_pushfstring(L, "Failed to save snapshot to '%s'", path);
+		lua_remove(L, 1);  // Remove the path
+
+		STACK_END(lua_save_snapshot, 2);
+		return 2;
+	}
+
+	lua_pop(L, 1);
+	lua_pushboolean(L, true);
+
+	STACK_END(lua_save_snapshot, 1);
+
+	return 1;
+}
+
+int lua_load_snapshot(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_load_snapshot, 2);
+
+	// STACK: path, resolver
+
+	const char* path = luaL_checkstring(L, 1);
+	if (!lua_istable(L, 2) && !lua_isfunction(L, 2)) {
+		lua_compat::typeError(L, 2, "table or function");
+	}
+
+	std::vector<Scheduler::SnapshotEntry> entries;
+	if (!Scheduler::loadSnapshot(path, entries)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Failed to load snapshot from '%s'", path);
+		lua_remove(L, 1);  // Remove the path
+		lua_remove(L, 1);  // Remove the resolver
+
+		STACK_END(lua_load_snapshot, 2);
+		return 2;
+	}
+
+	lua_Integer restored = restore_lua_tasks(L, 2, entries);
+
+	// Return the number of restored tasks
+	lua_pop(L, 2);
+	lua_pushinteger(L, restored);
+
+	STACK_END(lua_load_snapshot, 1);
+
+	return 1;
+}
+
+int lua_open_task_log(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_open_task_log, 2);
+
+	// STACK: path, resolver
+
+	const char* path = luaL_checkstring(L, 1);
+	if (!lua_istable(L, 2) && !lua_isfunction(L, 2)) {
+		lua_compat::typeError(L, 2, "table or function");
+	}
+
+#ifdef RHYTHM_TASK_LOG
+	Scheduler& scheduler = lua_get_scheduler(L);
+	std::vector<Scheduler::SnapshotEntry> pending;
+	if (scheduler.openTaskLog(path, pending)) {
+		lua_Integer restored = restore_lua_tasks(L, 2, pending);
+
+		// Return the number of restored tasks
+		lua_pop(L, 2);
+		lua_pushinteger(L, restored);
+
+		STACK_END(lua_open_task_log, 1);
+		return 1;
+	}
+
+	lua_pushnil(L);
+	lua_pushfstring(L, "Failed to open task log '%s'", path);
+#else
+	(void)path;
+	lua_pushnil(L);
+	lua_pushliteral(L, "Task log support is not enabled");
+#endif	// RHYTHM_TASK_LOG
+
+	lua_remove(L, 1);  // Remove the path
+	lua_remove(L, 1);  // Remove the resolver
+
+	STACK_END(lua_open_task_log, 2);
+
+	return 2;
+}
+
+int lua_close_task_log(lua_State* L) {
 	lua_pop_extra_args(L, 0);
 
-	STACK_START(lua_stop_loop, 0);
+	STACK_START(lua_close_task_log, 0);
 
+#ifdef RHYTHM_TASK_LOG
 	Scheduler& scheduler = lua_get_scheduler(L);
-	scheduler.stopLoop();
+	scheduler.closeTaskLog();
+#endif	// RHYTHM_TASK_LOG
 
-	STACK_END(lua_stop_loop, 0);
+	STACK_END(lua_close_task_log, 0);
 
 	return 0;
 }
 
-int lua_get_ms_until_next_task(lua_State* L) {
-	lua_pop_extra_args(L, 0);
+int lua_on_idle(lua_State* L) {
+	lua_pop_extra_args(L, 1);
 
-	STACK_START(lua_get_ms_until_next_task, 0);
+	STACK_START(lua_on_idle, 1);
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	// Store the function as a ref in the registry and get its reference ID
+	// (Stack should be empty now)
+	int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
 
+	// Add the idle callback
 	Scheduler& scheduler = lua_get_scheduler(L);
-	auto msOpt = scheduler.timeUntilNextTask();
-	if (msOpt) {
-		lua_pushinteger(L, msOpt->count());
-	} else {
-		lua_pushnil(L);
+	lua_State* thread = get_lua_callback_thread(L);
+	Scheduler::TaskId taskId = scheduler.addIdleCallback(
+		[thread, funcRef](Scheduler::TaskId id) {
+			call_lua_task_function(thread, funcRef, id);
+		},
+		[thread, funcRef](Scheduler::TaskId id) {
+			removee_lua_task_function(thread, funcRef, id);
+		});
+
+	// Return the callback ID
+	lua_pushinteger(L, taskId);
+
+	STACK_END(lua_on_idle, 1);
+
+	return 1;
+}
+
+int lua_set_idle_options(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_set_idle_options, 2);
+
+	// Get the horizon and budget in milliseconds
+	lua_Integer horizonMs = lua_compat::checkInteger(L, 1);
+	if (horizonMs < 0) {
+		luaL_error(L, "Horizon must be non-negative");
+	}
+	lua_Integer budgetMs = lua_compat::checkInteger(L, 2);
+	if (budgetMs < 0) {
+		luaL_error(L, "Budget must be non-negative");
 	}
+	lua_pop(L, 2);
 
-	STACK_END(lua_get_ms_until_next_task, 1);
+	Scheduler& scheduler = lua_get_scheduler(L);
+	scheduler.setIdleOptions(Scheduler::DurationMs(horizonMs),
+							 Scheduler::DurationMs(budgetMs));
+
+	STACK_END(lua_set_idle_options, 0);
 
 	return 0;
 }
 
-int lua_get_next_task_time(lua_State* L) {
-	lua_pop_extra_args(L, 0);
+int lua_set_tombstone_threshold(lua_State* L) {
+	lua_pop_extra_args(L, 1);
 
-	STACK_START(lua_get_next_task_time, 0);
+	STACK_START(lua_set_tombstone_threshold, 1);
 
-	Scheduler& scheduler = lua_get_scheduler(L);
-	auto tpOpt = scheduler.nextTaskTime();
-	if (tpOpt) {
-		std::time_t t = chrono_utils::steady_to_time_t(*tpOpt);
-		lua_pushinteger(L, static_cast<lua_Integer>(t));
-	} else {
-		lua_pushnil(L);
+	// Get the fraction of tombstones that triggers compaction
+	lua_Number fraction = luaL_checknumber(L, 1);
+	if (fraction < 0 || fraction > 1) {
+		luaL_argerror(L, 1, "fraction must be between 0 and 1");
 	}
+	lua_pop(L, 1);
 
-	STACK_END(lua_get_next_task_time, 1);
+	Scheduler& scheduler = lua_get_scheduler(L);
+	scheduler.setTombstoneThreshold(fraction);
 
-	return 1;
+	STACK_END(lua_set_tombstone_threshold, 0);
+
+	return 0;
 }
 
-int lua_get_task_count(lua_State* L) {
+int lua_tick(lua_State* L) {
 	lua_pop_extra_args(L, 0);
 
-	STACK_START(lua_get_task_count, 0);
+	STACK_START(lua_tick, 0);
 
 	Scheduler& scheduler = lua_get_scheduler(L);
-	lua_pushinteger(L, static_cast<lua_Integer>(scheduler.taskCount()));
+	scheduler.tick();
 
-	STACK_END(lua_get_task_count, 1);
+	STACK_END(lua_tick, 0);
+
+	return 0;
+}
+
+int lua_loop(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_loop, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	bool keepRunning = scheduler.loop();
+
+	lua_pushboolean(L, keepRunning);
+
+	STACK_END(lua_loop, 1);
+
+	return 1;
+}
+
+int lua_stop_loop(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_stop_loop, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	scheduler.stopLoop();
+
+	STACK_END(lua_stop_loop, 0);
+
+	return 0;
+}
+
+int lua_run_once(lua_State* L) {
+	lua_pop_extra_args(L, 1);
+
+	STACK_START(lua_run_once, 1);
+
+	// Get the longest time to wait, not waiting by default
+	lua_Integer maxWaitMs = 0;
+	if (!lua_isnoneornil(L, 1)) {
+		maxWaitMs = lua_compat::checkInteger(L, 1);
+		if (maxWaitMs < 0) {
+			luaL_error(L, "Wait must be non-negative");
+		}
+	}
+	lua_pop(L, 1);
+
+	// Wait and run the due tasks
+	Scheduler& scheduler = lua_get_scheduler(L);
+	std::size_t ran = scheduler.runOnce(Scheduler::DurationMs(maxWaitMs));
+
+	// Return the tasks run and when the host should call again
+	lua_pushinteger(L, static_cast<lua_Integer>(ran));
+	auto msOpt = scheduler.timeUntilNextTask();
+	if (msOpt) {
+		lua_pushinteger(L, msOpt->count());
+	} else {
+		lua_pushnil(L);
+	}
+
+	STACK_END(lua_run_once, 2);
+
+	return 2;
+}
+
+int lua_get_poll_fd(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_get_poll_fd, 0);
+
+#ifdef RHYTHM_POLL_FD
+	Scheduler& scheduler = lua_get_scheduler(L);
+	int fd = scheduler.pollFd();
+	if (fd >= 0) {
+		lua_pushinteger(L, fd);
+	} else {
+		lua_pushnil(L);
+	}
+#else
+	// Not supported on this platform
+	lua_pushnil(L);
+#endif	// RHYTHM_POLL_FD
+
+	STACK_END(lua_get_poll_fd, 1);
+
+	return 1;
+}
+
+// Calls the function below the `nargs` arguments on top of the stack in a
+// protected call, reporting errors as coming from `source`
+static void pcall_lua_function(lua_State* L, int nargs, const char* source) {
+	// The function and its arguments
+	int nvalues = nargs + 1;
+	STACK_START(pcall_lua_function, nvalues);
+
+	// Put the error function below the function
+	lua_push_error_func(L);
+	lua_insert(L, -nargs - 2);
+
+	if (lua_pcall(L, nargs, 0, -nargs - 2) != 0) {
+		const char* err = lua_tostring(L, -1);
+		fprintf(stderr, "Error in %s: %s\n", source, err);
+		lua_pop(L, 1);	// Pop error message
+	}
+
+	// Remove the error function from the stack
+	lua_pop(L, 1);
+
+	STACK_END(pcall_lua_function, 0);
+}
+
+// Calls the function referenced by `ref` with the `nargs` arguments on top of
+// the stack, see `pcall_lua_function()`
+static void call_lua_callback(lua_State* L,
+							  int ref,
+							  int nargs,
+							  const char* source) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	lua_insert(L, -nargs - 1);
+	pcall_lua_function(L, nargs, source);
+}
+
+// Resumes the suspended coroutine `L` with the `nargs` values on top of its
+// stack, reporting an error if it fails
+static void resume_lua_coroutine(lua_State* L, int nargs) {
+	STACK_START(resume_lua_coroutine, nargs);
+
+	int nresults = 0;
+	int status = lua_compat::resume(L, nullptr, nargs, &nresults);
+	if (status == 0 || status == LUA_YIELD) {
+		// Finished, or waiting for something else
+		lua_pop(L, nresults);
+	} else {
+		const char* err = lua_tostring(L, -1);
+		fprintf(stderr, "Error in coroutine: %s\n",
+				err ? err : "(error object is not a string)");
+		lua_pop(L, 1);	// Pop error message
+	}
+
+	STACK_END(resume_lua_coroutine, 0);
+}
+
+#ifdef RHYTHM_IO_URING
+
+enum class LuaFileOpKind { Read, Write, Fsync };
+
+// Read buffer growth when the size of a file isn't known up front
+static const std::size_t LUA_FILE_READ_CHUNK = 64 * 1024;
+
+// A file operation in flight, kept alive by the completion of its current
+// step
+struct LuaFileOp {
+	// Thread the callback is called on, or the coroutine waiting for the
+	// result
+	lua_State* L;
+	IoRing* ring;
+	LuaFileOpKind kind;
+	std::string path;
+	int fd = -1;
+	// Registry ref of the callback, or of the coroutine waiting for the result
+	int ref = LUA_NOREF;
+	bool hasCallback = false;
+	// Data read so far, or to write, and the bytes transferred
+	std::string data;
+	std::size_t done = 0;
+
+	~LuaFileOp() {
+		// Only still open if the ring was closed with the operation in flight
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+};
+
+static bool step_lua_file_op(const std::shared_ptr<LuaFileOp>& op);
+
+static int push_lua_file_op_result(lua_State* L,
+								   const LuaFileOp& op,
+								   int result) {
+	if (result < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", op.path.c_str(), std::strerror(-result));
+		return 2;
+	}
+
+	if (op.kind == LuaFileOpKind::Read) {
+		lua_pushlstring(L, op.data.data(), op.data.size());
+	} else {
+		lua_pushboolean(L, 1);
+	}
+	return 1;
+}
+
+// Closes the file and delivers the result, to the callback or by resuming the
+// waiting coroutine
+static void finish_lua_file_op(LuaFileOp& op, int result) {
+	::close(op.fd);
+	op.fd = -1;
+
+	lua_State* L = op.L;
+
+	STACK_START(finish_lua_file_op, 0);
+
+	if (op.hasCallback) {
+		int nargs = push_lua_file_op_result(L, op, result);
+		call_lua_callback(L, op.ref, nargs, "file operation callback");
+		luaL_unref(L, LUA_REGISTRYINDEX, op.ref);
+	} else {
+		// The results of the yielding call go straight onto the coroutine's
+		// stack, the registry keeps it alive until it is resumed
+		int nargs = push_lua_file_op_result(L, op, result);
+		resume_lua_coroutine(L, nargs);
+		luaL_unref(L, LUA_REGISTRYINDEX, op.ref);
+	}
+
+	STACK_END(finish_lua_file_op, 0);
+}
+
+static void on_lua_file_op_step(const std::shared_ptr<LuaFileOp>& op,
+								int result) {
+	if (result < 0) {
+		finish_lua_file_op(*op, result);
+		return;
+	}
+
+	// Loop on short reads and writes until the whole file is transferred
+	op->done += static_cast<std::size_t>(result);
+	switch (op->kind) {
+		case LuaFileOpKind::Read:
+			if (result == 0) {
+				op->data.resize(op->done);
+				finish_lua_file_op(*op, 0);
+				return;
+			}
+			break;
+		case LuaFileOpKind::Write:
+			if (op->done >= op->data.size()) {
+				finish_lua_file_op(*op, 0);
+				return;
+			}
+			break;
+		case LuaFileOpKind::Fsync:
+			finish_lua_file_op(*op, 0);
+			return;
+	}
+
+	if (!step_lua_file_op(op)) {
+		finish_lua_file_op(*op, -EAGAIN);
+	}
+}
+
+// Submits the next step of the operation
+static bool step_lua_file_op(const std::shared_ptr<LuaFileOp>& op) {
+	auto done = [op](int result) { on_lua_file_op_step(op, result); };
+	switch (op->kind) {
+		case LuaFileOpKind::Read:
+			// Read until end of file, so a file that grew is read whole
+			if (op->done == op->data.size()) {
+				op->data.resize(op->done +
+								std::max(op->done, LUA_FILE_READ_CHUNK));
+			}
+			return op->ring->read(op->fd, &op->data[op->done],
+								  op->data.size() - op->done, op->done, done);
+		case LuaFileOpKind::Write:
+			return op->ring->write(op->fd, op->data.data() + op->done,
+								   op->data.size() - op->done, op->done, done);
+		case LuaFileOpKind::Fsync:
+			return op->ring->fsync(op->fd, done);
+	}
+	return false;
+}
+
+// Opens the file and starts the operation, which completes through the
+// callback at `callbackIndex`, or if it is 0 by resuming the calling
+// coroutine. Replaces the stack with the results and returns their count, or
+// returns -1 if the caller has to yield.
+static int start_lua_file_op(lua_State* L,
+							 LuaFileOpKind kind,
+							 const char* path,
+							 int callbackIndex,
+							 const char* data,
+							 std::size_t length) {
+	bool isMainThread = lua_pushthread(L) == 1;
+	lua_pop(L, 1);
+	if (!callbackIndex && isMainThread) {
+		luaL_error(L, "A callback is needed outside of a coroutine");
+	}
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	IoRing* ring = scheduler.ioRing();
+	if (!ring) {
+		lua_settop(L, 0);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Async file I/O is not available");
+		return 2;
+	}
+
+	int flags = kind == LuaFileOpKind::Write ? O_WRONLY | O_CREAT | O_TRUNC
+											 : O_RDONLY;
+	int fd = ::open(path, flags | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		int error = errno;
+		lua_settop(L, 0);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, std::strerror(error));
+		return 2;
+	}
+
+	auto op = std::make_shared<LuaFileOp>();
+	op->L = callbackIndex ? get_lua_callback_thread(L) : L;
+	op->ring = ring;
+	op->kind = kind;
+	op->path = path;
+	op->fd = fd;
+	if (kind == LuaFileOpKind::Read) {
+		// One byte more than the size, so the first read can't fill it and
+		// the second one finds the end of the file
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+			op->data.resize(static_cast<std::size_t>(st.st_size) + 1);
+		}
+	} else if (kind == LuaFileOpKind::Write) {
+		op->data.assign(data, length);
+	}
+
+	// Writing nothing only needs the file truncated, a coroutine can have
+	// the result right away. A callback is still called from the ring,
+	// after an empty write, like for any other write.
+	if (kind == LuaFileOpKind::Write && length == 0 && !callbackIndex) {
+		::close(fd);
+		op->fd = -1;
+		lua_settop(L, 0);
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	op->hasCallback = callbackIndex != 0;
+	if (op->hasCallback) {
+		lua_pushvalue(L, callbackIndex);
+	} else {
+		lua_pushthread(L);
+	}
+	op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lua_settop(L, 0);
+	if (!step_lua_file_op(op)) {
+		luaL_unref(L, LUA_REGISTRYINDEX, op->ref);
+		int nresults = push_lua_file_op_result(L, *op, -EAGAIN);
+		return nresults;
+	}
+
+	if (op->hasCallback) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	return -1;
+}
+
+#endif	// RHYTHM_IO_URING
+
+int lua_read_file(lua_State* L) {
+	// The callback is optional, make it nil if it is missing
+	lua_settop(L, 2);
+
+	STACK_START(lua_read_file, 2);
+
+	// STACK: path, callback
+
+	const char* path = luaL_checkstring(L, 1);
+	int callbackIndex = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		callbackIndex = 2;
+	}
+
+#ifdef RHYTHM_IO_URING
+	int nresults = start_lua_file_op(L, LuaFileOpKind::Read, path,
+									 callbackIndex, nullptr, 0);
+	if (nresults < 0) {
+		return lua_yield(L, 0);
+	}
+#else
+	(void)path;
+	(void)callbackIndex;
+	lua_settop(L, 0);
+	lua_pushnil(L);
+	lua_pushliteral(L, "Async file I/O is not enabled");
+	int nresults = 2;
+#endif	// RHYTHM_IO_URING
+
+	STACK_END(lua_read_file, nresults);
+
+	return nresults;
+}
+
+int lua_write_file(lua_State* L) {
+	// The callback is optional, make it nil if it is missing
+	lua_settop(L, 3);
+
+	STACK_START(lua_write_file, 3);
+
+	// STACK: path, data, callback
+
+	const char* path = luaL_checkstring(L, 1);
+	std::size_t length = 0;
+	const char* data = luaL_checklstring(L, 2, &length);
+	int callbackIndex = 0;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+		callbackIndex = 3;
+	}
+
+#ifdef RHYTHM_IO_URING
+	int nresults = start_lua_file_op(L, LuaFileOpKind::Write, path,
+									 callbackIndex, data, length);
+	if (nresults < 0) {
+		return lua_yield(L, 0);
+	}
+#else
+	(void)path;
+	(void)data;
+	(void)callbackIndex;
+	lua_settop(L, 0);
+	lua_pushnil(L);
+	lua_pushliteral(L, "Async file I/O is not enabled");
+	int nresults = 2;
+#endif	// RHYTHM_IO_URING
+
+	STACK_END(lua_write_file, nresults);
+
+	return nresults;
+}
+
+int lua_fsync(lua_State* L) {
+	// The callback is optional, make it nil if it is missing
+	lua_settop(L, 2);
+
+	STACK_START(lua_fsync, 2);
+
+	// STACK: path, callback
+
+	const char* path = luaL_checkstring(L, 1);
+	int callbackIndex = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		callbackIndex = 2;
+	}
+
+#ifdef RHYTHM_IO_URING
+	int nresults = start_lua_file_op(L, LuaFileOpKind::Fsync, path,
+									 callbackIndex, nullptr, 0);
+	if (nresults < 0) {
+		return lua_yield(L, 0);
+	}
+#else
+	(void)path;
+	(void)callbackIndex;
+	lua_settop(L, 0);
+	lua_pushnil(L);
+	lua_pushliteral(L, "Async file I/O is not enabled");
+	int nresults = 2;
+#endif	// RHYTHM_IO_URING
+
+	STACK_END(lua_fsync, nresults);
+
+	return nresults;
+}
+
+#ifdef RHYTHM_IO_URING
+
+// Size of the buffer output is read into, each read is one callback
+static const std::size_t LUA_PROCESS_READ_CHUNK = 16 * 1024;
+
+// Output pipe of a spawned process
+struct LuaProcessPipe {
+	int fd = -1;
+	// Registry ref of the function receiving the output
+	int ref = LUA_NOREF;
+};
+
+// A spawned process, kept alive by the completions watching its descriptors
+struct LuaProcess {
+	// Thread the callbacks are called on
+	lua_State* L;
+	IoRing* ring;
+	pid_t pid;
+	int pidFd = -1;
+	// Registry ref of the exit callback, LUA_NOREF if there is none
+	int exitRef = LUA_NOREF;
+	LuaProcessPipe out;
+	LuaProcessPipe err;
+
+	~LuaProcess() {
+		// Only still open if the ring was closed while the process ran
+		for (int fd : {pidFd, out.fd, err.fd}) {
+			if (fd >= 0) {
+				::close(fd);
+			}
+		}
+	}
+};
+
+static bool watch_lua_process_pipe(const std::shared_ptr<LuaProcess>& process,
+								   LuaProcessPipe LuaProcess::*pipe);
+
+static void close_lua_process_pipe(lua_State* L, LuaProcessPipe& pipe) {
+	::close(pipe.fd);
+	pipe.fd = -1;
+	luaL_unref(L, LUA_REGISTRYINDEX, pipe.ref);
+	pipe.ref = LUA_NOREF;
+}
+
+// Passes everything that can be read from the pipe to its callback, closing
+// it at end of file
+static void drain_lua_process_pipe(LuaProcess& process, LuaProcessPipe& pipe) {
+	lua_State* L = process.L;
+	char buffer[LUA_PROCESS_READ_CHUNK];
+	while (pipe.fd >= 0) {
+		ssize_t length = ::read(pipe.fd, buffer, sizeof(buffer));
+		if (length > 0) {
+			lua_pushlstring(L, buffer, static_cast<std::size_t>(length));
+			call_lua_callback(L, pipe.ref, 1, "process output callback");
+		} else if (length < 0 && errno == EINTR) {
+			continue;
+		} else if (length < 0 && errno == EAGAIN) {
+			break;
+		} else {
+			close_lua_process_pipe(L, pipe);
+		}
+	}
+}
+
+static bool watch_lua_process_pipe(const std::shared_ptr<LuaProcess>& process,
+								   LuaProcessPipe LuaProcess::*pipe) {
+	return process->ring->pollOnce(
+		(*process.*pipe).fd, POLLIN, [process, pipe](int result) {
+			LuaProcessPipe& ready = *process.*pipe;
+			// Already closed by the exit handler's final drain
+			if (ready.fd < 0) {
+				return;
+			}
+			if (result < 0) {
+				close_lua_process_pipe(process->L, ready);
+				return;
+			}
+			drain_lua_process_pipe(*process, ready);
+			if (ready.fd >= 0 && !watch_lua_process_pipe(process, pipe)) {
+				close_lua_process_pipe(process->L, ready);
+			}
+		});
+}
+
+// Reaps the exited process and calls the exit callback, after handing over
+// the output that is already buffered
+static void on_lua_process_exit(const std::shared_ptr<LuaProcess>& process) {
+	lua_State* L = process->L;
+
+	int status = 0;
+	pid_t reaped;
+	do {
+		reaped = ::waitpid(process->pid, &status, WNOHANG);
+	} while (reaped < 0 && errno == EINTR);
+
+	::close(process->pidFd);
+	process->pidFd = -1;
+
+	for (LuaProcessPipe* pipe : {&process->out, &process->err}) {
+		drain_lua_process_pipe(*process, *pipe);
+	}
+
+	if (process->exitRef == LUA_NOREF) {
+		return;
+	}
+
+	STACK_START(on_lua_process_exit, 0);
+
+	// Exit code, or nil and the signal that terminated it
+	if (reaped == process->pid && WIFEXITED(status)) {
+		lua_pushinteger(L, WEXITSTATUS(status));
+		lua_pushnil(L);
+	} else if (reaped == process->pid && WIFSIGNALED(status)) {
+		lua_pushnil(L);
+		lua_pushinteger(L, WTERMSIG(status));
+	} else {
+		// Reaped by someone else
+		lua_pushnil(L);
+		lua_pushnil(L);
+	}
+	call_lua_callback(L, process->exitRef, 2, "process exit callback");
+	luaL_unref(L, LUA_REGISTRYINDEX, process->exitRef);
+	process->exitRef = LUA_NOREF;
+
+	STACK_END(on_lua_process_exit, 0);
+}
+
+// Creates a pipe for a child's output, the parent's end doesn't block
+static bool open_lua_process_pipe(int fds[2]) {
+	if (::pipe2(fds, O_CLOEXEC) != 0) {
+		return false;
+	}
+	if (::fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) {
+		::close(fds[0]);
+		::close(fds[1]);
+		return false;
+	}
+	return true;
+}
+
+// Spawns the process described by the arguments on the stack, which have
+// been checked. Pushes the PID, or nil and an error, and returns the count.
+static int spawn_lua_process(lua_State* L,
+							 const std::vector<char*>& argv,
+							 char* const* envp,
+							 const char* cwd,
+							 bool captureOut,
+							 bool captureErr) {
+	Scheduler& scheduler = lua_get_scheduler(L);
+	IoRing* ring = scheduler.ioRing();
+	if (!ring) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Process spawning is not available");
+		return 2;
+	}
+
+	int outFds[2] = {-1, -1};
+	int errFds[2] = {-1, -1};
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	int error = 0;
+	if (captureOut) {
+		if (open_lua_process_pipe(outFds)) {
+			posix_spawn_file_actions_adddup2(&actions, outFds[1], 1);
+		} else {
+			error = errno;
+		}
+	}
+	if (captureErr && !error) {
+		if (open_lua_process_pipe(errFds)) {
+			posix_spawn_file_actions_adddup2(&actions, errFds[1], 2);
+		} else {
+			error = errno;
+		}
+	}
+	if (cwd && !error) {
+#if defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+		error = posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#else
+		error = ENOTSUP;
+#endif
+	}
+
+	pid_t pid = -1;
+	if (!error) {
+		error = ::posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(),
+							   envp);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+
+	// Only the child writes to the pipes
+	for (int fd : {outFds[1], errFds[1]}) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+
+	auto process = std::make_shared<LuaProcess>();
+	process->L = get_lua_callback_thread(L);
+	process->ring = ring;
+	process->pid = pid;
+	process->out.fd = outFds[0];
+	process->err.fd = errFds[0];
+	if (error) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", argv[0], std::strerror(error));
+		return 2;
+	}
+
+	// Exits are seen through a pidfd, so nothing polls waitpid()
+	process->pidFd = static_cast<int>(::syscall(__NR_pidfd_open, pid, 0));
+	if (process->pidFd < 0) {
+		error = errno;
+		::kill(pid, SIGKILL);
+		::waitpid(pid, nullptr, 0);
+		lua_pushnil(L);
+		lua_pushfstring(L, "pidfd_open: %s", std::strerror(error));
+		return 2;
+	}
+
+	// Watched before taking the callbacks, so a failure only has the child
+	// and the descriptors to clean up
+	if (!ring->pollOnce(process->pidFd, POLLIN,
+						[process](int) { on_lua_process_exit(process); })) {
+		::kill(pid, SIGKILL);
+		::waitpid(pid, nullptr, 0);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Process exit couldn't be watched");
+		return 2;
+	}
+
+	// The callbacks are in the options at index 2, the exit callback at 3
+	if (!lua_isnoneornil(L, 3)) {
+		lua_pushvalue(L, 3);
+		process->exitRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if (captureOut) {
+		lua_getfield(L, 2, "stdout");
+		process->out.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		if (!watch_lua_process_pipe(process, &LuaProcess::out)) {
+			close_lua_process_pipe(L, process->out);
+		}
+	}
+	if (captureErr) {
+		lua_getfield(L, 2, "stderr");
+		process->err.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		if (!watch_lua_process_pipe(process, &LuaProcess::err)) {
+			close_lua_process_pipe(L, process->err);
+		}
+	}
+	lua_pushinteger(L, pid);
+	return 1;
+}
+
+#endif	// RHYTHM_IO_URING
+
+int lua_spawn(lua_State* L) {
+	// The options and exit callback are optional, make them nil if missing
+	lua_settop(L, 3);
+
+	STACK_START(lua_spawn, 3);
+
+	// STACK: argv, opts, on_exit
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int argc = static_cast<int>(lua_compat::rawLen(L, 1));
+	if (argc == 0) {
+		luaL_argerror(L, 1, "empty argument list");
+	}
+	for (int i = 1; i <= argc; i++) {
+		lua_rawgeti(L, 1, i);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			luaL_argerror(L, 1, "arguments must be strings");
+		}
+		lua_pop(L, 1);
+	}
+
+	const char* cwd = nullptr;
+	bool hasEnv = false;
+	bool captureOut = false;
+	bool captureErr = false;
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		lua_getfield(L, 2, "cwd");
+		if (!lua_isnil(L, -1)) {
+			if (lua_type(L, -1) != LUA_TSTRING) {
+				luaL_argerror(L, 2, "cwd must be a string");
+			}
+			// Kept alive by the options table
+			cwd = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "env");
+		hasEnv = !lua_isnil(L, -1);
+		if (hasEnv) {
+			if (!lua_istable(L, -1)) {
+				luaL_argerror(L, 2, "env must be a table");
+			}
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				if (lua_type(L, -2) != LUA_TSTRING ||
+					lua_type(L, -1) != LUA_TSTRING) {
+					luaL_argerror(L, 2, "env must map strings to strings");
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "stdout");
+		lua_getfield(L, 2, "stderr");
+		captureOut = !lua_isnil(L, -2);
+		captureErr = !lua_isnil(L, -1);
+		if ((captureOut && !lua_isfunction(L, -2)) ||
+			(captureErr && !lua_isfunction(L, -1))) {
+			luaL_argerror(L, 2, "stdout and stderr must be functions");
+		}
+		lua_pop(L, 2);
+	}
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	}
+
+#ifdef RHYTHM_IO_URING
+	int nresults;
+	{
+		// The strings are kept alive by the argument tables on the stack
+		std::vector<char*> argv;
+		for (int i = 1; i <= argc; i++) {
+			lua_rawgeti(L, 1, i);
+			argv.push_back(const_cast<char*>(lua_tostring(L, -1)));
+			lua_pop(L, 1);
+		}
+		argv.push_back(nullptr);
+
+		std::vector<std::string> env;
+		std::vector<char*> envp;
+		if (hasEnv) {
+			lua_getfield(L, 2, "env");
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				env.push_back(std::string(lua_tostring(L, -2)) + "=" +
+							  lua_tostring(L, -1));
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+			for (std::string& entry : env) {
+				envp.push_back(&entry[0]);
+			}
+			envp.push_back(nullptr);
+		}
+
+		nresults = spawn_lua_process(L, argv, hasEnv ? envp.data() : environ,
+									 cwd, captureOut, captureErr);
+	}
+#else
+	(void)cwd;
+	(void)hasEnv;
+	(void)captureOut;
+	(void)captureErr;
+	lua_pushnil(L);
+	lua_pushliteral(L, "Process spawning is not enabled");
+	int nresults = 2;
+#endif	// RHYTHM_IO_URING
+
+	// Leave only the results
+	for (int i = 0; i < 3; i++) {
+		lua_remove(L, 1);
+	}
+
+	STACK_END(lua_spawn, nresults);
+
+	return nresults;
+}
+
+#ifdef RHYTHM_PATH_WATCH
+
+// Inotify events by the names used in Lua
+static const struct {
+	const char* name;
+	std::uint32_t mask;
+} LUA_PATH_EVENTS[] = {
+	{"access", IN_ACCESS},
+	{"modify", IN_MODIFY},
+	{"attrib", IN_ATTRIB},
+	{"close_write", IN_CLOSE_WRITE},
+	{"close_nowrite", IN_CLOSE_NOWRITE},
+	{"open", IN_OPEN},
+	{"moved_from", IN_MOVED_FROM},
+	{"moved_to", IN_MOVED_TO},
+	{"create", IN_CREATE},
+	{"delete", IN_DELETE},
+	{"delete_self", IN_DELETE_SELF},
+	{"move_self", IN_MOVE_SELF},
+	{"ignored", IN_IGNORED},
+	{"overflow", IN_Q_OVERFLOW},
+	{"unmount", IN_UNMOUNT},
+	{"isdir", IN_ISDIR},
+};
+
+// Events watched when none are given: anything that changes the contents
+static const std::uint32_t LUA_PATH_EVENTS_DEFAULT =
+	IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+	IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// Calls the callback of a path watch with the path, a set of the event names
+// and the names of the entries involved
+static void call_lua_path_watch(lua_State* L,
+								int id,
+								const std::string& path,
+								const PathWatcher::Events& events) {
+	STACK_START(call_lua_path_watch, 0);
+
+	lua_compat::registryGet(L, &RHYTHM_WATCHES_KEY);
+	lua_rawgeti(L, -1, id);
+	lua_remove(L, -2);	// Remove the callback table
+
+	lua_pushlstring(L, path.data(), path.size());
+	lua_newtable(L);
+	for (const auto& event : LUA_PATH_EVENTS) {
+		if (events.mask & event.mask) {
+			lua_pushboolean(L, 1);
+			lua_setfield(L, -2, event.name);
+		}
+	}
+	lua_createtable(L, static_cast<int>(events.names.size()), 0);
+	for (std::size_t i = 0; i < events.names.size(); i++) {
+		const std::string& name = events.names[i];
+		lua_pushlstring(L, name.data(), name.size());
+		lua_rawseti(L, -2, static_cast<int>(i + 1));
+	}
+
+	pcall_lua_function(L, 3, "path watch callback");
+
+	STACK_END(call_lua_path_watch, 0);
+}
+
+#endif	// RHYTHM_PATH_WATCH
+
+int lua_watch_path(lua_State* L) {
+	// The events and window are optional, make them nil if missing
+	lua_settop(L, 4);
+
+	STACK_START(lua_watch_path, 4);
+
+	// STACK: path, events, fn, windowMs
+
+	const char* path = luaL_checkstring(L, 1);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_Integer windowMs = 50;
+	if (!lua_isnil(L, 4)) {
+		windowMs = lua_compat::checkInteger(L, 4);
+		if (windowMs < 0) {
+			luaL_error(L, "Window must be non-negative");
+		}
+	}
+
+#ifdef RHYTHM_PATH_WATCH
+	std::uint32_t mask = LUA_PATH_EVENTS_DEFAULT;
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		mask = 0;
+		int count = static_cast<int>(lua_compat::rawLen(L, 2));
+		for (int i = 1; i <= count; i++) {
+			lua_rawgeti(L, 2, i);
+			const char* name = lua_tostring(L, -1);
+			std::uint32_t eventMask = 0;
+			for (const auto& event : LUA_PATH_EVENTS) {
+				if (name && std::strcmp(name, event.name) == 0) {
+					eventMask = event.mask;
+				}
+			}
+			if (!eventMask) {
+				luaL_argerror(L, 2, lua_pushfstring(L, "unknown event '%s'",
+													name ? name : "?"));
+			}
+			mask |= eventMask;
+			lua_pop(L, 1);
+		}
+	}
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	lua_State* thread = get_lua_callback_thread(L);
+	int id = scheduler.watchPath(
+		path, mask, Scheduler::DurationMs(windowMs),
+		[thread, path = std::string(path)](
+			int id, const PathWatcher::Events& events) {
+			call_lua_path_watch(thread, id, path, events);
+		});
+	if (id >= 0) {
+		// Store the callback in the table of path watch callbacks
+		lua_compat::registryGet(L, &RHYTHM_WATCHES_KEY);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_compat::registrySet(L, &RHYTHM_WATCHES_KEY);
+		}
+		lua_pushvalue(L, 3);
+		lua_rawseti(L, -2, id);
+		lua_pop(L, 1);
+
+		lua_settop(L, 0);
+		lua_pushinteger(L, id);
+
+		STACK_END(lua_watch_path, 1);
+		return 1;
+	}
+
+	int error = errno;
+	lua_settop(L, 0);
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path, std::strerror(error));
+#else
+	(void)path;
+	lua_settop(L, 0);
+	lua_pushnil(L);
+	lua_pushliteral(L, "Path watching is not enabled");
+#endif	// RHYTHM_PATH_WATCH
+
+	STACK_END(lua_watch_path, 2);
+
+	return 2;
+}
+
+int lua_unwatch_path(lua_State* L) {
+	lua_pop_extra_args(L, 1);
+
+	STACK_START(lua_unwatch_path, 1);
+
+	int id = static_cast<int>(lua_compat::checkInteger(L, 1));
+	lua_pop(L, 1);
+
+	bool removed = false;
+#ifdef RHYTHM_PATH_WATCH
+	Scheduler& scheduler = lua_get_scheduler(L);
+	removed = scheduler.unwatchPath(id);
+	if (removed) {
+		lua_compat::registryGet(L, &RHYTHM_WATCHES_KEY);
+		lua_pushnil(L);
+		lua_rawseti(L, -2, id);
+		lua_pop(L, 1);
+	}
+#else
+	(void)id;
+#endif	// RHYTHM_PATH_WATCH
+	lua_pushboolean(L, removed);
+
+	STACK_END(lua_unwatch_path, 1);
+
+	return 1;
+}
+
+// A debounced or throttled function, in a userdata. Its calls share one
+// scheduler callback, so triggering it never allocates: a debouncer only
+// touches its pending task, pushing it back, and a throttle only counts.
+struct LuaDebouncer {
+	// Thread the function is called on
+	lua_State* L;
+	Scheduler* scheduler;
+	Scheduler::CallbackId callback;
+	Scheduler::DurationMs delay;
+	bool isThrottle;
+	// The pending call, 0 if there is none
+	Scheduler::TaskId task = 0;
+	// Triggers since the function was last called
+	lua_Integer count = 0;
+	// When a throttled function was last called
+	bool hasRun = false;
+	Scheduler::TimePoint lastRun;
+	int funcRef = LUA_NOREF;
+	// Registry ref of the userdata while a call is pending, so it isn't
+	// collected before the call
+	int selfRef = LUA_NOREF;
+};
+
+// Calls the function of a debouncer with the number of triggers it coalesced
+static void run_lua_debouncer(LuaDebouncer& debouncer) {
+	lua_State* L = debouncer.L;
+
+	STACK_START(run_lua_debouncer, 0);
+
+	lua_Integer count = debouncer.count;
+	debouncer.task = 0;
+	debouncer.count = 0;
+	if (debouncer.isThrottle) {
+		debouncer.hasRun = true;
+		debouncer.lastRun = Scheduler::Clock::now();
+	}
+
+	// Keep the userdata on the stack while releasing it, the function may
+	// drop the last reference
+	lua_rawgeti(L, LUA_REGISTRYINDEX, debouncer.selfRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, debouncer.selfRef);
+	debouncer.selfRef = LUA_NOREF;
+
+	lua_pushinteger(L, count);
+	call_lua_callback(L, debouncer.funcRef, 1, "debounced function");
+	lua_pop(L, 1);	// Pop the userdata
+
+	STACK_END(run_lua_debouncer, 0);
+}
+
+static LuaDebouncer* check_lua_debouncer(lua_State* L) {
+	return static_cast<LuaDebouncer*>(
+		luaL_checkudata(L, 1, RHYTHM_DEBOUNCER_METATABLE));
+}
+
+// __call, triggers the function
+static int lua_debouncer_call(lua_State* L) {
+	LuaDebouncer* debouncer = check_lua_debouncer(L);
+	Scheduler& scheduler = *debouncer->scheduler;
+
+	debouncer->count++;
+	if (debouncer->task) {
+		// Debouncing waits for a pause, throttling keeps its deadline
+		if (!debouncer->isThrottle) {
+			scheduler.touchTask(debouncer->task);
+		}
+		return 0;
+	}
+
+	if (debouncer->isThrottle) {
+		auto now = Scheduler::Clock::now();
+		if (!debouncer->hasRun || now - debouncer->lastRun >= debouncer->delay) {
+			// Outside the window the call goes through right away, on the
+			// caller's stack so errors propagate
+			debouncer->count = 0;
+			debouncer->hasRun = true;
+			debouncer->lastRun = now;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, debouncer->funcRef);
+			lua_pushinteger(L, 1);
+			lua_call(L, 1, 0);
+			return 0;
+		}
+		debouncer->task = scheduler.scheduleAt(
+			debouncer->lastRun + debouncer->delay, debouncer->callback);
+	} else {
+		debouncer->task =
+			scheduler.scheduleAfter(debouncer->delay, debouncer->callback);
+	}
+
+	lua_pushvalue(L, 1);
+	debouncer->selfRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+// Drops the pending call, returning whether there was one
+static int lua_debouncer_cancel(lua_State* L) {
+	LuaDebouncer* debouncer = check_lua_debouncer(L);
+	bool pending = debouncer->task != 0;
+	if (pending) {
+		debouncer->scheduler->cancelTask(debouncer->task);
+		debouncer->task = 0;
+		debouncer->count = 0;
+		luaL_unref(L, LUA_REGISTRYINDEX, debouncer->selfRef);
+		debouncer->selfRef = LUA_NOREF;
+	}
+	lua_pushboolean(L, pending);
+	return 1;
+}
+
+// Makes the pending call right away, returning whether there was one
+static int lua_debouncer_flush(lua_State* L) {
+	LuaDebouncer* debouncer = check_lua_debouncer(L);
+	bool pending = debouncer->task != 0;
+	if (pending) {
+		debouncer->scheduler->cancelTask(debouncer->task);
+		run_lua_debouncer(*debouncer);
+	}
+	lua_pushboolean(L, pending);
+	return 1;
+}
+
+static int lua_debouncer_gc(lua_State* L) {
+	auto* debouncer = static_cast<LuaDebouncer*>(lua_touserdata(L, 1));
+
+	// Only pending while the state is closing, when everything is collected
+	if (debouncer->task) {
+		debouncer->scheduler->cancelTask(debouncer->task);
+	}
+	debouncer->scheduler->removeTaskCallback(debouncer->callback);
+	luaL_unref(L, LUA_REGISTRYINDEX, debouncer->funcRef);
+	debouncer->~LuaDebouncer();
+	return 0;
+}
+
+// Creates a debouncer from the delay and function on the stack, replacing
+// them
+static void push_lua_debouncer(lua_State* L, bool isThrottle) {
+	STACK_START(push_lua_debouncer, 2);
+
+	// STACK: ms, fn
+
+	lua_Integer delayMs = lua_compat::checkInteger(L, 1);
+	if (delayMs < 0) {
+		luaL_error(L, "Delay must be non-negative");
+	}
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	void* memory = lua_compat::newUserdata(L, sizeof(LuaDebouncer));
+	auto* debouncer = new (memory) LuaDebouncer();
+	debouncer->L = get_lua_callback_thread(L);
+	debouncer->scheduler = &scheduler;
+	debouncer->delay = Scheduler::DurationMs(delayMs);
+	debouncer->isThrottle = isThrottle;
+	lua_pushvalue(L, 2);
+	debouncer->funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	debouncer->callback = scheduler.addTaskCallback(
+		[debouncer](Scheduler::TaskId) { run_lua_debouncer(*debouncer); });
+
+	if (luaL_newmetatable(L, RHYTHM_DEBOUNCER_METATABLE)) {
+		static const luaL_Reg methods[] = {
+			{"cancel", lua_debouncer_cancel},
+			{"flush", lua_debouncer_flush},
+			{NULL, NULL}  // Sentinel
+		};
+		lua_newtable(L);
+		lua_compat::setFuncs(L, methods, 0);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lua_debouncer_call);
+		lua_setfield(L, -2, "__call");
+		lua_pushcfunction(L, lua_debouncer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	// Leave only the debouncer
+	lua_insert(L, 1);
+	lua_settop(L, 1);
+
+	STACK_END(push_lua_debouncer, 1);
+}
+
+int lua_debounce(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+	push_lua_debouncer(L, false);
+	return 1;
+}
+
+int lua_throttle(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+	push_lua_debouncer(L, true);
+	return 1;
+}
+
+static RateLimiter* check_lua_rate_limiter(lua_State* L) {
+	return static_cast<RateLimiter*>(
+		luaL_checkudata(L, 1, RHYTHM_RATE_LIMITER_METATABLE));
+}
+
+// Gets the optional token count at `index`, 1 by default
+static double check_lua_tokens(lua_State* L, int index) {
+	double tokens = luaL_optnumber(L, index, 1);
+	luaL_argcheck(L, tokens >= 0, index, "tokens must be non-negative");
+	return tokens;
+}
+
+// Takes tokens if the bucket has them, returning whether it did
+static int lua_rate_limiter_take(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+	RateLimiter* limiter = check_lua_rate_limiter(L);
+	double tokens = check_lua_tokens(L, 2);
+
+	lua_pushboolean(L, limiter->tryTake(tokens, Scheduler::Clock::now()));
+	return 1;
+}
+
+// Returns the tokens in the bucket
+static int lua_rate_limiter_available(lua_State* L) {
+	lua_pop_extra_args(L, 1);
+	RateLimiter* limiter = check_lua_rate_limiter(L);
+
+	lua_pushnumber(L, limiter->available(Scheduler::Clock::now()));
+	return 1;
+}
+
+// Reserves tokens and calls back once they are covered, or suspends the
+// calling coroutine until then
+static int lua_rate_limiter_wait(lua_State* L) {
+	// The callback is optional, make it nil if it is missing
+	lua_settop(L, 3);
+
+	STACK_START(lua_rate_limiter_wait, 3);
+
+	// STACK: limiter, tokens, callback
+
+	RateLimiter* limiter = check_lua_rate_limiter(L);
+	double tokens = check_lua_tokens(L, 2);
+	bool hasCallback = !lua_isnoneornil(L, 3);
+	if (hasCallback) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	} else {
+		bool isMainThread = lua_pushthread(L) == 1;
+		lua_pop(L, 1);
+		if (isMainThread) {
+			luaL_error(L, "A callback is needed outside of a coroutine");
+		}
+	}
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	auto now = Scheduler::Clock::now();
+	Scheduler::TimePoint ready = limiter->reserve(tokens, now);
+
+	if (hasCallback) {
+		// Scheduled like any task, so it can be cancelled by its ID
+		lua_settop(L, 3);
+		int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_settop(L, 0);
+
+		lua_State* thread = get_lua_callback_thread(L);
+		Scheduler::TaskId taskId = scheduler.scheduleAt(
+			ready,
+			[thread, funcRef](Scheduler::TaskId id) {
+				call_lua_task_function(thread, funcRef, id);
+			},
+			[thread, funcRef](Scheduler::TaskId id) {
+				removee_lua_task_function(thread, funcRef, id);
+			},
+			funcRef);
+		lua_pushinteger(L, taskId);
+
+		STACK_END(lua_rate_limiter_wait, 1);
+
+		return 1;
+	}
+
+	lua_settop(L, 0);
+	if (ready <= now) {
+		STACK_END(lua_rate_limiter_wait, 0);
+
+		return 0;
+	}
+
+	// The registry keeps the coroutine alive until it is resumed
+	lua_pushthread(L);
+	int threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	scheduler.scheduleAt(ready, [L, threadRef](Scheduler::TaskId) {
+		resume_lua_coroutine(L, 0);
+		luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+	});
+	return lua_yield(L, 0);
+}
+
+int lua_rate_limiter(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_rate_limiter, 2);
+
+	// STACK: rate, burst
+
+	double rate = luaL_checknumber(L, 1);
+	double burst = luaL_checknumber(L, 2);
+	luaL_argcheck(L, rate > 0, 1, "rate must be positive");
+	luaL_argcheck(L, burst > 0, 2, "burst must be positive");
+
+	// Nothing to clean up, the limiter is only numbers
+	void* memory = lua_compat::newUserdata(L, sizeof(RateLimiter));
+	new (memory) RateLimiter(rate, burst, Scheduler::Clock::now());
+
+	if (luaL_newmetatable(L, RHYTHM_RATE_LIMITER_METATABLE)) {
+		static const luaL_Reg methods[] = {
+			{"take", lua_rate_limiter_take},
+			{"available", lua_rate_limiter_available},
+			{"wait", lua_rate_limiter_wait},
+			{NULL, NULL}  // Sentinel
+		};
+		// The methods get the scheduler as their upvalue too
+		lua_newtable(L);
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_compat::setFuncs(L, methods, 1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+
+	// Leave only the limiter
+	lua_insert(L, 1);
+	lua_settop(L, 1);
+
+	STACK_END(lua_rate_limiter, 1);
+
+	return 1;
+}
+
+// Futures are handles to slots in a pool, which keeps their state, values and
+// continuations. A future costs Lua only its small handle, and slots and
+// their vectors are reused.
+
+// What a settled future does with its value
+enum class LuaFutureLinkKind {
+	All,	  // Fill its place in the results of `rhythm.all()`
+	Any,	  // Settle the future of `rhythm.any()`
+	Timeout,  // Settle the future of `rhythm.timeout()`
+};
+
+struct LuaFutureLink {
+	LuaFutureLinkKind kind;
+	// The future settled through the link, which the link holds
+	std::uint32_t target;
+	// Position in the results of `rhythm.all()`
+	int index;
+};
+
+// A function from `on_done()` or a coroutine in `await()`
+struct LuaFutureCallback {
+	int ref;
+	bool isCoroutine;
+};
+
+struct LuaFutureSlot {
+	// Handles, links and pending work holding the slot
+	std::uint32_t refs = 0;
+	bool settled = false;
+	// Whether it is in the ready list
+	bool queued = false;
+	int valueRef = LUA_NOREF;
+	int errRef = LUA_NOREF;
+	// Results of `rhythm.all()`, and how many are missing
+	int resultsRef = LUA_NOREF;
+	int remaining = 0;
+	// Timer of `rhythm.timeout()`, 0 if none
+	Scheduler::TaskId timeoutTask = 0;
+	std::vector<LuaFutureCallback> callbacks;
+	std::vector<LuaFutureLink> links;
+};
+
+struct LuaFuturePool {
+	// Thread of its own, values are moved onto it and callbacks called on it
+	lua_State* L;
+	Scheduler* scheduler;
+	int threadRef;
+	// Slots are only appended, so references to them stay valid
+	std::deque<LuaFutureSlot> slots;
+	std::vector<std::uint32_t> freeSlots;
+	// Settled futures whose callbacks run on the next tick, and the ones
+	// being run
+	std::vector<std::uint32_t> ready;
+	std::vector<std::uint32_t> running;
+	std::vector<LuaFutureCallback> callbacks;
+	bool readyScheduled = false;
+};
+
+// The handle of a future in Lua
+struct LuaFuture {
+	LuaFuturePool* pool;
+	std::uint32_t index;
+};
+
+static std::uint32_t new_lua_future_slot(LuaFuturePool& pool) {
+	std::uint32_t index;
+	if (!pool.freeSlots.empty()) {
+		index = pool.freeSlots.back();
+		pool.freeSlots.pop_back();
+	} else {
+		index = static_cast<std::uint32_t>(pool.slots.size());
+		pool.slots.emplace_back();
+	}
+	pool.slots[index].refs = 1;
+	return index;
+}
+
+// Drops a reference to a slot, freeing it once it has none left
+static void release_lua_future_slot(LuaFuturePool& pool, std::uint32_t index) {
+	LuaFutureSlot& slot = pool.slots[index];
+	if (--slot.refs > 0) {
+		return;
+	}
+
+	lua_State* L = pool.L;
+	luaL_unref(L, LUA_REGISTRYINDEX, slot.valueRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, slot.errRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, slot.resultsRef);
+	for (const LuaFutureCallback& callback : slot.callbacks) {
+		// Coroutines awaiting a future nothing can settle are collected
+		luaL_unref(L, LUA_REGISTRYINDEX, callback.ref);
+	}
+
+	// Clearing keeps the capacity of the vectors for the next future
+	std::vector<LuaFutureLink> links;
+	links.swap(slot.links);
+	slot.callbacks.clear();
+	slot.settled = false;
+	slot.valueRef = LUA_NOREF;
+	slot.errRef = LUA_NOREF;
+	slot.resultsRef = LUA_NOREF;
+	slot.remaining = 0;
+	pool.freeSlots.push_back(index);
+
+	for (const LuaFutureLink& link : links) {
+		release_lua_future_slot(pool, link.target);
+	}
+}
+
+static void run_lua_future_callbacks(void* context);
+
+// Pushes the value and error of a settled future, one of them nil
+static void push_lua_future_outcome(lua_State* L, const LuaFutureSlot& slot) {
+	if (slot.errRef == LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, slot.valueRef);
+		lua_pushnil(L);
+	} else {
+		lua_pushnil(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, slot.errRef);
+	}
+}
+
+// Puts a settled future in the ready list, so its callbacks run on the next
+// tick
+static void queue_lua_future(LuaFuturePool& pool, std::uint32_t index) {
+	LuaFutureSlot& slot = pool.slots[index];
+	if (slot.queued) {
+		return;
+	}
+	slot.queued = true;
+	slot.refs++;
+	pool.ready.push_back(index);
+
+	// One continuation runs the whole ready list
+	if (!pool.readyScheduled) {
+		pool.readyScheduled = true;
+		pool.scheduler->scheduleContinuation(Scheduler::Clock::now(),
+											 run_lua_future_callbacks, nullptr,
+											 &pool);
+	}
+}
+
+static void settle_lua_future(LuaFuturePool& pool,
+							  std::uint32_t index,
+							  bool resolved);
+
+// Passes the outcome of a settled future on through a link
+static void follow_lua_future_link(LuaFuturePool& pool,
+								   const LuaFutureSlot& source,
+								   const LuaFutureLink& link) {
+	lua_State* L = pool.L;
+	LuaFutureSlot& target = pool.slots[link.target];
+	if (target.settled) {
+		return;
+	}
+
+	bool resolved = source.errRef == LUA_NOREF;
+	if (link.kind == LuaFutureLinkKind::All && resolved) {
+		// Only the last result settles the future
+		lua_rawgeti(L, LUA_REGISTRYINDEX, target.resultsRef);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, source.valueRef);
+		lua_rawseti(L, -2, link.index);
+		if (--target.remaining > 0) {
+			lua_pop(L, 1);
+			return;
+		}
+	} else {
+		lua_rawgeti(L, LUA_REGISTRYINDEX,
+					resolved ? source.valueRef : source.errRef);
+	}
+	settle_lua_future(pool, link.target, resolved);
+}
+
+// Settles a future with the value or error on top of the pool's stack,
+// popping it
+static void settle_lua_future(LuaFuturePool& pool,
+							  std::uint32_t index,
+							  bool resolved) {
+	lua_State* L = pool.L;
+	LuaFutureSlot& slot = pool.slots[index];
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (resolved) {
+		slot.valueRef = ref;
+	} else {
+		slot.errRef = ref;
+	}
+	slot.settled = true;
+
+	// Its timer is no longer needed, cancelling it releases the slot
+	if (slot.timeoutTask) {
+		Scheduler::TaskId task = slot.timeoutTask;
+		slot.timeoutTask = 0;
+		pool.scheduler->cancelTask(task);
+	}
+
+	if (!slot.callbacks.empty()) {
+		queue_lua_future(pool, index);
+	}
+
+	// Links don't call into Lua, follow them right away
+	std::vector<LuaFutureLink> links;
+	links.swap(slot.links);
+	for (const LuaFutureLink& link : links) {
+		follow_lua_future_link(pool, slot, link);
+		release_lua_future_slot(pool, link.target);
+	}
+	links.clear();
+	if (slot.links.empty()) {
+		slot.links.swap(links);
+	}
+}
+
+// Links a future to one settled through it, or passes its outcome on right
+// away if it is settled. Takes a reference to the target.
+static void link_lua_future(LuaFuturePool& pool,
+							std::uint32_t index,
+							const LuaFutureLink& link) {
+	LuaFutureSlot& slot = pool.slots[index];
+	pool.slots[link.target].refs++;
+	if (slot.settled) {
+		follow_lua_future_link(pool, slot, link);
+		release_lua_future_slot(pool, link.target);
+		return;
+	}
+	slot.links.push_back(link);
+}
+
+// Runs the callbacks of the futures in the ready list, called by the
+// scheduler as a continuation
+static void run_lua_future_callbacks(void* context) {
+	LuaFuturePool& pool = *static_cast<LuaFuturePool*>(context);
+	lua_State* L = pool.L;
+
+	STACK_START(run_lua_future_callbacks, 0);
+
+	// Futures queued by the callbacks are left for the next tick
+	pool.readyScheduled = false;
+	pool.running.swap(pool.ready);
+	for (std::uint32_t index : pool.running) {
+		LuaFutureSlot& slot = pool.slots[index];
+		slot.queued = false;
+		pool.callbacks.clear();
+		pool.callbacks.swap(slot.callbacks);
+
+		for (const LuaFutureCallback& callback : pool.callbacks) {
+			if (callback.isCoroutine) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, callback.ref);
+				lua_State* co = lua_tothread(L, -1);
+				lua_pop(L, 1);
+				push_lua_future_outcome(co, slot);
+				resume_lua_coroutine(co, 2);
+			} else {
+				push_lua_future_outcome(L, slot);
+				call_lua_callback(L, callback.ref, 2, "future callback");
+			}
+			luaL_unref(L, LUA_REGISTRYINDEX, callback.ref);
+		}
+		release_lua_future_slot(pool, index);
+	}
+	pool.running.clear();
+
+	STACK_END(run_lua_future_callbacks, 0);
+}
+
+// Gets the future pool, creating it on first use
+static LuaFuturePool& get_lua_future_pool(lua_State* L) {
+	STACK_START(get_lua_future_pool, 0);
+
+	lua_compat::registryGet(L, &RHYTHM_FUTURES_KEY);
+	auto* udata = static_cast<LuaFuturePool**>(lua_touserdata(L, -1));
+	lua_pop(L, 1);
+	if (udata) {
+		STACK_END(get_lua_future_pool, 0);
+		return **udata;
+	}
+
+	udata = static_cast<LuaFuturePool**>(
+		lua_compat::newUserdata(L, sizeof(LuaFuturePool*)));
+	auto* pool = new LuaFuturePool();
+	*udata = pool;
+
+	// Callbacks can't run on the calling thread, it may be a coroutine that
+	// is suspended by then
+	pool->L = lua_newthread(L);
+	pool->scheduler = &lua_get_scheduler(L);
+	pool->threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	// Only freed when the state is closed, after the futures
+	if (luaL_newmetatable(L, RHYTHM_FUTURE_POOL_METATABLE)) {
+		lua_pushcfunction(L, [](lua_State* L) -> int {
+			delete *static_cast<LuaFuturePool**>(lua_touserdata(L, 1));
+			return 0;
+		});
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_compat::registrySet(L, &RHYTHM_FUTURES_KEY);
+
+	STACK_END(get_lua_future_pool, 0);
+
+	return *pool;
+}
+
+static LuaFuture* check_lua_future(lua_State* L, int index) {
+	return static_cast<LuaFuture*>(
+		luaL_checkudata(L, index, RHYTHM_FUTURE_METATABLE));
+}
+
+static int lua_future_resolve(lua_State* L);
+static int lua_future_reject(lua_State* L);
+static int lua_future_on_done(lua_State* L);
+static int lua_future_await(lua_State* L);
+static int lua_future_is_done(lua_State* L);
+
+static int lua_future_gc(lua_State* L) {
+	auto* future = static_cast<LuaFuture*>(lua_touserdata(L, 1));
+	release_lua_future_slot(*future->pool, future->index);
+	return 0;
+}
+
+// Pushes a handle to a new future, returning its slot
+static std::uint32_t push_lua_future(lua_State* L, LuaFuturePool& pool) {
+	std::uint32_t index = new_lua_future_slot(pool);
+	auto* future =
+		static_cast<LuaFuture*>(lua_compat::newUserdata(L, sizeof(LuaFuture)));
+	future->pool = &pool;
+	future->index = index;
+
+	if (luaL_newmetatable(L, RHYTHM_FUTURE_METATABLE)) {
+		static const luaL_Reg methods[] = {
+			{"resolve", lua_future_resolve},
+			{"reject", lua_future_reject},
+			{"on_done", lua_future_on_done},
+			{"await", lua_future_await},
+			{"is_done", lua_future_is_done},
+			{NULL, NULL}  // Sentinel
+		};
+		lua_newtable(L);
+		lua_compat::setFuncs(L, methods, 0);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lua_future_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return index;
+}
+
+// Settles the future with its second argument, unless it already is
+static int settle_lua_future_method(lua_State* L, bool resolved) {
+	LuaFuture* future = check_lua_future(L, 1);
+	LuaFuturePool& pool = *future->pool;
+	if (pool.slots[future->index].settled) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	lua_xmove(L, pool.L, 1);
+	settle_lua_future(pool, future->index, resolved);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lua_future_resolve(lua_State* L) {
+	lua_settop(L, 2);
+	return settle_lua_future_method(L, true);
+}
+
+static int lua_future_reject(lua_State* L) {
+	lua_settop(L, 2);
+	luaL_argcheck(L, !lua_isnil(L, 2), 2, "error expected");
+	return settle_lua_future_method(L, false);
+}
+
+static int lua_future_on_done(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+	LuaFuture* future = check_lua_future(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	LuaFuturePool& pool = *future->pool;
+
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	pool.slots[future->index].callbacks.push_back(LuaFutureCallback{ref, false});
+	if (pool.slots[future->index].settled) {
+		queue_lua_future(pool, future->index);
+	}
+
+	// Return the future, for chaining
+	return 1;
+}
+
+static int lua_future_await(lua_State* L) {
+	lua_pop_extra_args(L, 1);
+	LuaFuture* future = check_lua_future(L, 1);
+	LuaFuturePool& pool = *future->pool;
+	LuaFutureSlot& slot = pool.slots[future->index];
+
+	if (slot.settled) {
+		push_lua_future_outcome(L, slot);
+		return 2;
+	}
+
+	if (lua_pushthread(L) == 1) {
+		luaL_error(L, "Only a coroutine can await a future");
+	}
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	slot.callbacks.push_back(LuaFutureCallback{ref, true});
+	lua_settop(L, 0);
+	return lua_yield(L, 0);
+}
+
+static int lua_future_is_done(lua_State* L) {
+	lua_pop_extra_args(L, 1);
+	LuaFuture* future = check_lua_future(L, 1);
+
+	lua_pushboolean(L, future->pool->slots[future->index].settled);
+	return 1;
+}
+
+int lua_future(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_future, 0);
+
+	push_lua_future(L, get_lua_future_pool(L));
+
+	STACK_END(lua_future, 1);
+
+	return 1;
+}
+
+// Creates the future of `rhythm.all()` or `rhythm.any()` from the array of
+// futures at index 1
+static int push_lua_future_combinator(lua_State* L, LuaFutureLinkKind kind) {
+	lua_pop_extra_args(L, 1);
+
+	STACK_START(push_lua_future_combinator, 1);
+
+	// STACK: futures
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int count = static_cast<int>(lua_compat::rawLen(L, 1));
+	for (int i = 1; i <= count; i++) {
+		lua_rawgeti(L, 1, i);
+		if (!lua_compat::testUdata(L, -1, RHYTHM_FUTURE_METATABLE)) {
+			luaL_argerror(L, 1, "expected an array of futures");
+		}
+		lua_pop(L, 1);
+	}
+
+	LuaFuturePool& pool = get_lua_future_pool(L);
+	std::uint32_t target = push_lua_future(L, pool);
+
+	if (kind == LuaFutureLinkKind::All) {
+		lua_createtable(L, count, 0);
+		pool.slots[target].resultsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		pool.slots[target].remaining = count;
+		if (count == 0) {
+			lua_rawgeti(pool.L, LUA_REGISTRYINDEX,
+						pool.slots[target].resultsRef);
+			settle_lua_future(pool, target, true);
+		}
+	}
+
+	for (int i = 1; i <= count; i++) {
+		lua_rawgeti(L, 1, i);
+		LuaFuture* future = static_cast<LuaFuture*>(lua_touserdata(L, -1));
+		lua_pop(L, 1);
+		link_lua_future(pool, future->index, LuaFutureLink{kind, target, i});
+	}
+
+	// Leave only the new future
+	lua_insert(L, 1);
+	lua_settop(L, 1);
+
+	STACK_END(push_lua_future_combinator, 1);
+
+	return 1;
+}
+
+int lua_all(lua_State* L) {
+	return push_lua_future_combinator(L, LuaFutureLinkKind::All);
+}
+
+int lua_any(lua_State* L) {
+	return push_lua_future_combinator(L, LuaFutureLinkKind::Any);
+}
+
+int lua_timeout(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_timeout, 2);
+
+	// STACK: future, ms
+
+	LuaFuture* future = check_lua_future(L, 1);
+	lua_Integer delayMs = lua_compat::checkInteger(L, 2);
+	if (delayMs < 0) {
+		luaL_error(L, "Delay must be non-negative");
+	}
+
+	LuaFuturePool& pool = *future->pool;
+	std::uint32_t target = push_lua_future(L, pool);
+	link_lua_future(pool, future->index,
+					LuaFutureLink{LuaFutureLinkKind::Timeout, target, 0});
+
+	// The timer holds the future until it fires or is cancelled
+	if (!pool.slots[target].settled) {
+		pool.slots[target].refs++;
+		LuaFuturePool* poolPtr = &pool;
+		pool.slots[target].timeoutTask = pool.scheduler->scheduleAfter(
+			Scheduler::DurationMs(delayMs),
+			[poolPtr, target](Scheduler::TaskId) {
+				LuaFuturePool& pool = *poolPtr;
+				pool.slots[target].timeoutTask = 0;
+				if (!pool.slots[target].settled) {
+					lua_pushliteral(pool.L, "timeout");
+					settle_lua_future(pool, target, false);
+				}
+			},
+			[poolPtr, target](Scheduler::TaskId) {
+				release_lua_future_slot(*poolPtr, target);
+			});
+	}
+
+	// Leave only the new future
+	lua_insert(L, 1);
+	lua_settop(L, 1);
+
+	STACK_END(lua_timeout, 1);
+
+	return 1;
+}
+
+int lua_get_ms_until_next_task(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_get_ms_until_next_task, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	auto msOpt = scheduler.timeUntilNextTask();
+	if (msOpt) {
+		lua_pushinteger(L, msOpt->count());
+	} else {
+		lua_pushnil(L);
+	}
+
+	STACK_END(lua_get_ms_until_next_task, 1);
+
+	return 1;
+}
+
+int lua_get_next_task_time(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_get_next_task_time, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	auto tpOpt = scheduler.nextTaskTime();
+	if (tpOpt) {
+		std::time_t t = chrono_utils::steady_to_time_t(*tpOpt);
+		lua_pushinteger(L, static_cast<lua_Integer>(t));
+	} else {
+		lua_pushnil(L);
+	}
+
+	STACK_END(lua_get_next_task_time, 1);
+
+	return 1;
+}
+
+int lua_get_task_count(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_get_task_count, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	lua_pushinteger(L, static_cast<lua_Integer>(scheduler.taskCount()));
+
+	STACK_END(lua_get_task_count, 1);
 
 	return 1;
 }
 
+int lua_get_scheduler_handle(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_get_scheduler_handle, 0);
+
+	// The scheduler doubles as the opaque rhythm_scheduler of the C API
+	Scheduler& scheduler = lua_get_scheduler(L);
+	lua_pushlightuserdata(L, &scheduler);
+
+	STACK_END(lua_get_scheduler_handle, 1);
+
+	return 1;
+}
+
+int lua_get_ffi_context(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_get_ffi_context, 0);
+
+	// Get the context from the registry if it exists
+	lua_getfield(L, LUA_REGISTRYINDEX, RHYTHM_FFI_CONTEXT_UDATA);
+	auto* ctx = static_cast<rhythm_ffi_context*>(lua_touserdata(L, -1));
+	lua_pop(L, 1);
+
+	if (!ctx) {
+		// Create the context, kept alive by the registry
+		ctx = static_cast<rhythm_ffi_context*>(
+			lua_compat::newUserdata(L, sizeof(rhythm_ffi_context)));
+		ctx->L = L;
+		ctx->scheduler = &lua_get_scheduler(L);
+		ctx->inFfiCall = false;
+
+		lua_setfield(L, LUA_REGISTRYINDEX, RHYTHM_FFI_CONTEXT_UDATA);
+
+		// Create the function table
+		lua_newtable(L);
+		ctx->funcsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	// Return the context and the function table
+	lua_pushlightuserdata(L, ctx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->funcsRef);
+
+	STACK_END(lua_get_ffi_context, 2);
+
+	return 2;
+}
+
+int rhythm_schedule_after_ref(rhythm_ffi_context* ctx, int64_t delay_ms) {
+	ctx->inFfiCall = true;
+	Scheduler::TaskId taskId = ctx->scheduler->scheduleAfter(
+		Scheduler::DurationMs(delay_ms),
+		[ctx](Scheduler::TaskId id) {
+			call_lua_ffi_task_function(ctx, id);
+		},
+		[ctx](Scheduler::TaskId id) { remove_lua_ffi_task_function(ctx, id); });
+	ctx->inFfiCall = false;
+
+	return taskId;
+}
+
+int rhythm_cancel(rhythm_ffi_context* ctx, int id) {
+	ctx->inFfiCall = true;
+	bool success = ctx->scheduler->cancelTask(id);
+	ctx->inFfiCall = false;
+
+	return success ? 1 : 0;
+}
+
+int64_t rhythm_ms_until_next(rhythm_ffi_context* ctx) {
+	auto msOpt = ctx->scheduler->timeUntilNextTask();
+	return msOpt ? static_cast<int64_t>(msOpt->count()) : -1;
+}
+
+int lua_enable_batch_dispatch(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_enable_batch_dispatch, 0);
+
+	// Load the dispatcher once
+	lua_compat::registryGet(L, &RHYTHM_DISPATCHER_KEY);
+	bool loaded = lua_isfunction(L, -1);
+	lua_pop(L, 1);
+
+	if (!loaded) {
+		if (luaL_loadbuffer(L, RHYTHM_BATCH_DISPATCHER,
+							sizeof(RHYTHM_BATCH_DISPATCHER) - 1,
+							"=rhythm.batch_dispatcher") != 0) {
+			lua_error(L);
+		}
+		lua_pushcfunction(L, lua_report_task_error);
+		lua_push_error_func(L);
+		lua_call(L, 2, 1);
+		lua_compat::registrySet(L, &RHYTHM_DISPATCHER_KEY);
+	}
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	lua_State* thread = get_lua_callback_thread(L);
+	scheduler.setBatchDispatcher(
+		[thread](const std::vector<Scheduler::BatchEntry>& batch) {
+			call_lua_task_batch(thread, batch);
+		});
+
+	STACK_END(lua_enable_batch_dispatch, 0);
+
+	return 0;
+}
+
+int lua_disable_batch_dispatch(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_disable_batch_dispatch, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	scheduler.clearBatchDispatcher();
+
+	STACK_END(lua_disable_batch_dispatch, 0);
+
+	return 0;
+}
+
+int lua_enable_idle_gc(lua_State* L) {
+	lua_pop_extra_args(L, 2);
+
+	STACK_START(lua_enable_idle_gc, lua_gettop(L));
+
+	// STACK: [stepSize], [minIdleMs]
+
+	// Get the GC step size (in the units of LUA_GCSTEP)
+	int stepSize = static_cast<int>(luaL_optinteger(L, 1, 1));
+	if (stepSize < 0) {
+		luaL_error(L, "Step size must be non-negative");
+	}
+
+	// Get the minimum idle gap in milliseconds
+	lua_Integer minIdleMs = luaL_optinteger(L, 2, 2);
+	if (minIdleMs < 0) {
+		luaL_error(L, "Minimum idle time must be non-negative");
+	}
+
+	lua_settop(L, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	lua_State* thread = get_lua_callback_thread(L);
+	scheduler.setIdleGc(
+		[thread, stepSize]() {
+			Scheduler::GcStepResult result;
+
+			std::size_t before = lua_gc(thread, LUA_GCCOUNT, 0) * 1024 +
+								 lua_gc(thread, LUA_GCCOUNTB, 0);
+			result.cycleComplete = lua_gc(thread, LUA_GCSTEP, stepSize) != 0;
+			std::size_t after = lua_gc(thread, LUA_GCCOUNT, 0) * 1024 +
+								lua_gc(thread, LUA_GCCOUNTB, 0);
+
+			if (before > after) {
+				result.freedBytes = before - after;
+			}
+			return result;
+		},
+		Scheduler::DurationMs(minIdleMs));
+
+	STACK_END(lua_enable_idle_gc, 0);
+
+	return 0;
+}
+
+int lua_disable_idle_gc(lua_State* L) {
+	lua_pop_extra_args(L, 0);
+
+	STACK_START(lua_disable_idle_gc, 0);
+
+	Scheduler& scheduler = lua_get_scheduler(L);
+	scheduler.clearIdleGc();
+
+	STACK_END(lua_disable_idle_gc, 0);
+
+	return 0;
+}
+
 int lua_get_scheduler_metrics(lua_State* L) {
 	lua_pop_extra_args(L, 0);
 
@@ -402,6 +3122,16 @@ int lua_get_scheduler_metrics(lua_State* L) {
 	lua_setfield(L, -2, "measurementWindowMs");
 	lua_pushnumber(L, metrics.runTimeFraction());
 	lua_setfield(L, -2, "runTimeFraction");
+	lua_pushinteger(L, metrics.gcSteps);
+	lua_setfield(L, -2, "gcSteps");
+	lua_pushinteger(L, static_cast<lua_Integer>(metrics.gcFreedBytes));
+	lua_setfield(L, -2, "gcFreedBytes");
+	lua_pushinteger(L, metrics.gcTime.count());
+	lua_setfield(L, -2, "gcTimeMs");
+	lua_pushnumber(L, metrics.tombstoneRatio);
+	lua_setfield(L, -2, "tombstoneRatio");
+	lua_pushinteger(L, metrics.compactions);
+	lua_setfield(L, -2, "compactions");
 #else
 	// Metrics not enabled, return nil
 	lua_pushnil(L);
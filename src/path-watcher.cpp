@@ -0,0 +1,152 @@
+#include "path-watcher.hpp"
+
+#ifdef RHYTHM_PATH_WATCH
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+PathWatcher::~PathWatcher() {
+	close();
+}
+
+bool PathWatcher::open() {
+	close();
+
+	m_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	return m_fd >= 0;
+}
+
+void PathWatcher::close() {
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_watches.clear();
+	m_byWd.clear();
+}
+
+int PathWatcher::add(const std::string& path, std::uint32_t mask) {
+	if (m_fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	// Adds to the mask of an existing watch on the same path instead of
+	// replacing it
+	int wd = ::inotify_add_watch(m_fd, path.c_str(), mask | IN_MASK_ADD);
+	if (wd < 0) {
+		return -1;
+	}
+
+	int id = m_nextId++;
+	m_watches.emplace(id, Watch{wd, mask, false, Events(), {}});
+	m_byWd[wd].push_back(id);
+	return id;
+}
+
+bool PathWatcher::remove(int id) {
+	auto it = m_watches.find(id);
+	if (it == m_watches.end()) {
+		return false;
+	}
+
+	int wd = it->second.wd;
+	m_watches.erase(it);
+	if (wd < 0) {
+		return true;
+	}
+
+	// Other watches on the same path keep the inotify watch, with the
+	// removed mask still in it; their own masks filter it out
+	std::vector<int>& ids = m_byWd[wd];
+	ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+	if (ids.empty()) {
+		m_byWd.erase(wd);
+		::inotify_rm_watch(m_fd, wd);
+	}
+	return true;
+}
+
+void PathWatcher::read(std::vector<int>& pending) {
+	alignas(struct inotify_event) char buffer[16 * 1024];
+	for (;;) {
+		ssize_t length = ::read(m_fd, buffer, sizeof(buffer));
+		if (length < 0 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			break;
+		}
+
+		for (ssize_t offset = 0; offset < length;) {
+			const auto* event =
+				reinterpret_cast<const struct inotify_event*>(buffer + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+			const char* name = event->len > 0 ? event->name : nullptr;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				for (auto& entry : m_watches) {
+					addEvent(entry.first, IN_Q_OVERFLOW, nullptr, pending);
+				}
+				continue;
+			}
+
+			auto it = m_byWd.find(event->wd);
+			if (it == m_byWd.end()) {
+				continue;
+			}
+			for (int id : it->second) {
+				addEvent(id, event->mask, name, pending);
+			}
+
+			// The kernel removed the watch, its descriptor may be reused
+			if (event->mask & IN_IGNORED) {
+				for (int id : it->second) {
+					m_watches[id].wd = -1;
+				}
+				m_byWd.erase(it);
+			}
+		}
+	}
+}
+
+bool PathWatcher::take(int id, Events& events) {
+	auto it = m_watches.find(id);
+	if (it == m_watches.end() || !it->second.pending) {
+		return false;
+	}
+
+	Watch& watch = it->second;
+	events = std::move(watch.events);
+	watch.events = Events();
+	watch.names.clear();
+	watch.pending = false;
+	return true;
+}
+
+void PathWatcher::addEvent(int id,
+						   std::uint32_t mask,
+						   const char* name,
+						   std::vector<int>& pending) {
+	Watch& watch = m_watches[id];
+
+	// These are always reported, whatever the mask
+	mask &= watch.mask | IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT | IN_ISDIR;
+	if ((mask & ~IN_ISDIR) == 0) {
+		return;
+	}
+
+	watch.events.mask |= mask;
+	if (name && watch.names.insert(name).second) {
+		watch.events.names.push_back(name);
+	}
+	if (!watch.pending) {
+		watch.pending = true;
+		pending.push_back(id);
+	}
+}
+
+#endif	// RHYTHM_PATH_WATCH
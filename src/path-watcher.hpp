@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "rhythm-config.hpp"
+
+#ifdef RHYTHM_PATH_WATCH
+
+/**
+ * Watches files and directories with inotify (Linux only).
+ *
+ * Events are accumulated per watch until they are taken, so a burst of
+ * changes is reported once: the union of the event masks, and the distinct
+ * names of the directory entries involved.
+ */
+class PathWatcher {
+   public:
+	/** The events accumulated by a watch. */
+	struct Events {
+		/** Union of the inotify event masks, like `IN_MODIFY` */
+		std::uint32_t mask = 0;
+		/** Names of the entries involved, for a watched directory */
+		std::vector<std::string> names;
+	};
+
+	PathWatcher() = default;
+	PathWatcher(const PathWatcher&) = delete;
+	PathWatcher& operator=(const PathWatcher&) = delete;
+	~PathWatcher();
+
+	/**
+	 * Create the inotify instance.
+	 * @return True if it was created successfully.
+	 */
+	bool open();
+
+	/**
+	 * Close the inotify instance, removing all watches.
+	 */
+	void close();
+
+	/** The descriptor, readable when events are ready, -1 if not open. */
+	int fd() const { return m_fd; }
+
+	/**
+	 * Watch a file or directory. Watches of the same path share one inotify
+	 * watch, each only sees the events in its own mask.
+	 * @param mask The inotify events to report, like `IN_MODIFY`.
+	 * @return The ID of the watch, or -1 with errno set if it couldn't be
+	 * added.
+	 */
+	int add(const std::string& path, std::uint32_t mask);
+
+	/**
+	 * Stop watching, dropping the accumulated events.
+	 * @return True if the watch was found and removed.
+	 */
+	bool remove(int id);
+
+	/**
+	 * Read the events that are ready, without blocking.
+	 * `IN_IGNORED` is reported when the watched path is gone, after which the
+	 * watch sees no more events, and `IN_Q_OVERFLOW` to every watch if events
+	 * were lost.
+	 * @param pending Receives the IDs of the watches that had no events
+	 * accumulated before.
+	 */
+	void read(std::vector<int>& pending);
+
+	/**
+	 * Take the events accumulated by a watch.
+	 * @return False if the watch doesn't exist or has no events.
+	 */
+	bool take(int id, Events& events);
+
+   private:
+	struct Watch {
+		// Inotify watch descriptor, -1 once the kernel removed it
+		int wd;
+		std::uint32_t mask;
+		bool pending;
+		Events events;
+		// The names in `events`, to add each only once
+		std::unordered_set<std::string> names;
+	};
+
+	int m_fd = -1;
+	int m_nextId = 1;
+	std::unordered_map<int, Watch> m_watches;
+	// IDs of the watches sharing each inotify watch
+	std::unordered_map<int, std::vector<int>> m_byWd;
+
+	void addEvent(int id, std::uint32_t mask, const char* name,
+				  std::vector<int>& pending);
+};
+
+#endif	// RHYTHM_PATH_WATCH
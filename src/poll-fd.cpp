@@ -0,0 +1,90 @@
+#include "poll-fd.hpp"
+
+#ifdef RHYTHM_POLL_FD
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <initializer_list>
+
+PollFd::~PollFd() {
+	close();
+}
+
+bool PollFd::open() {
+	close();
+
+	m_epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+	m_timerFd =
+		::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_epollFd < 0 || m_timerFd < 0) {
+		close();
+		return false;
+	}
+
+	// Level triggered, so the epoll descriptor stays readable until the timer
+	// is drained
+	if (!watch(m_timerFd)) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void PollFd::close() {
+	for (int* fd : {&m_epollFd, &m_timerFd}) {
+		if (*fd >= 0) {
+			::close(*fd);
+			*fd = -1;
+		}
+	}
+}
+
+bool PollFd::arm(std::chrono::nanoseconds delay) {
+	if (m_timerFd < 0) {
+		return false;
+	}
+
+	// A zero value would disarm the timer, expire as soon as possible instead
+	if (delay.count() <= 0) {
+		delay = std::chrono::nanoseconds(1);
+	}
+
+	auto seconds = std::chrono::duration_cast<std::chrono::seconds>(delay);
+	struct itimerspec spec = {};
+	spec.it_value.tv_sec = static_cast<time_t>(seconds.count());
+	spec.it_value.tv_nsec = static_cast<long>((delay - seconds).count());
+	return ::timerfd_settime(m_timerFd, 0, &spec, nullptr) == 0;
+}
+
+bool PollFd::disarm() {
+	if (m_timerFd < 0) {
+		return false;
+	}
+
+	struct itimerspec spec = {};
+	return ::timerfd_settime(m_timerFd, 0, &spec, nullptr) == 0;
+}
+
+bool PollFd::watch(int fd) {
+	if (m_epollFd < 0) {
+		return false;
+	}
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	return ::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void PollFd::drain() {
+	std::uint64_t count;
+	if (m_timerFd >= 0) {
+		(void)!::read(m_timerFd, &count, sizeof(count));
+	}
+}
+
+#endif	// RHYTHM_POLL_FD
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include "rhythm-config.hpp"
+
+#ifdef RHYTHM_POLL_FD
+
+/**
+ * Readable file descriptor for waiting on a scheduler from an external event
+ * loop (Linux only).
+ *
+ * The descriptor is an epoll instance watching a timerfd, armed at the
+ * scheduler's next deadline, and the descriptors passed to `watch()`, like the
+ * scheduler's eventfd signaled when a function is posted from another thread.
+ * It becomes readable when any of them is and the timer stays expired until
+ * `drain()` is called.
+ */
+class PollFd {
+   public:
+	PollFd() = default;
+	PollFd(const PollFd&) = delete;
+	PollFd& operator=(const PollFd&) = delete;
+	~PollFd();
+
+	/**
+	 * Create the descriptors.
+	 * @return True if they were created successfully.
+	 */
+	bool open();
+
+	/**
+	 * Close the descriptors.
+	 */
+	void close();
+
+	/** The descriptor to wait on, -1 if not open. */
+	int fd() const { return m_epollFd; }
+
+	/**
+	 * Arm the timer to expire after a delay, replacing any earlier deadline.
+	 * A delay of zero or less makes the descriptor readable right away.
+	 */
+	bool arm(std::chrono::nanoseconds delay);
+
+	/**
+	 * Stop the timer.
+	 */
+	bool disarm();
+
+	/**
+	 * Also make the descriptor readable while another descriptor is. It isn't
+	 * drained by `drain()`, whoever owns it must consume what made it
+	 * readable.
+	 * @return True if the descriptor is now watched.
+	 */
+	bool watch(int fd);
+
+	/**
+	 * Consume the expired timer, so it no longer makes the descriptor
+	 * readable.
+	 */
+	void drain();
+
+   private:
+	int m_epollFd = -1;
+	int m_timerFd = -1;
+};
+
+#endif	// RHYTHM_POLL_FD
@@ -0,0 +1,51 @@
+#include "rate-limiter.hpp"
+
+#include <algorithm>
+
+RateLimiter::RateLimiter(double rate, double burst, const TimePoint& now)
+	: m_rate(rate), m_burst(burst), m_tokens(burst), m_updated(now) {}
+
+void RateLimiter::refill(const TimePoint& now) {
+	// Time can appear to go back when callers pass cached times
+	if (now <= m_updated) {
+		return;
+	}
+
+	std::chrono::duration<double> elapsed = now - m_updated;
+	m_tokens = std::min(m_burst, m_tokens + elapsed.count() * m_rate);
+	m_updated = now;
+}
+
+bool RateLimiter::tryTake(double tokens, const TimePoint& now) {
+	refill(now);
+	if (m_tokens < tokens) {
+		return false;
+	}
+
+	m_tokens -= tokens;
+	return true;
+}
+
+RateLimiter::TimePoint RateLimiter::reserve(double tokens,
+											const TimePoint& now) {
+	TimePoint ready = readyTime(tokens, now);
+	m_tokens -= tokens;
+	return ready;
+}
+
+RateLimiter::TimePoint RateLimiter::readyTime(double tokens,
+											  const TimePoint& now) {
+	refill(now);
+	if (m_tokens >= tokens) {
+		return now;
+	}
+
+	// Round up, so the tokens are there by the time
+	std::chrono::duration<double> wait((tokens - m_tokens) / m_rate);
+	return now + std::chrono::ceil<TimePoint::duration>(wait);
+}
+
+double RateLimiter::available(const TimePoint& now) {
+	refill(now);
+	return m_tokens;
+}
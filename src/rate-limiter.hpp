@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+
+/**
+ * A token bucket, refilled lazily from the times it is used at.
+ *
+ * The bucket holds up to `burst` tokens and gains `rate` tokens per second.
+ * Nothing runs between uses: each call first credits the tokens earned since
+ * the previous one, so any number of buckets cost no timers. Reserving can
+ * take the bucket into debt, which later requests wait behind, so waiters are
+ * served in order.
+ */
+class RateLimiter {
+   public:
+	using TimePoint = std::chrono::steady_clock::time_point;
+
+	/**
+	 * @param rate Tokens gained per second, greater than 0.
+	 * @param burst Most tokens the bucket holds, greater than 0. It starts
+	 * full.
+	 * @param now The current time.
+	 */
+	RateLimiter(double rate, double burst, const TimePoint& now);
+
+	/**
+	 * Take tokens if the bucket has them.
+	 * @return True if the tokens were taken.
+	 */
+	bool tryTake(double tokens, const TimePoint& now);
+
+	/**
+	 * Take tokens whether or not the bucket has them, going into debt if it
+	 * doesn't.
+	 * @return The time the tokens are covered, `now` if they already are.
+	 */
+	TimePoint reserve(double tokens, const TimePoint& now);
+
+	/**
+	 * The time the bucket will have the tokens, `now` if it has them.
+	 */
+	TimePoint readyTime(double tokens, const TimePoint& now);
+
+	/** The tokens in the bucket, negative while in debt. */
+	double available(const TimePoint& now);
+
+	double rate() const { return m_rate; }
+	double burst() const { return m_burst; }
+
+   private:
+	/** Credit the tokens earned since the last update. */
+	void refill(const TimePoint& now);
+
+	double m_rate;
+	double m_burst;
+	double m_tokens;
+	TimePoint m_updated;
+};
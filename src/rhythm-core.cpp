@@ -0,0 +1,101 @@
+#include "rhythm-core.h"
+#include "scheduler.hpp"
+
+namespace {
+
+Scheduler* toScheduler(rhythm_scheduler* scheduler) {
+	return reinterpret_cast<Scheduler*>(scheduler);
+}
+
+const Scheduler* toScheduler(const rhythm_scheduler* scheduler) {
+	return reinterpret_cast<const Scheduler*>(scheduler);
+}
+
+// Wraps a native callback, or returns an empty function if there is none
+Scheduler::TaskFn wrap(rhythm_task_fn fn, void* userdata) {
+	if (!fn) {
+		return Scheduler::TaskFn();
+	}
+	return [fn, userdata](Scheduler::TaskId id) { fn(id, userdata); };
+}
+
+}  // namespace
+
+rhythm_scheduler* rhythm_scheduler_new(void) {
+	return reinterpret_cast<rhythm_scheduler*>(new Scheduler());
+}
+
+void rhythm_scheduler_free(rhythm_scheduler* scheduler) {
+	delete toScheduler(scheduler);
+}
+
+rhythm_task_id rhythm_scheduler_after(rhythm_scheduler* scheduler,
+									  int64_t delay_ms,
+									  rhythm_task_fn fn,
+									  rhythm_task_fn cleanup,
+									  void* userdata) {
+	return toScheduler(scheduler)->scheduleAfter(
+		Scheduler::DurationMs(delay_ms), wrap(fn, userdata),
+		wrap(cleanup, userdata));
+}
+
+rhythm_task_id rhythm_scheduler_every(rhythm_scheduler* scheduler,
+									  int64_t interval_ms,
+									  rhythm_task_fn fn,
+									  rhythm_task_fn cleanup,
+									  void* userdata,
+									  int run_immediately,
+									  int skip_if_late) {
+	return toScheduler(scheduler)->scheduleEvery(
+		Scheduler::DurationMs(interval_ms), wrap(fn, userdata),
+		wrap(cleanup, userdata), run_immediately != 0, skip_if_late != 0);
+}
+
+int rhythm_scheduler_cancel(rhythm_scheduler* scheduler, rhythm_task_id id) {
+	return toScheduler(scheduler)->cancelTask(id) ? 1 : 0;
+}
+
+int rhythm_scheduler_touch(rhythm_scheduler* scheduler, rhythm_task_id id) {
+	return toScheduler(scheduler)->touchTask(id) ? 1 : 0;
+}
+
+void rhythm_scheduler_tick(rhythm_scheduler* scheduler) {
+	toScheduler(scheduler)->tick();
+}
+
+size_t rhythm_scheduler_run_once(rhythm_scheduler* scheduler,
+								 int64_t max_wait_ms) {
+	return toScheduler(scheduler)->runOnce(Scheduler::DurationMs(max_wait_ms));
+}
+
+int rhythm_scheduler_loop(rhythm_scheduler* scheduler) {
+	return toScheduler(scheduler)->loop() ? 1 : 0;
+}
+
+void rhythm_scheduler_stop(rhythm_scheduler* scheduler) {
+	toScheduler(scheduler)->stopLoop();
+}
+
+void rhythm_scheduler_post(rhythm_scheduler* scheduler,
+						   rhythm_post_fn fn,
+						   void* userdata) {
+	toScheduler(scheduler)->post([fn, userdata]() { fn(userdata); });
+}
+
+int rhythm_scheduler_poll_fd(rhythm_scheduler* scheduler) {
+#ifdef RHYTHM_POLL_FD
+	return toScheduler(scheduler)->pollFd();
+#else
+	(void)scheduler;
+	return -1;
+#endif	// RHYTHM_POLL_FD
+}
+
+int64_t rhythm_scheduler_ms_until_next(const rhythm_scheduler* scheduler) {
+	auto ms = toScheduler(scheduler)->timeUntilNextTask();
+	return ms ? static_cast<int64_t>(ms->count()) : -1;
+}
+
+size_t rhythm_scheduler_task_count(const rhythm_scheduler* scheduler) {
+	return toScheduler(scheduler)->taskCount();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+// C++20 coroutine support for native scheduled tasks. The rest of the library
+// only needs C++17, so this header is opt-in.
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "scheduler-coro.hpp requires C++20 coroutine support"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include "scheduler.hpp"
+
+/**
+ * Fire-and-forget coroutine driven by a scheduler.
+ *
+ * The coroutine starts running immediately and is resumed by `tick()` after
+ * each `co_await scheduler.sleep(...)` or `co_await scheduler.until(...)`.
+ * Its frame is allocated from the scheduler's frame pool, so the scheduler
+ * must be the coroutine's first parameter:
+ *
+ * ```cpp
+ * SchedulerCoroutine blink(Scheduler& scheduler, Led& led) {
+ *     for (;;) {
+ *         led.toggle();
+ *         co_await scheduler.sleep(std::chrono::milliseconds(500));
+ *     }
+ * }
+ * ```
+ *
+ * Coroutines still waiting when the scheduler is destroyed are destroyed
+ * with it.
+ */
+template <typename Policy>
+class BasicSchedulerCoroutine {
+   public:
+	struct promise_type {
+		// The frame is preceded by a pointer to the scheduler that owns it,
+		// padded to keep the frame aligned
+		static constexpr std::size_t HeaderSize = alignof(std::max_align_t);
+
+		template <typename... Args>
+		static void* operator new(std::size_t size,
+								  BasicScheduler<Policy>& scheduler,
+								  Args&...) {
+			auto* block = static_cast<unsigned char*>(
+				scheduler.allocateFrame(size + HeaderSize));
+			*reinterpret_cast<BasicScheduler<Policy>**>(block) = &scheduler;
+			return block + HeaderSize;
+		}
+
+		// Coroutines without the scheduler as first parameter can't use the
+		// frame pool
+		static void* operator new(std::size_t size) = delete;
+
+		static void operator delete(void* frame, std::size_t size) {
+			auto* block = static_cast<unsigned char*>(frame) - HeaderSize;
+			auto* scheduler =
+				*reinterpret_cast<BasicScheduler<Policy>**>(block);
+			scheduler->freeFrame(block, size + HeaderSize);
+		}
+
+		BasicSchedulerCoroutine get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+using SchedulerCoroutine = BasicSchedulerCoroutine<DefaultSchedulerPolicy>;
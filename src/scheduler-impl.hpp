@@ -0,0 +1,2127 @@
+#pragma once
+
+// Implementation of BasicScheduler. Only needs to be included to instantiate
+// the scheduler with a custom policy; the default policy is instantiated in
+// scheduler.cpp.
+
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <random>
+
+#ifdef RHYTHM_WAKE_FD
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif	// RHYTHM_WAKE_FD
+
+namespace scheduler_detail {
+
+// Snapshot file header, followed by the entry count
+inline constexpr char SnapshotMagic[4] = {'R', 'H', 'Y', 'S'};
+inline constexpr std::uint32_t SnapshotVersion = 1;
+
+// Snapshot entry flags
+inline constexpr std::uint8_t SnapshotFlagSkipIfLate = 0x01;
+
+// Task log is compacted once it holds this many records, and more than
+// twice as many as there are logged tasks
+inline constexpr std::size_t TaskLogCompactMinRecords = 4096;
+
+// Maximum number of durations remembered while waiting for them to repeat
+inline constexpr std::size_t SingleDurationLimit = 1024;
+
+// Tombstones are never compacted while there are fewer than this many
+inline constexpr std::size_t CompactMinTombstones = 64;
+
+// Range of task times in ms since the epoch. The epoch is moved up to now
+// once it is RebaseEpochMs behind, leaving room for deadlines more than
+// twice as far ahead; deadlines beyond the range are kept in the task's
+// extra fields.
+inline constexpr std::int64_t MinEpochMs = INT32_MIN + 1;
+inline constexpr std::int64_t MaxEpochMs = INT32_MAX;
+inline constexpr std::int64_t RebaseEpochMs = std::int64_t(1) << 30;
+
+// Touch time of tasks that weren't touched
+inline constexpr std::int32_t NotTouched = INT32_MIN;
+
+// Duration of tasks whose duration is kept in their extra fields
+inline constexpr std::uint32_t LongDuration = UINT32_MAX;
+
+// Converts a deadline to wall clock milliseconds, which survive a restart
+template <typename Clock>
+std::int64_t toWallMs(const typename Clock::time_point& tp) {
+	auto wall = std::chrono::system_clock::now() +
+				std::chrono::duration_cast<std::chrono::system_clock::duration>(
+					tp - Clock::now());
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			   wall.time_since_epoch())
+		.count();
+}
+
+// Converts wall clock milliseconds back to a deadline
+template <typename Clock>
+typename Clock::time_point fromWallMs(std::int64_t ms) {
+	std::chrono::system_clock::time_point wall{std::chrono::milliseconds(ms)};
+	return Clock::now() +
+		   std::chrono::duration_cast<typename Clock::duration>(
+			   wall - std::chrono::system_clock::now());
+}
+
+template <typename T>
+void writeValue(std::ostream& out, const T& value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool readValue(std::istream& in, T& value) {
+	return static_cast<bool>(
+		in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+}  // namespace scheduler_detail
+
+template <typename Policy>
+BasicScheduler<Policy>::BasicScheduler() {
+#ifdef RHYTHM_WAKE_FD
+	// Without it posted functions still run, but only once a wait ends
+	m_wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif	// RHYTHM_WAKE_FD
+}
+
+template <typename Policy>
+BasicScheduler<Policy>::~BasicScheduler() {
+	// Destroy coroutines that are still waiting, returning their frames
+	for (const Continuation& continuation : m_continuations) {
+		if (continuation.destroy) {
+			continuation.destroy(continuation.context);
+		}
+	}
+	m_continuations.clear();
+
+	for (std::vector<void*>& frames : m_framePool) {
+		for (void* frame : frames) {
+			::operator delete(frame);
+		}
+	}
+
+#ifdef RHYTHM_WAKE_FD
+	if (m_wakeFd >= 0) {
+		::close(m_wakeFd);
+	}
+#endif	// RHYTHM_WAKE_FD
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleAt(
+	const TimePoint& time,
+	const TaskFn& func,
+	const TaskFn cleanup,
+	int batchRef) {
+	return scheduleAt(time, newCallback(func, cleanup, batchRef));
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleAfter(
+	const DurationMs& delay,
+	const TaskFn& func,
+	const TaskFn cleanup,
+	int batchRef) {
+	return scheduleAfter(delay, newCallback(func, cleanup, batchRef));
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleEvery(
+	const DurationMs& interval,
+	const TaskFn& func,
+	const TaskFn cleanup,
+	bool runImmediately,
+	bool skipIfLate,
+	int batchRef) {
+	return scheduleEvery(interval, newCallback(func, cleanup, batchRef),
+						 runImmediately, skipIfLate);
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::CallbackId
+BasicScheduler<Policy>::addTaskCallback(const TaskFn& func,
+										const TaskFn cleanup,
+										int batchRef) {
+	CallbackId callback = newCallback(func, cleanup, batchRef);
+
+	// Held until the callback is removed
+	m_callbacks[callback].refs++;
+	return callback;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::removeTaskCallback(CallbackId callback) {
+	releaseCallback(callback);
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleAt(
+	const TimePoint& time, CallbackId callback) {
+	// Create the task
+	Task task = newTask(callback);
+	setDeadline(task, time);
+
+	return addTask(std::move(task), DurationMs::zero());
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleAfter(
+	const DurationMs& delay, CallbackId callback) {
+	// Create the task
+	Task task = newTask(callback);
+	setDeadline(task, Clock::now() + delay);
+	setDuration(task, delay);
+
+	return addTask(std::move(task), delay);
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleEvery(
+	const DurationMs& interval,
+	CallbackId callback,
+	bool runImmediately,
+	bool skipIfLate) {
+	// Create the task, an interval of zero makes it a one-shot task
+	Task task = newTask(callback);
+	setDeadline(task,
+				runImmediately ? Clock::now() : Clock::now() + interval);
+	setDuration(task, interval);
+	task.recurring = interval.count() > 0;
+	task.skipIfLate = skipIfLate;
+
+	return addTask(std::move(task), interval);
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId
+BasicScheduler<Policy>::scheduleAfterTasks(
+	const std::vector<TaskId>& predecessors,
+	const DurationMs& delay,
+	const TaskFn& func,
+	const TaskFn cleanup,
+	int batchRef) {
+	// Create the task, its deadline is set once it is released
+	Task task = newTask(newCallback(func, cleanup, batchRef));
+
+	std::size_t remaining = 0;
+	for (TaskId predecessor : predecessors) {
+		// Tasks that aren't scheduled have completed, or never will
+		if (!findTask(predecessor) &&
+			m_heldTasks.find(predecessor) == m_heldTasks.end()) {
+			continue;
+		}
+
+		// A predecessor listed twice is only waited for once
+		std::vector<TaskId>& dependents = m_dependents[predecessor];
+		if (std::find(dependents.begin(), dependents.end(), task.id) !=
+			dependents.end()) {
+			continue;
+		}
+		dependents.push_back(task.id);
+		remaining++;
+	}
+
+	if (remaining == 0) {
+		setDeadline(task, Clock::now() + delay);
+		setDuration(task, delay);
+		return addTask(std::move(task), delay);
+	}
+
+	TaskId id = task.id;
+	m_heldTasks.emplace(id, HeldTask{std::move(task), delay, remaining});
+	return id;
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::scheduleRetry(
+	const RetryFn& func,
+	const RetryOptions& options,
+	const TaskFn cleanup) {
+	// The attempt count and the next delay live in the task's callback
+	unsigned int attempt = 0;
+	double delayMs = static_cast<double>(options.base.count());
+	TaskFn attemptFn = [this, func, options, attempt,
+						delayMs](TaskId id) mutable {
+		attempt++;
+		bool done = func(id, attempt) ||
+					(options.maxAttempts && attempt >= options.maxAttempts);
+
+		// The task may have been cancelled by the attempt
+		Task* task = findTask(id);
+		if (!task) {
+			return;
+		}
+		if (done) {
+			// Completed as a one-shot task once the attempt returns
+			task->recurring = false;
+			return;
+		}
+
+		double maxMs = static_cast<double>(options.maxDelay.count());
+		double nextMs = std::min(delayMs, maxMs);
+		delayMs = std::min(delayMs * options.factor, maxMs);
+		if (options.jitter > 0) {
+			if (!m_retryRandomSeeded) {
+				m_retryRandom.seed(static_cast<std::uint_fast32_t>(
+					Clock::now().time_since_epoch().count()));
+				m_retryRandomSeeded = true;
+			}
+			std::uniform_real_distribution<double> fraction(0, options.jitter);
+			nextMs -= nextMs * fraction(m_retryRandom);
+		}
+		rearmRetry(*task, DurationMs(static_cast<DurationMs::rep>(nextMs)));
+	};
+
+	// Recurring, but kept out of the timer lists since its interval changes
+	Task task = newTask(newCallback(attemptFn, cleanup, NoBatchRef));
+	setDeadline(task, Clock::now());
+	task.recurring = true;
+
+	return addTask(std::move(task), DurationMs::zero());
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::CallbackId
+BasicScheduler<Policy>::newCallback(const TaskFn& func,
+									const TaskFn& cleanup,
+									int batchRef) {
+	// Reuse a free slot if there is one
+	CallbackId callback;
+	if (!m_freeCallbacks.empty()) {
+		callback = m_freeCallbacks.back();
+		m_freeCallbacks.pop_back();
+	} else {
+		callback = static_cast<CallbackId>(m_callbacks.size());
+		m_callbacks.emplace_back();
+	}
+
+	Callback& slot = m_callbacks[callback];
+	slot.func = func;
+	slot.cleanup = cleanup;
+	slot.batchRef = batchRef;
+	slot.refs = 0;
+	return callback;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::releaseCallback(CallbackId callback) {
+	if (--m_callbacks[callback].refs == 0) {
+		m_releasedCallbacks.push_back(callback);
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::reclaimCallbacks() {
+	for (CallbackId callback : m_releasedCallbacks) {
+		Callback& slot = m_callbacks[callback];
+		slot.func = TaskFn();
+		slot.cleanup = TaskFn();
+		m_freeCallbacks.push_back(callback);
+	}
+	m_releasedCallbacks.clear();
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::Task BasicScheduler<Policy>::newTask(
+	CallbackId callback) {
+	m_callbacks[callback].refs++;
+
+	Task task{};
+	task.id = m_nextId++;
+	task.touched = scheduler_detail::NotTouched;
+	task.callback = callback;
+	task.active = true;
+	return task;
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskExtra& BasicScheduler<Policy>::taskExtra(
+	Task& task) {
+	task.extra = true;
+	return m_taskExtras[task.id];
+}
+
+template <typename Policy>
+const typename BasicScheduler<Policy>::TaskExtra*
+BasicScheduler<Policy>::findTaskExtra(const Task& task) const {
+	if (!task.extra) {
+		return nullptr;
+	}
+	auto it = m_taskExtras.find(task.id);
+	return it != m_taskExtras.end() ? &it->second : nullptr;
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::EpochMs BasicScheduler<Policy>::toEpochMs(
+	const TimePoint& time) const {
+	using namespace scheduler_detail;
+
+	// Compare before subtracting, which could overflow for extreme times
+	if (time <= fromEpochMs(MinEpochMs)) {
+		return static_cast<EpochMs>(MinEpochMs);
+	}
+	if (time >= fromEpochMs(MaxEpochMs)) {
+		return static_cast<EpochMs>(MaxEpochMs);
+	}
+	return static_cast<EpochMs>(
+		std::chrono::ceil<DurationMs>(time - m_epoch).count());
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::rebaseEpoch(const TimePoint& now) {
+	using namespace scheduler_detail;
+
+	std::int64_t shift =
+		std::chrono::floor<DurationMs>(now - m_epoch).count();
+	m_epoch += DurationMs(shift);
+
+	forEachTask(*this, [this, shift](Task& task) {
+		if (!task.active) {
+			return;
+		}
+
+		// Far deadlines may be in range now
+		if (task.far) {
+			setDeadline(task, m_taskExtras[task.id].deadline);
+		} else {
+			task.nextRun = static_cast<EpochMs>(
+				std::max(task.nextRun - shift, MinEpochMs));
+		}
+
+		if (task.touched != NotTouched) {
+			task.touched = static_cast<EpochMs>(
+				std::max(task.touched - shift, MinEpochMs));
+		}
+	});
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setDeadline(Task& task,
+										 const TimePoint& deadline) {
+	if (deadline > fromEpochMs(scheduler_detail::MaxEpochMs)) {
+		// Out of range, run into the end of it and rearm from there
+		taskExtra(task).deadline = deadline;
+		task.nextRun = static_cast<EpochMs>(scheduler_detail::MaxEpochMs);
+		task.far = true;
+		return;
+	}
+
+	task.nextRun = toEpochMs(deadline);
+	task.far = false;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setNextRun(Task& task, std::int64_t nextRun) {
+	using namespace scheduler_detail;
+
+	if (nextRun > MaxEpochMs) {
+		setDeadline(task, fromEpochMs(nextRun));
+		return;
+	}
+
+	task.nextRun = static_cast<EpochMs>(std::max(nextRun, MinEpochMs));
+	task.far = false;
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TimePoint BasicScheduler<Policy>::taskDeadline(
+	const Task& task) const {
+	if (task.far) {
+		return findTaskExtra(task)->deadline;
+	}
+	return fromEpochMs(task.nextRun);
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TimePoint
+BasicScheduler<Policy>::effectiveDeadline(const Task& task) const {
+	TimePoint deadline = taskDeadline(task);
+	if (task.touched != scheduler_detail::NotTouched) {
+		deadline = std::max(deadline,
+							fromEpochMs(task.touched) + taskDuration(task));
+	}
+	return deadline;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setDuration(Task& task,
+										 const DurationMs& duration) {
+	using namespace scheduler_detail;
+
+	if (duration.count() <= 0) {
+		task.duration = 0;
+	} else if (duration.count() >= LongDuration) {
+		taskExtra(task).duration = duration;
+		task.duration = LongDuration;
+	} else {
+		task.duration = static_cast<std::uint32_t>(duration.count());
+	}
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::DurationMs
+BasicScheduler<Policy>::taskDuration(const Task& task) const {
+	if (task.duration == scheduler_detail::LongDuration) {
+		return findTaskExtra(task)->duration;
+	}
+	return DurationMs(task.duration);
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::addTask(
+	Task&& task, const DurationMs& duration) {
+	TaskId id = task.id;
+	m_taskCount++;
+
+	// Update next task time
+	if (fromEpochMs(task.nextRun) < m_nextTaskTime) {
+		m_nextTaskTime = fromEpochMs(task.nextRun);
+
+#ifdef RHYTHM_POLL_FD
+		if (m_pollFd && m_nextTaskTime < m_pollArmedTime) {
+			armPollFd();
+		}
+#endif	// RHYTHM_POLL_FD
+	}
+
+	if (duration.count() > 0) {
+		auto it = m_timerLists.find(duration.count());
+		if (it == m_timerLists.end() &&
+			m_singleDurations.count(duration.count()) != 0) {
+			// The duration repeats, start a list for it
+			m_singleDurations.erase(duration.count());
+			it = m_timerLists.emplace(duration.count(), TaskList()).first;
+		}
+
+		if (it != m_timerLists.end()) {
+			insertOrdered(it->second, std::move(task));
+			return id;
+		}
+
+		// Remember the duration, forgetting all of them once there are too
+		// many that never repeated
+		if (m_singleDurations.size() >=
+			scheduler_detail::SingleDurationLimit) {
+			m_singleDurations.clear();
+		}
+		m_singleDurations.insert(duration.count());
+	}
+
+	// Add to the list
+	m_tasks.push_back(std::move(task));
+	m_taskIndex[id] = &m_tasks.back();
+
+	return id;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::insertOrdered(TaskList& list, Task&& task) {
+	// Only a task rearmed after running late or being touched can belong
+	// before the tail, it waits in a bucket rather than being moved back
+	// through the list
+	if (!list.empty() && task.nextRun < list.back().nextRun) {
+		bucketTask(std::move(task));
+		return;
+	}
+
+	list.push_back(std::move(task));
+	m_taskIndex[list.back().id] = &list.back();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::bucketTask(Task&& task) {
+	Bucket& bucket = m_deadlineBuckets[fromEpochMs(task.nextRun)];
+	const Task* data = bucket.data();
+	bucket.push_back(std::move(task));
+	m_bucketTaskCount++;
+
+	if (bucket.data() == data) {
+		m_taskIndex[bucket.back().id] = &bucket.back();
+		return;
+	}
+
+	// The bucket grew into new storage, all of its tasks moved
+	for (Task& moved : bucket) {
+		if (moved.active) {
+			m_taskIndex[moved.id] = &moved;
+		}
+	}
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::Task* BasicScheduler<Policy>::findTask(
+	TaskId id) {
+	auto it = m_taskIndex.find(id);
+	if (it == m_taskIndex.end() || !it->second->active)
+		return nullptr;
+	return it->second;
+}
+
+template <typename Policy>
+template <typename Self, typename Fn>
+void BasicScheduler<Policy>::forEachTask(Self& self, Fn&& fn) {
+	for (auto& task : self.m_tasks) {
+		fn(task);
+	}
+	for (auto& item : self.m_timerLists) {
+		for (auto& task : item.second) {
+			fn(task);
+		}
+	}
+	for (auto& item : self.m_deadlineBuckets) {
+		for (auto& task : item.second) {
+			fn(task);
+		}
+	}
+	for (auto& bucket : self.m_dueBuckets) {
+		for (auto& task : bucket) {
+			fn(task);
+		}
+	}
+	for (auto& task : self.m_batchOneShots) {
+		fn(task);
+	}
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::setTaskKey(TaskId id, const std::string& key) {
+	Task* it = findTask(id);
+	if (!it || key.size() > MaxKeyLength) {
+		return false;
+	}
+
+	TaskExtra& extra = taskExtra(*it);
+	extra.key = key;
+
+#ifdef RHYTHM_TASK_LOG
+	// Keyed one-shot tasks are durable while the log is open
+	if (m_taskLog && !it->recurring) {
+		if (extra.logId == 0) {
+			extra.logId = m_taskLog->allocateId();
+			m_loggedTaskCount++;
+		}
+		m_taskLog->appendSchedule(
+			extra.logId,
+			scheduler_detail::toWallMs<Clock>(effectiveDeadline(*it)), key);
+	}
+#endif	// RHYTHM_TASK_LOG
+
+	return true;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::saveSnapshot(const std::string& path) const {
+	using namespace scheduler_detail;
+
+	// Gather the tasks that can be restored
+	std::vector<std::pair<const Task*, const TaskExtra*>> tasks;
+	forEachTask(*this, [this, &tasks](const Task& task) {
+		const TaskExtra* extra = task.active ? findTaskExtra(task) : nullptr;
+		if (extra && !extra->key.empty()) {
+			tasks.emplace_back(&task, extra);
+		}
+	});
+
+	// Keys are stored with a 16 bit length, a longer one would be restored
+	// as a different key
+	for (const auto& item : tasks) {
+		if (item.second->key.size() > MaxKeyLength) {
+			return false;
+		}
+	}
+
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			return false;
+		}
+
+		out.write(SnapshotMagic, sizeof(SnapshotMagic));
+		writeValue(out, SnapshotVersion);
+		writeValue(out, static_cast<std::uint32_t>(tasks.size()));
+
+		for (const auto& item : tasks) {
+			const Task& task = *item.first;
+			const std::string& key = item.second->key;
+			std::int64_t deadlineMs = toWallMs<Clock>(effectiveDeadline(task));
+			std::int64_t intervalMs =
+				task.recurring ? taskDuration(task).count() : 0;
+			std::uint8_t flags = task.skipIfLate ? SnapshotFlagSkipIfLate : 0;
+			auto keyLength = static_cast<std::uint16_t>(key.size());
+
+			writeValue(out, deadlineMs);
+			writeValue(out, intervalMs);
+			writeValue(out, flags);
+			writeValue(out, keyLength);
+			out.write(key.data(), keyLength);
+		}
+
+		if (!out.flush()) {
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+	}
+
+	return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::loadSnapshot(
+	const std::string& path, std::vector<SnapshotEntry>& entries) {
+	using namespace scheduler_detail;
+
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		return false;
+	}
+
+	// Check the header
+	char magic[sizeof(SnapshotMagic)];
+	std::uint32_t version;
+	std::uint32_t count;
+	if (!in.read(magic, sizeof(magic)) ||
+		!std::equal(magic, magic + sizeof(magic), SnapshotMagic) ||
+		!readValue(in, version) || version != SnapshotVersion ||
+		!readValue(in, count)) {
+		return false;
+	}
+
+	std::vector<SnapshotEntry> loaded;
+	loaded.reserve(count);
+	for (std::uint32_t i = 0; i < count; i++) {
+		std::int64_t deadlineMs;
+		std::int64_t intervalMs;
+		std::uint8_t flags;
+		std::uint16_t keyLength;
+		if (!readValue(in, deadlineMs) || !readValue(in, intervalMs) ||
+			!readValue(in, flags) || !readValue(in, keyLength)) {
+			return false;
+		}
+
+		SnapshotEntry entry;
+		entry.key.resize(keyLength);
+		if (!in.read(&entry.key[0], keyLength)) {
+			return false;
+		}
+		entry.nextRun = fromWallMs<Clock>(deadlineMs);
+		entry.interval = DurationMs(intervalMs);
+		entry.skipIfLate = (flags & SnapshotFlagSkipIfLate) != 0;
+
+		loaded.push_back(std::move(entry));
+	}
+
+	entries = std::move(loaded);
+	return true;
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::restoreTask(
+	const SnapshotEntry& entry,
+	const TaskFn& func,
+	const TaskFn cleanup,
+	int batchRef) {
+	// Create the task
+	Task task = newTask(newCallback(func, cleanup, batchRef));
+	setDeadline(task, entry.nextRun);
+	setDuration(task, entry.interval);
+	task.recurring = entry.interval.count() > 0;
+	task.skipIfLate = entry.skipIfLate;
+	if (!entry.key.empty()) {
+		taskExtra(task).key = entry.key;
+	}
+
+#ifdef RHYTHM_TASK_LOG
+	// The task is already in the log, keep its ID so completing it is logged
+	if (m_taskLog && entry.logId != 0) {
+		taskExtra(task).logId = entry.logId;
+		m_loggedTaskCount++;
+	}
+#endif	// RHYTHM_TASK_LOG
+
+	// Restored deadlines are in no particular order, so the task isn't put
+	// in a timer list
+	return addTask(std::move(task), DurationMs::zero());
+}
+
+#ifdef RHYTHM_TASK_LOG
+
+template <typename Policy>
+bool BasicScheduler<Policy>::openTaskLog(
+	const std::string& path, std::vector<SnapshotEntry>& pending) {
+	closeTaskLog();
+
+	auto log = std::make_unique<TaskLog>();
+	std::vector<TaskLog::Entry> entries;
+	if (!log->open(path, entries)) {
+		return false;
+	}
+	m_taskLog = std::move(log);
+
+	pending.clear();
+	pending.reserve(entries.size());
+	for (TaskLog::Entry& entry : entries) {
+		SnapshotEntry restored;
+		restored.key = std::move(entry.key);
+		restored.nextRun =
+			scheduler_detail::fromWallMs<Clock>(entry.deadlineMs);
+		restored.logId = entry.id;
+		pending.push_back(std::move(restored));
+	}
+
+	// Pending tasks that aren't restored shouldn't count as logged
+	m_loggedTaskCount = 0;
+
+	return true;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::closeTaskLog() {
+	if (!m_taskLog) {
+		return;
+	}
+
+	logTouchedTasks();
+	m_taskLog->close();
+	m_taskLog.reset();
+
+	// Tasks are no longer logged
+	for (auto& item : m_taskExtras) {
+		item.second.logId = 0;
+	}
+	m_loggedTaskCount = 0;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::commitTaskLog() {
+	if (!m_taskLog) {
+		return true;
+	}
+
+	logTouchedTasks();
+
+	std::size_t records = m_taskLog->recordCount();
+	if (records >= scheduler_detail::TaskLogCompactMinRecords &&
+		records > 2 * m_loggedTaskCount) {
+		// Rewrite the log with just the tasks that are still pending
+		std::vector<TaskLog::Entry> live;
+		live.reserve(m_loggedTaskCount);
+		for (const auto& item : m_taskExtras) {
+			const Task* task =
+				item.second.logId != 0 ? findTask(item.first) : nullptr;
+			if (task) {
+				TaskLog::Entry entry;
+				entry.id = item.second.logId;
+				entry.deadlineMs = scheduler_detail::toWallMs<Clock>(
+					effectiveDeadline(*task));
+				entry.key = item.second.key;
+				live.push_back(std::move(entry));
+			}
+		}
+
+		if (m_taskLog->commit() && m_taskLog->compact(live)) {
+			return true;
+		}
+	}
+
+	return m_taskLog->commit();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::logTaskDone(Task& task) {
+	if (!m_taskLog || !task.extra) {
+		return;
+	}
+
+	TaskExtra& extra = taskExtra(task);
+	if (extra.logId != 0) {
+		m_taskLog->appendDone(extra.logId);
+		extra.logId = 0;
+		m_loggedTaskCount--;
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::logTouchedTasks() {
+	for (TaskId id : m_touchedLoggedTasks) {
+		// Tasks that fired or were cancelled since are already done
+		Task* task = findTask(id);
+		if (!task || !task->extra) {
+			continue;
+		}
+
+		TaskExtra& extra = taskExtra(*task);
+		if (extra.logTouched && extra.logId != 0) {
+			m_taskLog->appendSchedule(
+				extra.logId,
+				scheduler_detail::toWallMs<Clock>(effectiveDeadline(*task)),
+				extra.key);
+		}
+		extra.logTouched = false;
+	}
+	m_touchedLoggedTasks.clear();
+}
+
+#endif	// RHYTHM_TASK_LOG
+
+template <typename Policy>
+typename BasicScheduler<Policy>::TaskId BasicScheduler<Policy>::addIdleCallback(
+	const TaskFn& func, const TaskFn cleanup) {
+	IdleCallback callback;
+	callback.id = m_nextId++;
+	callback.func = func;
+	callback.cleanup = cleanup;
+	callback.active = true;
+
+	m_idleIndex[callback.id] = m_idleCallbacks.size();
+	m_idleCallbacks.push_back(std::move(callback));
+
+	return callback.id;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setIdleOptions(
+	const DurationMs& horizon, const DurationMs& budget) {
+	m_idleHorizon = horizon;
+	m_idleBudget = budget;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::cancelTask(TaskId id) {
+	// Find the task and mark it as inactive, along with the tasks held on it
+	Task* task = findTask(id);
+	if (task) {
+		cancelDependents(id);
+		finishTask(*task);
+		return true;
+	}
+
+	if (cancelHeldTask(id)) {
+		return true;
+	}
+
+	// Otherwise it may be an idle callback
+	auto idleIt = m_idleIndex.find(id);
+	if (idleIt != m_idleIndex.end()) {
+		TaskFn cleanup = std::move(m_idleCallbacks[idleIt->second].cleanup);
+		removeIdleCallback(idleIt->second);
+
+		if (cleanup) {
+			cleanup(id);
+		}
+		return true;
+	}
+	return false;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::removeIdleCallback(std::size_t index) {
+	IdleCallback& callback = m_idleCallbacks[index];
+	m_idleIndex.erase(callback.id);
+	if (m_runningIdle) {
+		// Positions must not change under the running callbacks
+		callback.active = false;
+		return;
+	}
+
+	// Fill the gap with the last callback
+	if (index + 1 < m_idleCallbacks.size()) {
+		callback = std::move(m_idleCallbacks.back());
+		m_idleIndex[callback.id] = index;
+	}
+	m_idleCallbacks.pop_back();
+	if (m_idleCursor >= m_idleCallbacks.size()) {
+		m_idleCursor = 0;
+	}
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::touchTask(TaskId id) {
+	Task* task = findTask(id);
+	if (!task || task->duration == 0) {
+		return false;
+	}
+
+	task->touched = toEpochMs(Clock::now());
+
+#ifdef RHYTHM_TASK_LOG
+	// The log only needs the last touch before the commit
+	if (m_taskLog && task->extra) {
+		TaskExtra& extra = taskExtra(*task);
+		if (extra.logId != 0 && !extra.logTouched) {
+			extra.logTouched = true;
+			m_touchedLoggedTasks.push_back(id);
+		}
+	}
+#endif	// RHYTHM_TASK_LOG
+
+	return true;
+}
+
+template <typename Policy>
+std::size_t BasicScheduler<Policy>::tick() {
+#ifdef RHYTHM_POLL_FD
+	// Until there is something new to do, the descriptor isn't readable
+	if (m_pollFd) {
+		m_pollFd->drain();
+	}
+#endif	// RHYTHM_POLL_FD
+
+	// Run functions posted from other threads
+	if (m_hasPosted.load(std::memory_order_acquire)) {
+		runPosted();
+	}
+
+#ifdef RHYTHM_IO_URING
+	// Run completions of I/O that finished since the last tick
+	if (m_ioRing) {
+		m_ioRing->poll();
+	}
+#endif	// RHYTHM_IO_URING
+
+#ifdef RHYTHM_PATH_WATCH
+	// Without a poll on the ring, read the inotify descriptor on each tick
+	if (!m_pathWatches.empty() && !pathWatcherOnRing()) {
+		readPathWatcher();
+
+#ifdef RHYTHM_IO_URING
+		// The last poll couldn't be submitted, try again
+		if (m_ioRing) {
+			pollPathWatcher();
+		}
+#endif	// RHYTHM_IO_URING
+	}
+#endif	// RHYTHM_PATH_WATCH
+
+	auto now = Clock::now();
+	m_nextTaskTime = TimePoint::max();
+	m_tickRuns = 0;
+
+	// Keep task times well within range
+	if (now - m_epoch >= DurationMs(scheduler_detail::RebaseEpochMs)) {
+		rebaseEpoch(now);
+	}
+	EpochMs nowMs = toEpochMs(now);
+
+	// Buckets filled while running are left for the next tick
+	takeDueBuckets(nowMs);
+
+	// Tasks added while running are left for the next tick
+	std::size_t count = m_tasks.size();
+	for (std::size_t i = 0; i < count; i++) {
+		Task& task = m_tasks[i];
+
+		// Skip inactive tasks
+		if (!task.active)
+			continue;
+
+		// Check if it's time to run the task, unless it was touched since
+		if (task.nextRun <= nowMs && !rearmEarly(task, nowMs)) {
+			if (m_batchDispatch &&
+				m_callbacks[task.callback].batchRef != NoBatchRef) {
+				// Leave it to the batch dispatcher
+				if (batchTask(task, nowMs)) {
+					continue;
+				}
+			} else {
+				// Execute the task
+				runTask(task);
+
+				if (task.recurring) {
+					advanceTask(task, nowMs);
+				} else if (task.active) {
+					// One-shot task, deactivate it
+					finishTask(task);
+				}
+			}
+		}
+
+		// Update next task time if the task is still active
+		if (task.active && fromEpochMs(task.nextRun) < m_nextTaskTime) {
+			m_nextTaskTime = fromEpochMs(task.nextRun);
+		}
+	}
+
+	// Run due tasks from the timer lists, only their heads need checking
+	for (auto it = m_timerLists.begin(); it != m_timerLists.end();) {
+		TaskList& list = it->second;
+		runTimerList(list, nowMs);
+
+		// Drop lists that ran out, their duration may not come up again
+		if (list.empty()) {
+			it = m_timerLists.erase(it);
+			continue;
+		}
+
+		if (fromEpochMs(list.front().nextRun) < m_nextTaskTime) {
+			m_nextTaskTime = fromEpochMs(list.front().nextRun);
+		}
+		++it;
+	}
+
+	// Run the tasks rearmed before the tail of their list that are now due
+	if (!m_dueBuckets.empty()) {
+		runDueBuckets(nowMs);
+	}
+	if (!m_deadlineBuckets.empty() &&
+		m_deadlineBuckets.begin()->first < m_nextTaskTime) {
+		m_nextTaskTime = m_deadlineBuckets.begin()->first;
+	}
+
+	// Run the batched tasks
+	if (!m_batch.empty()) {
+		dispatchBatch();
+	}
+
+	// Compact only once tombstones make up too much of the stored tasks, so
+	// ticks that expire nothing do no compaction work
+	std::size_t stored = storedTaskCount();
+	std::size_t tombstones = stored - m_taskCount;
+	if (tombstones >= scheduler_detail::CompactMinTombstones &&
+		tombstones > m_tombstoneThreshold * stored) {
+		compactTasks();
+	}
+
+	// No callback released so far can still be running
+	reclaimCallbacks();
+
+	// Resume continuations that are due
+	while (!m_continuations.empty() && m_continuations.front().time <= now) {
+		std::pop_heap(m_continuations.begin(), m_continuations.end(),
+					  std::greater<Continuation>());
+		Continuation continuation = m_continuations.back();
+		m_continuations.pop_back();
+
+		continuation.resume(continuation.context);
+	}
+
+	// Include the earliest continuation in the next task time
+	if (!m_continuations.empty() &&
+		m_continuations.front().time < m_nextTaskTime) {
+		m_nextTaskTime = m_continuations.front().time;
+	}
+
+#ifdef RHYTHM_TASK_LOG
+	// Group commit everything logged during this tick
+	commitTaskLog();
+#endif	// RHYTHM_TASK_LOG
+
+#ifdef RHYTHM_POLL_FD
+	// The timer may have expired, always rearm it
+	if (m_pollFd) {
+		armPollFd();
+	}
+#endif	// RHYTHM_POLL_FD
+
+	return m_tickRuns;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::post(const PostFn& fn) {
+	std::lock_guard<std::mutex> lock(m_postMutex);
+
+	// Only the first function since the last tick needs to wake the loop
+	bool wake = m_posted.empty();
+	m_posted.push_back(fn);
+	m_hasPosted.store(true, std::memory_order_release);
+	if (!wake) {
+		return;
+	}
+
+#ifdef RHYTHM_WAKE_FD
+	// Signaled under the lock, so it pairs with the functions runPosted()
+	// takes. Can only fail if the counter is about to overflow, in which case
+	// the descriptor is already readable.
+	if (m_wakeFd >= 0) {
+		std::uint64_t one = 1;
+		(void)!::write(m_wakeFd, &one, sizeof(one));
+	}
+#else
+	m_postCondition.notify_one();
+#endif	// RHYTHM_WAKE_FD
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::runPosted() {
+	// Run them outside the lock, they may post more
+	std::vector<PostFn> posted;
+	{
+		std::lock_guard<std::mutex> lock(m_postMutex);
+		posted.swap(m_posted);
+		m_hasPosted.store(false, std::memory_order_relaxed);
+
+#ifdef RHYTHM_WAKE_FD
+		// The descriptor stays readable until the functions are taken
+		if (m_wakeFd >= 0) {
+			std::uint64_t count;
+			(void)!::read(m_wakeFd, &count, sizeof(count));
+		}
+#endif	// RHYTHM_WAKE_FD
+	}
+
+	for (PostFn& fn : posted) {
+		fn();
+	}
+}
+
+#ifdef RHYTHM_POLL_FD
+
+template <typename Policy>
+int BasicScheduler<Policy>::pollFd() {
+	if (!m_pollFd) {
+		auto pollFd = std::make_unique<PollFd>();
+		if (!pollFd->open()) {
+			return -1;
+		}
+		m_pollFd = std::move(pollFd);
+		armPollFd();
+
+		// Readable while functions are posted
+		if (m_wakeFd >= 0) {
+			m_pollFd->watch(m_wakeFd);
+		}
+
+#ifdef RHYTHM_IO_URING
+		// Also readable when I/O completes
+		if (m_ioRing) {
+			m_pollFd->watch(m_ioRing->fd());
+		}
+#endif	// RHYTHM_IO_URING
+
+#ifdef RHYTHM_PATH_WATCH
+		// And when a watched path changes
+		if (m_pathWatcher) {
+			m_pollFd->watch(m_pathWatcher->fd());
+		}
+#endif	// RHYTHM_PATH_WATCH
+	}
+	return m_pollFd->fd();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::armPollFd() {
+	m_pollArmedTime = m_nextTaskTime;
+	if (m_nextTaskTime == TimePoint::max()) {
+		m_pollFd->disarm();
+	} else {
+		m_pollFd->arm(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			m_nextTaskTime - Clock::now()));
+	}
+}
+
+#endif	// RHYTHM_POLL_FD
+
+#ifdef RHYTHM_IO_URING
+
+template <typename Policy>
+IoRing* BasicScheduler<Policy>::ioRing() {
+	if (!m_ioRing && !m_ioRingFailed) {
+		auto ring = std::make_unique<IoRing>();
+		if (!ring->open()) {
+			m_ioRingFailed = true;
+			return nullptr;
+		}
+		m_ioRing = std::move(ring);
+
+#ifdef RHYTHM_POLL_FD
+		if (m_pollFd) {
+			m_pollFd->watch(m_ioRing->fd());
+		}
+#endif	// RHYTHM_POLL_FD
+	}
+	return m_ioRing.get();
+}
+
+#endif	// RHYTHM_IO_URING
+
+#ifdef RHYTHM_PATH_WATCH
+
+template <typename Policy>
+int BasicScheduler<Policy>::watchPath(const std::string& path,
+									  std::uint32_t mask,
+									  const DurationMs& window,
+									  const PathWatchFn& fn) {
+	if (!m_pathWatcher) {
+		auto watcher = std::make_unique<PathWatcher>();
+		if (!watcher->open()) {
+			return -1;
+		}
+		m_pathWatcher = std::move(watcher);
+
+#ifdef RHYTHM_POLL_FD
+		if (m_pollFd) {
+			m_pollFd->watch(m_pathWatcher->fd());
+		}
+#endif	// RHYTHM_POLL_FD
+	}
+
+	int id = m_pathWatcher->add(path, mask);
+	if (id < 0) {
+		return -1;
+	}
+	m_pathWatches[id] = PathWatch{fn, window};
+
+#ifdef RHYTHM_IO_URING
+	// Wait in the ring when there is one, so one wait covers everything
+	if (!m_pathWatchPoll && ioRing()) {
+		pollPathWatcher();
+	}
+#endif	// RHYTHM_IO_URING
+	return id;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::unwatchPath(int id) {
+	auto it = m_pathWatches.find(id);
+	if (it == m_pathWatches.end()) {
+		return false;
+	}
+
+	if (it->second.flushTask) {
+		cancelTask(it->second.flushTask);
+	}
+	m_pathWatches.erase(it);
+	m_pathWatcher->remove(id);
+
+#ifdef RHYTHM_IO_URING
+	// Without watches, stop waiting so the loop can end
+	if (m_pathWatches.empty() && m_pathWatchPoll) {
+		m_ioRing->cancel(m_pathWatchPoll);
+		m_pathWatchPoll = 0;
+		++m_pathWatchPolls;
+	}
+#endif	// RHYTHM_IO_URING
+	return true;
+}
+
+#ifdef RHYTHM_IO_URING
+
+template <typename Policy>
+void BasicScheduler<Policy>::pollPathWatcher() {
+	std::uint64_t poll = ++m_pathWatchPolls;
+	m_pathWatchPoll = m_ioRing->pollOnce(
+		m_pathWatcher->fd(), POLLIN, [this, poll](int result) {
+			if (poll != m_pathWatchPolls) {
+				return;
+			}
+			m_pathWatchPoll = 0;
+			if (result < 0) {
+				return;
+			}
+
+			readPathWatcher();
+			if (!m_pathWatches.empty()) {
+				pollPathWatcher();
+			}
+		});
+}
+
+#endif	// RHYTHM_IO_URING
+
+template <typename Policy>
+bool BasicScheduler<Policy>::pathWatcherOnRing() const {
+#ifdef RHYTHM_IO_URING
+	return m_pathWatchPoll != 0;
+#else
+	return false;
+#endif	// RHYTHM_IO_URING
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::readPathWatcher() {
+	// Open a coalescing window for watches that got their first event
+	std::vector<int> pending;
+	m_pathWatcher->read(pending);
+	for (int id : pending) {
+		// Removed by an earlier callback while its events were read
+		auto it = m_pathWatches.find(id);
+		if (it == m_pathWatches.end()) {
+			continue;
+		}
+		it->second.flushTask = scheduleAfter(
+			it->second.window, [this, id](TaskId) { flushPathWatch(id); });
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::flushPathWatch(int id) {
+	auto it = m_pathWatches.find(id);
+	PathWatcher::Events events;
+	if (it == m_pathWatches.end() || !m_pathWatcher->take(id, events)) {
+		return;
+	}
+	it->second.flushTask = 0;
+
+	// The callback may remove the watch
+	PathWatchFn fn = it->second.fn;
+	fn(id, events);
+}
+
+#endif	// RHYTHM_PATH_WATCH
+
+#ifdef RHYTHM_WAKE_FD
+
+#ifdef RHYTHM_IO_URING
+
+template <typename Policy>
+void BasicScheduler<Policy>::waitIoRing(std::chrono::nanoseconds timeout) {
+	// The poll completes when a function is posted, and is submitted again
+	// by the next wait once the tick has taken them
+	if (!m_wakePoll && m_wakeFd >= 0) {
+		m_wakePoll = m_ioRing->pollOnce(m_wakeFd, POLLIN,
+										[this](int) { m_wakePoll = 0; });
+	}
+	m_ioRing->wait(timeout);
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::ioInFlight() const {
+	return m_ioRing->pendingCount() > (m_wakePoll ? 1 : 0);
+}
+
+#endif	// RHYTHM_IO_URING
+
+template <typename Policy>
+void BasicScheduler<Policy>::waitWakeFd(std::chrono::nanoseconds timeout) {
+	struct pollfd watched[2] = {};
+	nfds_t count = 0;
+	if (m_wakeFd >= 0) {
+		watched[count].fd = m_wakeFd;
+		watched[count].events = POLLIN;
+		count++;
+	}
+
+#ifdef RHYTHM_PATH_WATCH
+	// Events are read by the next tick
+	if (!m_pathWatches.empty()) {
+		watched[count].fd = m_pathWatcher->fd();
+		watched[count].events = POLLIN;
+		count++;
+	}
+#endif	// RHYTHM_PATH_WATCH
+
+	// Unlike poll(), the timeout isn't rounded to milliseconds
+	struct timespec spec = {};
+	if (timeout.count() >= 0) {
+		auto seconds =
+			std::chrono::duration_cast<std::chrono::seconds>(timeout);
+		spec.tv_sec = static_cast<time_t>(seconds.count());
+		spec.tv_nsec = static_cast<long>((timeout - seconds).count());
+	}
+	::ppoll(watched, count, timeout.count() >= 0 ? &spec : nullptr, nullptr);
+}
+
+#endif	// RHYTHM_WAKE_FD
+
+template <typename Policy>
+void BasicScheduler<Policy>::sleepUntil(const TimePoint& time) {
+	auto now = Clock::now();
+	auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		time > now ? time - now : Clock::duration::zero());
+
+#ifdef RHYTHM_WAKE_FD
+#ifdef RHYTHM_IO_URING
+	if (m_ioRing) {
+		waitIoRing(timeout);
+		return;
+	}
+#endif	// RHYTHM_IO_URING
+
+	waitWakeFd(timeout);
+#else
+	std::unique_lock<std::mutex> lock(m_postMutex);
+	m_postCondition.wait_for(lock, timeout,
+							 [this] { return !m_posted.empty(); });
+#endif	// RHYTHM_WAKE_FD
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setTombstoneThreshold(double fraction) {
+	m_tombstoneThreshold = std::clamp(fraction, 0.0, 1.0);
+}
+
+template <typename Policy>
+std::size_t BasicScheduler<Policy>::storedTaskCount() const {
+	std::size_t stored =
+		m_tasks.size() + m_batchOneShots.size() + m_bucketTaskCount;
+	for (const auto& item : m_timerLists) {
+		stored += item.second.size();
+	}
+	return stored;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::compactTasks() {
+	compactList(m_tasks);
+
+	for (auto it = m_timerLists.begin(); it != m_timerLists.end();) {
+		compactList(it->second);
+		if (it->second.empty()) {
+			it = m_timerLists.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	for (auto it = m_deadlineBuckets.begin(); it != m_deadlineBuckets.end();) {
+		m_bucketTaskCount -= it->second.size();
+		compactList(it->second);
+		m_bucketTaskCount += it->second.size();
+		if (it->second.empty()) {
+			it = m_deadlineBuckets.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	if constexpr (Policy::Metrics) {
+		if (m_compactions < std::numeric_limits<unsigned int>::max()) {
+			m_compactions++;
+		}
+	}
+}
+
+template <typename Policy>
+template <typename List>
+void BasicScheduler<Policy>::compactList(List& list) {
+	// Move the active tasks forward, updating the index of the ones that move
+	auto kept = list.begin();
+	for (auto it = list.begin(); it != list.end(); ++it) {
+		if (!it->active) {
+			continue;
+		}
+		if (kept != it) {
+			*kept = std::move(*it);
+			m_taskIndex[kept->id] = &*kept;
+		}
+		++kept;
+	}
+	list.erase(kept, list.end());
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setBatchDispatcher(const BatchFn& dispatch) {
+	m_batchDispatch = dispatch;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::clearBatchDispatcher() {
+	m_batchDispatch = BatchFn();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::dispatchBatch() {
+	TimePoint start;
+	if constexpr (Policy::Metrics) {
+		start = Clock::now();
+	}
+
+	m_batchDispatch(m_batch);
+
+	if constexpr (Policy::Metrics) {
+		auto runTime =
+			std::chrono::duration_cast<DurationMs>(Clock::now() - start);
+		noteRunTime(runTime);
+	}
+
+	// Complete the one-shot tasks, unless the batch cancelled them
+	for (Task& task : m_batchOneShots) {
+		if (task.active) {
+			finishTask(task);
+		}
+	}
+
+	m_batch.clear();
+	m_batchOneShots.clear();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::runTask(Task& task) {
+	TimePoint start;
+	bool wasLate = false;
+	if constexpr (Policy::Metrics) {
+		// Measure start time
+		start = Clock::now();
+
+		// Consider a task run as "late" if it starts significantly after its
+		// scheduled time
+		wasLate = start > fromEpochMs(task.nextRun) + LateThreshold;
+	}
+
+	// Execute the task
+	m_tickRuns++;
+	m_callbacks[task.callback].func(task.id);
+
+	if constexpr (Policy::Metrics) {
+		// Measure run duration and record metrics
+		auto end = Clock::now();
+		auto runDuration = std::chrono::duration_cast<DurationMs>(end - start);
+		noteTaskRun(runDuration, wasLate);
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::advanceTask(Task& task, EpochMs now) {
+	std::int64_t nextRun = task.nextRun;
+	std::int64_t interval = taskDuration(task).count();
+
+	// Reschedule recurring task
+	if (task.skipIfLate) {
+		// Skip missed runs
+		while (nextRun <= now) {
+			nextRun += interval;
+		}
+	} else {
+		// Schedule for the next interval
+		nextRun += interval;
+	}
+
+	setNextRun(task, nextRun);
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::rearmRetry(Task& task, const DurationMs& delay) {
+	// advanceTask() then moves it on by the delay from now. The delay is at
+	// least 1ms, so a task failing right away doesn't spin the loop.
+	setDuration(task, std::max(delay, DurationMs(1)));
+	setNextRun(task, toEpochMs(Clock::now()));
+	task.touched = scheduler_detail::NotTouched;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::rearmEarly(Task& task, EpochMs now) {
+	// A far deadline may still be out of range
+	if (task.far) {
+		setDeadline(task, m_taskExtras[task.id].deadline);
+		if (task.nextRun > now) {
+			return true;
+		}
+	}
+
+	if (task.touched == scheduler_detail::NotTouched) {
+		return false;
+	}
+
+	std::int64_t deadline =
+		std::int64_t(task.touched) + taskDuration(task).count();
+	task.touched = scheduler_detail::NotTouched;
+
+	// The time since the last touch may already cover the duration
+	if (deadline <= now) {
+		return false;
+	}
+
+	setNextRun(task, deadline);
+	return true;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::finishTask(Task& task) {
+	task.active = false;
+	m_taskCount--;
+	m_taskIndex.erase(task.id);
+
+#ifdef RHYTHM_TASK_LOG
+	logTaskDone(task);
+#endif	// RHYTHM_TASK_LOG
+
+	// Call cleanup function if provided
+	Callback& callback = m_callbacks[task.callback];
+	if (callback.cleanup) {
+		callback.cleanup(task.id);
+	}
+
+	if (task.extra) {
+		m_taskExtras.erase(task.id);
+	}
+	releaseCallback(task.callback);
+
+	// Whatever waited for the task can go ahead
+	if (!m_dependents.empty()) {
+		releaseDependents(task.id);
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::releaseDependents(TaskId id) {
+	auto it = m_dependents.find(id);
+	if (it == m_dependents.end()) {
+		return;
+	}
+	std::vector<TaskId> dependents = std::move(it->second);
+	m_dependents.erase(it);
+
+	auto now = Clock::now();
+	for (TaskId dependent : dependents) {
+		// Skip tasks cancelled since, and those still waiting for others
+		auto heldIt = m_heldTasks.find(dependent);
+		if (heldIt == m_heldTasks.end() || --heldIt->second.remaining > 0) {
+			continue;
+		}
+
+		HeldTask held = std::move(heldIt->second);
+		m_heldTasks.erase(heldIt);
+		setDeadline(held.task, now + held.delay);
+		setDuration(held.task, held.delay);
+		addTask(std::move(held.task), held.delay);
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::cancelDependents(TaskId id) {
+	auto it = m_dependents.find(id);
+	if (it == m_dependents.end()) {
+		return;
+	}
+	std::vector<TaskId> dependents = std::move(it->second);
+	m_dependents.erase(it);
+
+	for (TaskId dependent : dependents) {
+		cancelHeldTask(dependent);
+	}
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::cancelHeldTask(TaskId id) {
+	auto it = m_heldTasks.find(id);
+	if (it == m_heldTasks.end()) {
+		return false;
+	}
+	CallbackId callback = it->second.task.callback;
+	m_heldTasks.erase(it);
+
+	// Cancel its own dependents first, as for a scheduled task
+	cancelDependents(id);
+
+	if (m_callbacks[callback].cleanup) {
+		m_callbacks[callback].cleanup(id);
+	}
+	releaseCallback(callback);
+	return true;
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::batchTask(Task& task, EpochMs now) {
+	m_batch.push_back(
+		BatchEntry{task.id, m_callbacks[task.callback].batchRef});
+	m_tickRuns++;
+
+	if constexpr (Policy::Metrics) {
+		// The run time is noted for the whole batch
+		noteTaskRun(DurationMs::zero(),
+					now > task.nextRun + LateThreshold.count());
+	}
+
+	if (task.recurring) {
+		advanceTask(task, now);
+		return false;
+	}
+
+	// One-shot task, completed once the batch has run
+	m_batchOneShots.push_back(std::move(task));
+	m_taskIndex[task.id] = &m_batchOneShots.back();
+	task.active = false;
+	return true;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::runTimerList(TaskList& list, EpochMs now) {
+	// Each task runs at most once per tick, even if it is rearmed while
+	// still due
+	std::size_t remaining = list.size();
+	while (remaining > 0 && !list.empty()) {
+		Task& task = list.front();
+		if (task.active && task.nextRun > now) {
+			break;
+		}
+		remaining--;
+
+		// Drop cancelled tasks and the ones that are done
+		if (!task.active || !runListedTask(task, now)) {
+			list.pop_front();
+			continue;
+		}
+
+		// Move the rearmed task to its place
+		Task rearmed = std::move(task);
+		list.pop_front();
+		insertOrdered(list, std::move(rearmed));
+	}
+
+	// Drop cancelled tasks that are now at the head
+	while (!list.empty() && !list.front().active) {
+		list.pop_front();
+	}
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::runListedTask(Task& task, EpochMs now) {
+	if (rearmEarly(task, now)) {
+		// Touched since it was armed or only its range ran out, wait for the
+		// rest of its duration
+		return true;
+	}
+
+	if (m_batchDispatch && m_callbacks[task.callback].batchRef != NoBatchRef) {
+		// Leave it to the batch dispatcher
+		return !batchTask(task, now);
+	}
+
+	// Execute the task, it may cancel itself
+	runTask(task);
+	if (!task.active) {
+		return false;
+	}
+
+	if (!task.recurring) {
+		// One-shot task, deactivate it
+		finishTask(task);
+		return false;
+	}
+	advanceTask(task, now);
+	return true;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::takeDueBuckets(EpochMs now) {
+	TimePoint due = fromEpochMs(now);
+	while (!m_deadlineBuckets.empty() &&
+		   m_deadlineBuckets.begin()->first <= due) {
+		// Moving the bucket keeps its tasks in place
+		m_dueBuckets.push_back(std::move(m_deadlineBuckets.begin()->second));
+		m_deadlineBuckets.erase(m_deadlineBuckets.begin());
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::runDueBuckets(EpochMs now) {
+	for (Bucket& bucket : m_dueBuckets) {
+		for (Task& task : bucket) {
+			// Drop cancelled tasks and the ones that are done
+			if (!task.active || !runListedTask(task, now)) {
+				continue;
+			}
+
+			if (fromEpochMs(task.nextRun) < m_nextTaskTime) {
+				m_nextTaskTime = fromEpochMs(task.nextRun);
+			}
+			// Leave a tombstone, the bucket is only dropped once all of its
+			// tasks ran
+			Task rearmed = std::move(task);
+			task.active = false;
+			insertOrdered(m_timerLists[taskDuration(rearmed).count()],
+						  std::move(rearmed));
+		}
+		m_bucketTaskCount -= bucket.size();
+	}
+	m_dueBuckets.clear();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::scheduleContinuation(const TimePoint& time,
+												  ContinuationFn resume,
+												  ContinuationFn destroy,
+												  void* context) {
+	m_continuations.push_back(Continuation{time, resume, destroy, context});
+	std::push_heap(m_continuations.begin(), m_continuations.end(),
+				   std::greater<Continuation>());
+
+	// Update next task time
+	if (time < m_nextTaskTime) {
+		m_nextTaskTime = time;
+
+#ifdef RHYTHM_POLL_FD
+		if (m_pollFd && m_nextTaskTime < m_pollArmedTime) {
+			armPollFd();
+		}
+#endif	// RHYTHM_POLL_FD
+	}
+}
+
+template <typename Policy>
+void* BasicScheduler<Policy>::allocateFrame(std::size_t size) {
+	std::size_t sizeClass = (size + FrameSizeClass - 1) / FrameSizeClass;
+	if (sizeClass == 0 || sizeClass > FrameSizeClasses) {
+		return ::operator new(size);
+	}
+
+	// Reuse a pooled frame of the same size class if there is one
+	std::vector<void*>& frames = m_framePool[sizeClass - 1];
+	if (!frames.empty()) {
+		void* frame = frames.back();
+		frames.pop_back();
+		return frame;
+	}
+	return ::operator new(sizeClass * FrameSizeClass);
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::freeFrame(void* frame, std::size_t size) {
+	std::size_t sizeClass = (size + FrameSizeClass - 1) / FrameSizeClass;
+	if (sizeClass == 0 || sizeClass > FrameSizeClasses) {
+		::operator delete(frame);
+		return;
+	}
+
+	m_framePool[sizeClass - 1].push_back(frame);
+}
+
+template <typename Policy>
+bool BasicScheduler<Policy>::loop() {
+	m_running = true;
+	while (m_running) {
+		tick();
+
+		// A task may have stopped the loop, don't sleep until the next one
+		if (!m_running) {
+			break;
+		}
+
+		// Determine when to wake up next
+		auto wakeTime = nextTaskTime();
+
+		// Run idle callbacks if there is slack before the next task, or
+		// there is no next task
+		if (!m_idleCallbacks.empty()) {
+			runIdleCallbacks(wakeTime ? *wakeTime : TimePoint::max());
+
+			// Callbacks may have scheduled an earlier task
+			wakeTime = nextTaskTime();
+		}
+
+		if (wakeTime) {
+			// Use the idle gap for garbage collection if enabled
+			if (m_idleGcStep) {
+				runIdleGc(*wakeTime);
+			}
+
+			// Sleep until the next task time
+			sleepUntil(*wakeTime);
+#ifdef RHYTHM_IO_URING
+		} else if (m_ioRing && ioInFlight()) {
+			// No tasks, but I/O in flight whose completions may add some
+			waitIoRing(std::chrono::nanoseconds(-1));
+#endif	// RHYTHM_IO_URING
+#ifdef RHYTHM_PATH_WATCH
+		} else if (!m_pathWatches.empty()) {
+			// No tasks, but watches whose events may add some
+			waitWakeFd(std::chrono::nanoseconds(-1));
+#endif	// RHYTHM_PATH_WATCH
+		} else {
+			// No tasks scheduled, sleep for a short duration
+			sleepUntil(Clock::now() + DurationMs(100));
+			break;	// Exit loop if no tasks are scheduled
+		}
+	}
+
+	return m_running;
+}
+
+template <typename Policy>
+std::size_t BasicScheduler<Policy>::runOnce(const DurationMs& maxWait) {
+	// Wake for the next task, or when the wait runs out
+	auto wakeTime = Clock::now() + maxWait;
+	if (m_nextTaskTime < wakeTime) {
+		wakeTime = m_nextTaskTime;
+	}
+
+	if (maxWait.count() > 0) {
+		sleepUntil(wakeTime);
+	}
+
+	return tick();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::setIdleGc(
+	const GcStepFn& step, const DurationMs& minIdle) {
+	m_idleGcStep = step;
+	m_idleGcMinIdle = minIdle;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::clearIdleGc() {
+	m_idleGcStep = GcStepFn();
+	m_idleGcMinIdle = DurationMs::zero();
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::runIdleCallbacks(const TimePoint& deadline) {
+	auto now = Clock::now();
+	if (deadline - now < m_idleHorizon) {
+		return;
+	}
+
+	// Never run past the next task, even if the budget would allow it
+	auto budgetEnd = std::min(now + m_idleBudget, deadline);
+
+	// Run each callback at most once, resuming from where the last iteration
+	// ran out of budget so every callback gets a turn
+	std::size_t count = m_idleCallbacks.size();
+	m_runningIdle = true;
+	for (std::size_t i = 0; i < count && Clock::now() < budgetEnd; i++) {
+		if (m_idleCursor >= m_idleCallbacks.size()) {
+			m_idleCursor = 0;
+		}
+
+		IdleCallback& callback = m_idleCallbacks[m_idleCursor++];
+		if (callback.active) {
+			callback.func(callback.id);
+		}
+	}
+	m_runningIdle = false;
+
+	// Remove the callbacks cancelled while running
+	std::size_t before = m_idleCallbacks.size();
+	m_idleCallbacks.erase(
+		std::remove_if(
+			m_idleCallbacks.begin(), m_idleCallbacks.end(),
+			[](const IdleCallback& callback) { return !callback.active; }),
+		m_idleCallbacks.end());
+	if (m_idleCallbacks.size() != before) {
+		for (std::size_t i = 0; i < m_idleCallbacks.size(); i++) {
+			m_idleIndex[m_idleCallbacks[i].id] = i;
+		}
+	}
+	if (m_idleCursor >= m_idleCallbacks.size()) {
+		m_idleCursor = 0;
+	}
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::runIdleGc(const TimePoint& deadline) {
+	auto now = Clock::now();
+	if (deadline - now < m_idleGcMinIdle) {
+		return;
+	}
+
+	// Use the longest step seen so far as the estimate for the next one, so
+	// the final step finishes before the deadline
+	typename Clock::duration longestStep = Clock::duration::zero();
+	while (now + longestStep < deadline) {
+		GcStepResult result = m_idleGcStep();
+
+		auto end = Clock::now();
+		auto stepTime = end - now;
+		if (stepTime > longestStep) {
+			longestStep = stepTime;
+		}
+
+		if constexpr (Policy::Metrics) {
+			if (m_gcSteps < std::numeric_limits<unsigned int>::max()) {
+				m_gcSteps++;
+			}
+			m_gcFreedBytes += result.freedBytes;
+			m_gcTime += stepTime;
+		}
+
+		now = end;
+
+		// Don't start a new cycle, the remaining garbage is the next cycle's
+		if (result.cycleComplete) {
+			break;
+		}
+	}
+}
+
+template <typename Policy>
+std::optional<typename BasicScheduler<Policy>::DurationMs>
+BasicScheduler<Policy>::timeUntilNextTask() const {
+	// If no tasks are scheduled, return nullopt
+	if (m_nextTaskTime == TimePoint::max()) {
+		return std::nullopt;
+	}
+
+	// Calculate the duration until the next task
+	auto now = Clock::now();
+
+	// If the next task time is in the past, return zero duration
+	if (m_nextTaskTime <= now) {
+		return DurationMs(0);
+	}
+
+	return std::chrono::duration_cast<DurationMs>(m_nextTaskTime - now);
+}
+
+template <typename Policy>
+std::optional<typename BasicScheduler<Policy>::TimePoint>
+BasicScheduler<Policy>::nextTaskTime() const {
+	if (m_nextTaskTime == TimePoint::max()) {
+		return std::nullopt;
+	}
+	return m_nextTaskTime;
+}
+
+template <typename Policy>
+typename BasicScheduler<Policy>::Metrics BasicScheduler<Policy>::getMetrics()
+	const {
+	auto now = Clock::now();
+
+	Metrics metrics;
+	metrics.totalRuns = m_totalRuns;
+	metrics.lateRuns = m_lateRuns;
+	metrics.totalRunTime = m_totalRunTime;
+	metrics.measurementWindow =
+		std::chrono::duration_cast<DurationMs>(now - m_metricsStartTime);
+	metrics.gcSteps = m_gcSteps;
+	metrics.gcFreedBytes = m_gcFreedBytes;
+	metrics.gcTime = std::chrono::duration_cast<DurationMs>(m_gcTime);
+	metrics.compactions = m_compactions;
+
+	std::size_t stored = storedTaskCount();
+	if (stored > 0) {
+		metrics.tombstoneRatio =
+			static_cast<double>(stored - m_taskCount) / stored;
+	}
+
+	return metrics;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::resetMetrics() {
+	m_totalRuns = 0;
+	m_lateRuns = 0;
+	m_totalRunTime = DurationMs::zero();
+	m_metricsStartTime = Clock::now();
+	m_gcSteps = 0;
+	m_gcFreedBytes = 0;
+	m_gcTime = Clock::duration::zero();
+	m_compactions = 0;
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::noteTaskRun(
+	const DurationMs& runTime, bool wasLate) {
+	// Update total run time, guarding against overflow
+	if (m_totalRuns < std::numeric_limits<unsigned int>::max()) {
+		m_totalRuns++;
+	}
+
+	// Update late run count, guarding against overflow
+	if (wasLate && m_lateRuns < std::numeric_limits<unsigned int>::max()) {
+		m_lateRuns++;
+	}
+
+	noteRunTime(runTime);
+}
+
+template <typename Policy>
+void BasicScheduler<Policy>::noteRunTime(const DurationMs& runTime) {
+	// Accumulate total run time, guarding against overflow
+	auto maxDur = DurationMs::max();
+	if (maxDur - m_totalRunTime > runTime) {
+		m_totalRunTime += runTime;
+	} else {
+		m_totalRunTime = maxDur;
+	}
+}
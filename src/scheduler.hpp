@@ -1,43 +1,175 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "io-ring.hpp"
+#include "path-watcher.hpp"
+#include "poll-fd.hpp"
 #include "rhythm-config.hpp"
+#include "task-log.hpp"
 
-class Scheduler {
+/**
+ * Default scheduler policy, configured by the build options.
+ *
+ * A policy provides:
+ * - `Clock`: the clock used for deadlines and measurements.
+ * - `Container<T>`: the sequence container storing tasks, which must support
+ *   `pop_front()` and keep references valid when appending (like
+ *   `std::deque`).
+ * - `Metrics`: whether metrics are collected. When false, the timing code
+ *   around task runs is compiled out.
+ * - `LateThreshold`: how late a task may start before it counts as late.
+ */
+struct DefaultSchedulerPolicy {
+	using Clock = std::chrono::steady_clock;
+
+	template <typename T>
+	using Container = std::deque<T>;
+
+#ifdef RHYTHM_SCHEDULER_METRICS
+	static constexpr bool Metrics = true;
+#else
+	static constexpr bool Metrics = false;
+#endif	// RHYTHM_SCHEDULER_METRICS
+
+	static constexpr std::chrono::milliseconds LateThreshold =
+		std::chrono::milliseconds(10);
+};
+
+/**
+ * Scheduler for one-shot and recurring tasks, specialized by a compile-time
+ * policy (see `DefaultSchedulerPolicy`).
+ * To use a custom policy, include "scheduler-impl.hpp" and instantiate the
+ * template in one translation unit.
+ */
+template <typename Policy>
+class BasicScheduler {
    public:
 	using TaskId = int;
 	using TaskFn = std::function<void(TaskId)>;
-	using Clock = std::chrono::steady_clock;
-	using TimePoint = Clock::time_point;
+	using Clock = typename Policy::Clock;
+	using TimePoint = typename Clock::time_point;
 	using DurationMs = std::chrono::milliseconds;
 
+	/** Batch reference of tasks that are never batched. */
+	static constexpr int NoBatchRef = -1;
+
+	/** Longest task key, in bytes, that snapshots and the task log store. */
+	static constexpr std::size_t MaxKeyLength = 65535;
+
+	/** A due task handed to the batch dispatcher. */
+	struct BatchEntry {
+		TaskId id;
+		/** The batch reference the task was scheduled with */
+		int ref;
+	};
+
+	/**
+	 * Runs all batched tasks that are due in a tick with a single call.
+	 * See `setBatchDispatcher()`.
+	 */
+	using BatchFn = std::function<void(const std::vector<BatchEntry>&)>;
+
+	/** ID of a task callback shared by several tasks. */
+	using CallbackId = std::uint32_t;
+
+	/** Function resuming or destroying a suspended continuation. */
+	using ContinuationFn = void (*)(void* context);
+
+	/** Function posted to run on the scheduler's thread. */
+	using PostFn = std::function<void()>;
+
+	/** Backoff between the attempts of a retried task, see `scheduleRetry()`. */
+	struct RetryOptions {
+		/** Delay after the first failed attempt */
+		DurationMs base = DurationMs(100);
+		/** Factor the delay grows by after each further failed attempt */
+		double factor = 2;
+		/** Longest delay between attempts */
+		DurationMs maxDelay = DurationMs(30000);
+		/** Most attempts made, 0 for no limit */
+		unsigned int maxAttempts = 0;
+		/** Largest fraction randomly taken off each delay, from 0 to 1 */
+		double jitter = 0;
+	};
+
+	/**
+	 * Makes an attempt of a retried task, numbered from 1.
+	 * Returns true once it succeeded, false to be retried.
+	 */
+	using RetryFn = std::function<bool(TaskId id, unsigned int attempt)>;
+
+#ifdef RHYTHM_PATH_WATCH
+	/**
+	 * Called with the ID of a path watch and the events it coalesced, see
+	 * `watchPath()`.
+	 */
+	using PathWatchFn =
+		std::function<void(int id, const PathWatcher::Events& events)>;
+#endif	// RHYTHM_PATH_WATCH
+
+	BasicScheduler();
+	BasicScheduler(const BasicScheduler&) = delete;
+	BasicScheduler& operator=(const BasicScheduler&) = delete;
+	~BasicScheduler();
+
+	/** Result of a single incremental garbage collection step. */
+	struct GcStepResult {
+		/** Number of bytes released by the step */
+		std::size_t freedBytes = 0;
+		/** True if the step completed a full collection cycle */
+		bool cycleComplete = false;
+	};
+
+	/**
+	 * Performs one bounded, incremental garbage collection step.
+	 * Used by the loop to move collection work into idle gaps.
+	 */
+	using GcStepFn = std::function<GcStepResult()>;
+
 	// Threshold to consider a task run as "late" (in ms)
-	static constexpr DurationMs LateThreshold = DurationMs(10);
+	static constexpr DurationMs LateThreshold = Policy::LateThreshold;
 
 	/**
 	 * Schedule a one-shot task to run at a specific time.
 	 * @param time The time point to run the task.
 	 * @param func The task function to execute.
 	 * @param cleanup Optional cleanup function called after the task completes.
+	 * @param batchRef Reference passed to the batch dispatcher, see
+	 * `setBatchDispatcher()`.
 	 * @return The ID of the scheduled task.
 	 */
 	TaskId scheduleAt(const TimePoint& time,
 					  const TaskFn& func,
-					  const TaskFn cleanup = TaskFn());
+					  const TaskFn cleanup = TaskFn(),
+					  int batchRef = NoBatchRef);
 
 	/**
 	 * Schedule a one-shot task to run after a delay.
 	 * @param delay The delay after which to run the task.
 	 * @param func The task function to execute.
 	 * @param cleanup Optional cleanup function called after the task completes.
+	 * @param batchRef Reference passed to the batch dispatcher, see
+	 * `setBatchDispatcher()`.
 	 * @return The ID of the scheduled task.
 	 */
 	TaskId scheduleAfter(const DurationMs& delay,
 						 const TaskFn& func,
-						 const TaskFn cleanup = TaskFn());
+						 const TaskFn cleanup = TaskFn(),
+						 int batchRef = NoBatchRef);
 
 	/**
 	 * Schedule a recurring task at the given interval.
@@ -47,32 +179,462 @@ class Scheduler {
 	 * @param runImmediately If true, the task will run immediately upon
 	 * scheduling.
 	 * @param skipIfLate If true, skip missed runs if late.
+	 * @param batchRef Reference passed to the batch dispatcher, see
+	 * `setBatchDispatcher()`.
 	 * @return The ID of the scheduled task.
 	 */
 	TaskId scheduleEvery(const DurationMs& interval,
 						 const TaskFn& func,
 						 const TaskFn cleanup = TaskFn(),
 						 bool runImmediately = false,
+						 bool skipIfLate = false,
+						 int batchRef = NoBatchRef);
+
+	/**
+	 * Register a callback that several tasks can share.
+	 * Tasks scheduled with a function get a callback of their own, while
+	 * tasks scheduled with a shared callback only store its ID. Sharing one
+	 * callback keeps large numbers of similar timers, like per-connection
+	 * timeouts, small; the callback tells them apart by the task ID it is
+	 * called with.
+	 * @param func The task function to execute.
+	 * @param cleanup Optional cleanup function called after each task
+	 * completes.
+	 * @param batchRef Reference passed to the batch dispatcher, see
+	 * `setBatchDispatcher()`.
+	 * @return The ID of the callback.
+	 */
+	CallbackId addTaskCallback(const TaskFn& func,
+							   const TaskFn cleanup = TaskFn(),
+							   int batchRef = NoBatchRef);
+
+	/**
+	 * Remove a callback registered with `addTaskCallback()`.
+	 * Tasks already scheduled with it still run, the callback is released
+	 * once they are done.
+	 * @param callback The ID of the callback.
+	 */
+	void removeTaskCallback(CallbackId callback);
+
+	/**
+	 * Schedule a one-shot task with a shared callback to run at a specific
+	 * time.
+	 * @param time The time point to run the task.
+	 * @param callback The ID of a callback from `addTaskCallback()`.
+	 * @return The ID of the scheduled task.
+	 */
+	TaskId scheduleAt(const TimePoint& time, CallbackId callback);
+
+	/**
+	 * Schedule a one-shot task with a shared callback to run after a delay.
+	 * @param delay The delay after which to run the task.
+	 * @param callback The ID of a callback from `addTaskCallback()`.
+	 * @return The ID of the scheduled task.
+	 */
+	TaskId scheduleAfter(const DurationMs& delay, CallbackId callback);
+
+	/**
+	 * Schedule a recurring task with a shared callback.
+	 * @param interval The interval at which to run the task.
+	 * @param callback The ID of a callback from `addTaskCallback()`.
+	 * @param runImmediately If true, the task will run immediately upon
+	 * scheduling.
+	 * @param skipIfLate If true, skip missed runs if late.
+	 * @return The ID of the scheduled task.
+	 */
+	TaskId scheduleEvery(const DurationMs& interval,
+						 CallbackId callback,
+						 bool runImmediately = false,
 						 bool skipIfLate = false);
 
 	/**
-	 * Cancel a scheduled task.
+	 * Schedule a task that is retried with exponential backoff until it
+	 * succeeds. The first attempt is due right away. After a failed one, the
+	 * same task is rearmed with the next delay instead of scheduling a new
+	 * one, so retrying allocates nothing per attempt.
+	 * @param func The attempt function.
+	 * @param options The backoff between attempts.
+	 * @param cleanup Optional cleanup function called once the task succeeded,
+	 * ran out of attempts or was cancelled.
+	 * @return The ID of the scheduled task.
+	 */
+	TaskId scheduleRetry(const RetryFn& func,
+						 const RetryOptions& options,
+						 const TaskFn cleanup = TaskFn());
+
+	/**
+	 * Schedule a one-shot task that is held until other tasks complete, then
+	 * runs after a delay. Each held task counts the predecessors it still
+	 * waits for and each predecessor lists the tasks waiting on it, so
+	 * completing a task releases its dependents directly, without polling.
+	 * Cancelling a task cancels the tasks held on it too.
+	 * @param predecessors The tasks to wait for. Tasks that are no longer
+	 * scheduled count as complete.
+	 * @param delay The delay after the last predecessor completes.
+	 * @param func The task function to execute.
+	 * @param cleanup Optional cleanup function called after the task completes.
+	 * @param batchRef Reference passed to the batch dispatcher, see
+	 * `setBatchDispatcher()`.
+	 * @return The ID of the scheduled task.
+	 */
+	TaskId scheduleAfterTasks(const std::vector<TaskId>& predecessors,
+							  const DurationMs& delay,
+							  const TaskFn& func,
+							  const TaskFn cleanup = TaskFn(),
+							  int batchRef = NoBatchRef);
+
+	/** A pending task as stored in a schedule snapshot. */
+	struct SnapshotEntry {
+		/** User-supplied key identifying the task's callback */
+		std::string key;
+		/** The time the task is next due */
+		TimePoint nextRun;
+		/** Interval of a recurring task, zero if one-shot */
+		DurationMs interval = DurationMs::zero();
+		/** Whether missed runs of a recurring task are skipped */
+		bool skipIfLate = false;
+		/** ID of the task in the durable task log, zero if not logged */
+		std::uint64_t logId = 0;
+	};
+
+	/**
+	 * Attach a snapshot key to a task.
+	 * Only tasks with a key are written by `saveSnapshot()`, since the key is
+	 * the only way to find the task's callback again after a restart. If the
+	 * task log is open, keyed one-shot tasks are also recorded in it.
+	 * @param id The ID of the task.
+	 * @param key The key identifying the task's callback, at most
+	 * `MaxKeyLength` bytes long.
+	 * @return True if the task was found and the key set, false if the task
+	 * wasn't found or the key is too long.
+	 */
+	bool setTaskKey(TaskId id, const std::string& key);
+
+	/**
+	 * Write all pending tasks that have a key to a binary snapshot file.
+	 * The file is written to a temporary path first and renamed into place,
+	 * so an existing snapshot is never left half written.
+	 * @param path The path of the snapshot file.
+	 * @return True if the snapshot was written successfully.
+	 */
+	bool saveSnapshot(const std::string& path) const;
+
+	/**
+	 * Read the entries of a snapshot file written by `saveSnapshot()`.
+	 * @param path The path of the snapshot file.
+	 * @param entries Receives the entries read from the file.
+	 * @return True if the file was read successfully.
+	 */
+	static bool loadSnapshot(const std::string& path,
+							 std::vector<SnapshotEntry>& entries);
+
+	/**
+	 * Schedule a task restored from a snapshot, keeping its deadline,
+	 * interval and key.
+	 * @param entry The snapshot entry to restore.
+	 * @param func The task function to execute.
+	 * @param cleanup Optional cleanup function called after the task
+	 * completes.
+	 * @param batchRef Reference passed to the batch dispatcher, see
+	 * `setBatchDispatcher()`.
+	 * @return The ID of the scheduled task.
+	 */
+	TaskId restoreTask(const SnapshotEntry& entry,
+					   const TaskFn& func,
+					   const TaskFn cleanup = TaskFn(),
+					   int batchRef = NoBatchRef);
+
+#ifdef RHYTHM_TASK_LOG
+	/**
+	 * Open the durable task log, replaying it to find the one-shot tasks
+	 * that were still pending when it was last used.
+	 * While the log is open, scheduling (via `setTaskKey()`), cancelling and
+	 * firing keyed one-shot tasks is recorded in it. Records are committed
+	 * together at the end of each tick.
+	 * Pending tasks that aren't passed to `restoreTask()` are dropped from the
+	 * log when it is next compacted.
+	 * @param path The path of the log file.
+	 * @param pending Receives the pending tasks.
+	 * @return True if the log was opened successfully.
+	 */
+	bool openTaskLog(const std::string& path,
+					 std::vector<SnapshotEntry>& pending);
+
+	/**
+	 * Commit any outstanding records and close the task log.
+	 */
+	void closeTaskLog();
+
+	/**
+	 * Commit outstanding task log records, compacting the log if most of its
+	 * records are no longer needed.
+	 * This is called at the end of every tick.
+	 * @return True if the records were committed successfully.
+	 */
+	bool commitTaskLog();
+#endif	// RHYTHM_TASK_LOG
+
+	/**
+	 * Add a callback that runs only when the loop has slack.
+	 * Idle callbacks are run by `loop()` when no task is due within the idle
+	 * horizon, including when none is scheduled, and only for as long as the
+	 * idle budget allows.
+	 * @param func The callback function to execute.
+	 * @param cleanup Optional cleanup function called when the callback is
+	 * cancelled.
+	 * @return The ID of the idle callback, which can be passed to
+	 * `cancelTask()`.
+	 */
+	TaskId addIdleCallback(const TaskFn& func, const TaskFn cleanup = TaskFn());
+
+	/**
+	 * Configure when idle callbacks are run.
+	 * @param horizon Idle callbacks only run if no task is due within this
+	 * time.
+	 * @param budget The maximum time spent running idle callbacks per loop
+	 * iteration.
+	 */
+	void setIdleOptions(const DurationMs& horizon, const DurationMs& budget);
+
+	/**
+	 * Cancel a scheduled task or idle callback.
 	 * @param id The ID of the task to cancel.
 	 * @return True if the task was found and cancelled, false otherwise.
 	 */
 	bool cancelTask(TaskId id);
 
-	void tick();
+	/**
+	 * Record activity for a task, pushing its deadline back.
+	 * A touched task doesn't run at its current deadline; instead it is
+	 * silently rearmed to run its delay (or interval, if recurring) after
+	 * the last touch. Touching only stores the time, so it is much cheaper
+	 * than cancelling and rescheduling a timeout. Snapshots and the task log
+	 * record the moved deadline, the log once per task at the next commit.
+	 * @param id The ID of a task scheduled with `scheduleAfter()` or
+	 * `scheduleEvery()`.
+	 * @return True if the task was found and touched, false otherwise.
+	 */
+	bool touchTask(TaskId id);
+
+	/**
+	 * Run the tasks that are due.
+	 * @return The number of tasks run, including those handed to the batch
+	 * dispatcher.
+	 */
+	std::size_t tick();
 	bool loop();
 
+	/**
+	 * Run a function on the scheduler's thread, at the start of the next tick.
+	 * This is the only method that may be called from other threads. It wakes
+	 * up `loop()` and `runOnce()` if they are waiting, and makes the poll
+	 * descriptor readable.
+	 * @param fn The function to run.
+	 */
+	void post(const PostFn& fn);
+
+#ifdef RHYTHM_POLL_FD
+	/**
+	 * Get a file descriptor for waiting on the scheduler from an external
+	 * event loop, instead of running `loop()`.
+	 * The descriptor becomes readable when a task is due or a function was
+	 * posted, and stays readable until the next `tick()`, which rearms it for
+	 * the next deadline. It is created on first use and owned by the
+	 * scheduler.
+	 * @return The descriptor, or -1 if it couldn't be created.
+	 */
+	int pollFd();
+#endif	// RHYTHM_POLL_FD
+
+#ifdef RHYTHM_IO_URING
+	/**
+	 * Get the io_uring instance for asynchronous file I/O. While it is open,
+	 * `loop()` and `runOnce()` sleep in it, so they wake up as soon as an
+	 * operation completes and run its completion on the scheduler's thread,
+	 * and `loop()` keeps running while operations are in flight. It is created
+	 * on first use and owned by the scheduler.
+	 * @return The ring, or nullptr if io_uring isn't available.
+	 */
+	IoRing* ioRing();
+#endif	// RHYTHM_IO_URING
+
+#ifdef RHYTHM_PATH_WATCH
+	/**
+	 * Watch a file or directory with inotify, on the same wait as the timers.
+	 * Events are coalesced: the first event of a burst opens a window, and
+	 * `fn` is called once when it closes with everything seen meanwhile.
+	 * The inotify descriptor is polled on the io_uring when there is one,
+	 * otherwise `loop()` waits on it and `tick()` reads it; it is also
+	 * watched by `pollFd()`.
+	 * @param mask The inotify events to report, like `IN_MODIFY`.
+	 * @param window How long to collect events before calling `fn`.
+	 * @return The ID of the watch, or -1 with errno set if it couldn't be
+	 * added.
+	 */
+	int watchPath(const std::string& path,
+				  std::uint32_t mask,
+				  const DurationMs& window,
+				  const PathWatchFn& fn);
+
+	/**
+	 * Stop a watch added by `watchPath()`, dropping events not yet reported.
+	 * @return True if the watch was found and removed.
+	 */
+	bool unwatchPath(int id);
+#endif	// RHYTHM_PATH_WATCH
+
+	/**
+	 * Wait until the next task is due, but no longer than `maxWait`, then run
+	 * the tasks that are due. For hosts driving their own event loop, which
+	 * can't block in `loop()`.
+	 * @param maxWait The longest time to wait, zero to not wait.
+	 * @return The number of tasks run.
+	 */
+	std::size_t runOnce(const DurationMs& maxWait);
+
+	/**
+	 * Enable batched dispatch.
+	 * Instead of calling the function of each due task that has a batch
+	 * reference, `tick()` collects them and calls `dispatch` once with all of
+	 * them. The dispatcher is responsible for running the tasks; recurring
+	 * tasks are rescheduled as usual, and the cleanup of one-shot tasks runs
+	 * after the dispatcher returns. Tasks without a batch reference are still
+	 * run individually.
+	 * @param dispatch Function running a batch of due tasks.
+	 */
+	void setBatchDispatcher(const BatchFn& dispatch);
+
+	/**
+	 * Disable batched dispatch, running every task individually.
+	 */
+	void clearBatchDispatcher();
+
+	/**
+	 * Awaitable that suspends a coroutine until a deadline, after which it is
+	 * resumed directly by `tick()`. Works with any coroutine handle type, see
+	 * "scheduler-coro.hpp" for a coroutine type using the scheduler's frame
+	 * pool.
+	 */
+	class SleepAwaiter {
+	   public:
+		SleepAwaiter(BasicScheduler& scheduler, const TimePoint& deadline)
+			: m_scheduler(scheduler), m_deadline(deadline) {}
+
+		bool await_ready() const { return m_deadline <= Clock::now(); }
+
+		template <typename Handle>
+		void await_suspend(Handle handle) {
+			m_scheduler.scheduleContinuation(m_deadline, &resume<Handle>,
+											 &destroy<Handle>,
+											 handle.address());
+		}
+
+		void await_resume() const {}
+
+	   private:
+		BasicScheduler& m_scheduler;
+		TimePoint m_deadline;
+
+		template <typename Handle>
+		static void resume(void* address) {
+			Handle::from_address(address).resume();
+		}
+
+		template <typename Handle>
+		static void destroy(void* address) {
+			Handle::from_address(address).destroy();
+		}
+	};
+
+	/**
+	 * Suspend the awaiting coroutine for a delay.
+	 * @param delay The delay after which to resume.
+	 */
+	SleepAwaiter sleep(const DurationMs& delay) {
+		return SleepAwaiter(*this, Clock::now() + delay);
+	}
+
+	/**
+	 * Suspend the awaiting coroutine until a specific time.
+	 * @param time The time point at which to resume.
+	 */
+	SleepAwaiter until(const TimePoint& time) {
+		return SleepAwaiter(*this, time);
+	}
+
+	/**
+	 * Schedule a continuation to be resumed by `tick()` at a specific time.
+	 * Unlike tasks, continuations need no allocation beyond their slot in
+	 * the continuation queue.
+	 * @param time The time point to resume the continuation.
+	 * @param resume Function called with `context` to resume it.
+	 * @param destroy Optional function called with `context` if the scheduler
+	 * is destroyed before the continuation was resumed.
+	 * @param context Pointer passed to `resume` or `destroy`.
+	 */
+	void scheduleContinuation(const TimePoint& time,
+							  ContinuationFn resume,
+							  ContinuationFn destroy,
+							  void* context);
+
+	/**
+	 * Allocate a coroutine frame from the scheduler's frame pool.
+	 * Frames are pooled in size classes, so frames of recurring coroutines
+	 * are reused without going to the heap.
+	 * @param size The size of the frame in bytes.
+	 */
+	void* allocateFrame(std::size_t size);
+
+	/**
+	 * Return a frame allocated by `allocateFrame()` to the pool.
+	 * @param frame The frame.
+	 * @param size The size the frame was allocated with.
+	 */
+	void freeFrame(void* frame, std::size_t size);
+
+	/**
+	 * Enable incremental garbage collection while the loop is idle.
+	 * When the next deadline is at least `minIdle` away, `loop()` performs
+	 * GC steps in the gap, stopping before the deadline or once a full cycle
+	 * has completed.
+	 * @param step Function performing one bounded GC step.
+	 * @param minIdle The minimum idle gap required to start collecting.
+	 */
+	void setIdleGc(const GcStepFn& step, const DurationMs& minIdle);
+
+	/**
+	 * Disable idle garbage collection.
+	 */
+	void clearIdleGc();
+
 	void stopLoop() { m_running = false; }
 
 	std::optional<DurationMs> timeUntilNextTask() const;
 	std::optional<TimePoint> nextTaskTime() const;
 
-	std::size_t taskCount() const { return m_tasks.size(); }
+	std::size_t taskCount() const { return m_taskCount + m_heldTasks.size(); }
 
-#ifdef RHYTHM_SCHEDULER_METRICS
+	/**
+	 * Set when cancelled and finished tasks are removed from storage.
+	 * They are left in place as tombstones and skipped, until they make up
+	 * more than the given fraction of the stored tasks, when all storage is
+	 * compacted at the end of a tick.
+	 * @param fraction The fraction of tombstones that triggers compaction,
+	 * from 0 to 1.
+	 */
+	void setTombstoneThreshold(double fraction);
+
+	/**
+	 * Get the number of timer lists, one per delay or interval shared by
+	 * several pending tasks.
+	 */
+	std::size_t timerListCount() const { return m_timerLists.size(); }
+	std::size_t idleCallbackCount() const { return m_idleCallbacks.size(); }
+
+	/**
+	 * Metrics collected by the scheduler. Only collected if the policy
+	 * enables them, otherwise all values stay zero.
+	 */
 	struct Metrics {
 		/** Total number of task runs */
 		unsigned int totalRuns = 0;
@@ -82,6 +644,19 @@ class Scheduler {
 		DurationMs totalRunTime = DurationMs::zero();
 		/** Elapsed time since metrics started/were reset */
 		DurationMs measurementWindow = DurationMs::zero();
+		/** Number of idle garbage collection steps performed */
+		unsigned int gcSteps = 0;
+		/** Total bytes released by idle garbage collection */
+		std::size_t gcFreedBytes = 0;
+		/** Total time spent in idle garbage collection */
+		DurationMs gcTime = DurationMs::zero();
+		/**
+		 * Fraction of stored tasks that are tombstones, cancelled or finished
+		 * but not yet removed. Always measured.
+		 */
+		double tombstoneRatio = 0.0;
+		/** Number of times the stored tasks were compacted */
+		unsigned int compactions = 0;
 
 		/**
 		 * Fraction of time spent running tasks over the measurement window.
@@ -109,29 +684,538 @@ class Scheduler {
 	 */
 	void resetMetrics();
 
-#endif	// RHYTHM_SCHEDULER_METRICS
-
    private:
+	// Milliseconds since the scheduler's epoch
+	using EpochMs = std::int32_t;
+
+	// Tasks are kept small, since there may be millions of them: times are
+	// stored in ms relative to a rolling epoch, functions in the callback
+	// table, and fields most tasks don't need in m_taskExtras
 	struct Task {
 		TaskId id;
+		EpochMs nextRun;
+		EpochMs touched;			  // Last touch, if any
+		std::uint32_t duration;		  // Interval if recurring, otherwise delay
+		std::uint32_t callback : 27;  // Index into m_callbacks, 2^27 at most
+		std::uint32_t active : 1;
+		std::uint32_t recurring : 1;
+		std::uint32_t skipIfLate : 1;
+		std::uint32_t far : 1;	  // Deadline beyond the range of nextRun
+		std::uint32_t extra : 1;  // Has an entry in m_taskExtras
+	};
+
+	// Fields of a task that are rarely needed
+	struct TaskExtra {
+		std::string key;  // Snapshot key, empty if not persisted
+		std::uint64_t logId = 0;  // Task log ID, zero if not logged
+		TimePoint deadline;		  // Deadline, if far
+		DurationMs duration = DurationMs::zero();  // Duration, if too long
+		bool logTouched = false;  // Touched since its deadline was logged
+	};
+
+	struct Callback {
 		TaskFn func;
-		TaskFn cleanup;		  // Optional cleanup function
-		DurationMs interval;  // Zero if one-shot
-		TimePoint nextRun;
-		bool skipIfLate;
+		TaskFn cleanup;	 // Optional cleanup function
+		int batchRef;	 // Reference for the batch dispatcher
+		std::uint32_t refs;	 // Tasks using it, plus one while registered
+	};
+
+	struct IdleCallback {
+		TaskId id;
+		TaskFn func;
+		TaskFn cleanup;	 // Optional cleanup function
 		bool active;
 	};
 
-	std::deque<Task> m_tasks;
+	struct Continuation {
+		TimePoint time;
+		ContinuationFn resume;
+		ContinuationFn destroy;
+		void* context;
+
+		// Orders the continuation heap by earliest time first
+		bool operator>(const Continuation& other) const {
+			return time > other.time;
+		}
+	};
+
+	// Frames are pooled in multiples of this size, larger ones aren't pooled
+	static constexpr std::size_t FrameSizeClass = 64;
+	static constexpr std::size_t FrameSizeClasses = 16;
+
+	using TaskList = typename Policy::template Container<Task>;
+
+	// Times of tasks are relative to this, see rebaseEpoch()
+	TimePoint m_epoch = Clock::now();
+
+	// Tasks scheduled at a specific time, or whose duration isn't shared
+	TaskList m_tasks;
+
+	// Tasks whose delay or interval is shared by other tasks, by duration in
+	// ms. Tasks armed with the same duration expire in the order they were
+	// armed, so each list stays in deadline order by appending, and only its
+	// head needs to be checked. Cancelled tasks are dropped once they reach
+	// the head.
+	std::map<DurationMs::rep, TaskList> m_timerLists;
+
+	// Tasks rearmed to a deadline before the tail of their timer list, after
+	// being touched or running late, by deadline. Each bucket is due at once,
+	// so rearming costs a lookup among the distinct deadlines rather than a
+	// walk through the list. Buckets due in a tick are moved out to run.
+	using Bucket = std::vector<Task>;
+	std::map<TimePoint, Bucket> m_deadlineBuckets;
+	std::vector<Bucket> m_dueBuckets;
+	std::size_t m_bucketTaskCount = 0;
+
+	// Durations seen once, a second task with one of them starts a list
+	std::unordered_set<DurationMs::rep> m_singleDurations;
+
+	std::size_t m_taskCount = 0;
+
+	// Active tasks by ID, kept up to date as tasks move
+	std::unordered_map<TaskId, Task*> m_taskIndex;
+
+	// Extra fields of the tasks that have any, by ID
+	std::unordered_map<TaskId, TaskExtra> m_taskExtras;
+
+	// A task waiting for its predecessors, see scheduleAfterTasks()
+	struct HeldTask {
+		Task task;
+		DurationMs delay;
+		std::size_t remaining;	// Predecessors yet to complete
+	};
+
+	// Held tasks by ID, and by the tasks they wait for. Cancelled held tasks
+	// are only dropped from the lists of their predecessors once those
+	// complete.
+	std::unordered_map<TaskId, HeldTask> m_heldTasks;
+	std::unordered_map<TaskId, std::vector<TaskId>> m_dependents;
+
+	// Task callbacks, by ID. Released callbacks stay intact until the end of
+	// the tick, since they may still be running.
+	typename Policy::template Container<Callback> m_callbacks;
+	std::vector<CallbackId> m_freeCallbacks;
+	std::vector<CallbackId> m_releasedCallbacks;
+
+	// Fraction of tombstones in storage that triggers compaction
+	double m_tombstoneThreshold = 0.25;
+
+	typename Policy::template Container<IdleCallback> m_idleCallbacks;
 	TaskId m_nextId = 1;
 	TimePoint m_nextTaskTime = TimePoint::max();
 	bool m_running = false;
 
+	// Tasks run by the current tick
+	std::size_t m_tickRuns = 0;
+
+	// Functions posted from other threads
+	std::mutex m_postMutex;
+	std::vector<PostFn> m_posted;
+	std::atomic<bool> m_hasPosted{false};
+
+#ifdef RHYTHM_WAKE_FD
+	// Eventfd that is readable while functions are posted, so waits on
+	// descriptors end for them. Created with the scheduler, since other
+	// threads may post at any time.
+	int m_wakeFd = -1;
+#else
+	// Signaled when the first function is posted, to end a sleep
+	std::condition_variable m_postCondition;
+#endif	// RHYTHM_WAKE_FD
+
+	/**
+	 * Internal helper to run the functions posted from other threads.
+	 */
+	void runPosted();
+
+#ifdef RHYTHM_POLL_FD
+	// Pollable descriptor, and the deadline its timer is armed for
+	std::unique_ptr<PollFd> m_pollFd;
+	TimePoint m_pollArmedTime = TimePoint::max();
+
+	/**
+	 * Internal helper to arm the poll descriptor's timer for the next task
+	 * time.
+	 */
+	void armPollFd();
+#endif	// RHYTHM_POLL_FD
+
+#ifdef RHYTHM_IO_URING
+	// Asynchronous file I/O, not retried once it failed to open
+	std::unique_ptr<IoRing> m_ioRing;
+	bool m_ioRingFailed = false;
+#endif	// RHYTHM_IO_URING
+
+#ifdef RHYTHM_PATH_WATCH
+	struct PathWatch {
+		PathWatchFn fn;
+		DurationMs window;
+		// Task reporting the coalesced events, 0 if none is scheduled
+		TaskId flushTask = 0;
+	};
+
+	std::unique_ptr<PathWatcher> m_pathWatcher;
+	std::unordered_map<int, PathWatch> m_pathWatches;
+
+#ifdef RHYTHM_IO_URING
+	// Poll of the inotify descriptor on the ring. Each poll is numbered, so
+	// the completion of a cancelled one is ignored.
+	IoRing::OpId m_pathWatchPoll = 0;
+	std::uint64_t m_pathWatchPolls = 0;
+
+	/**
+	 * Internal helper to wait for inotify events on the ring.
+	 */
+	void pollPathWatcher();
+#endif	// RHYTHM_IO_URING
+
+	/**
+	 * Internal helper to tell whether the inotify descriptor is polled on
+	 * the ring, rather than read by `tick()`.
+	 */
+	bool pathWatcherOnRing() const;
+
+	/**
+	 * Internal helper to read the events that are ready, opening a
+	 * coalescing window for the watches that got their first event.
+	 */
+	void readPathWatcher();
+
+	/**
+	 * Internal helper to report the coalesced events of a path watch.
+	 */
+	void flushPathWatch(int id);
+#endif	// RHYTHM_PATH_WATCH
+
+#ifdef RHYTHM_WAKE_FD
+#ifdef RHYTHM_IO_URING
+	// Poll of the wake descriptor on the ring, kept while the ring waits
+	IoRing::OpId m_wakePoll = 0;
+
+	/**
+	 * Internal helper to wait on the ring, waking up early for posted
+	 * functions.
+	 * @param timeout The longest wait, negative to wait for a completion.
+	 */
+	void waitIoRing(std::chrono::nanoseconds timeout);
+
+	/**
+	 * Internal helper to tell whether I/O is in flight on the ring, not
+	 * counting the poll of the wake descriptor.
+	 */
+	bool ioInFlight() const;
+#endif	// RHYTHM_IO_URING
+
+	/**
+	 * Internal helper to wait without the ring on the wake descriptor and,
+	 * with path watches, the inotify descriptor.
+	 * @param timeout The longest wait, negative to wait for an event.
+	 */
+	void waitWakeFd(std::chrono::nanoseconds timeout);
+#endif	// RHYTHM_WAKE_FD
+
+	/**
+	 * Internal helper to sleep until a time, waking up early for I/O
+	 * completions and posted functions.
+	 */
+	void sleepUntil(const TimePoint& time);
+
+	// Batched dispatch, the batch is reused between ticks. One-shot tasks in
+	// the batch are held until the dispatcher has run.
+	BatchFn m_batchDispatch;
+	std::vector<BatchEntry> m_batch;
+	TaskList m_batchOneShots;
+
+	// Min-heap of continuations by time
+	std::vector<Continuation> m_continuations;
+
+	// Jitter of retry delays, seeded on first use
+	std::minstd_rand m_retryRandom;
+	bool m_retryRandomSeeded = false;
+
+	// Free coroutine frames, by size class
+	std::vector<void*> m_framePool[FrameSizeClasses];
+
+#ifdef RHYTHM_TASK_LOG
+	// Durable task log
+	std::unique_ptr<TaskLog> m_taskLog;
+	std::size_t m_loggedTaskCount = 0;
+
+	// Logged tasks touched since the last commit, whose deadlines it records
+	std::vector<TaskId> m_touchedLoggedTasks;
+
+	/**
+	 * Internal helper to record that a logged task has fired or been
+	 * cancelled.
+	 */
+	void logTaskDone(Task& task);
+
+	/**
+	 * Internal helper to record the deadlines of the logged tasks touched
+	 * since the last commit, once per task however often it was touched.
+	 */
+	void logTouchedTasks();
+#endif	// RHYTHM_TASK_LOG
+
+	// Idle callbacks
+	DurationMs m_idleHorizon = DurationMs(10);
+	DurationMs m_idleBudget = DurationMs(5);
+	std::size_t m_idleCursor = 0;
+	// Position of each idle callback in `m_idleCallbacks`, by ID
+	std::unordered_map<TaskId, std::size_t> m_idleIndex;
+	// Set while idle callbacks run, cancelled ones are then removed after
+	// the run
+	bool m_runningIdle = false;
+
+	// Idle garbage collection
+	GcStepFn m_idleGcStep;
+	DurationMs m_idleGcMinIdle = DurationMs::zero();
+
 	// Metrics
 	unsigned int m_totalRuns = 0;
 	unsigned int m_lateRuns = 0;
 	DurationMs m_totalRunTime = DurationMs::zero();
-	Clock::time_point m_metricsStartTime = Clock::now();
+	TimePoint m_metricsStartTime = Clock::now();
+	unsigned int m_gcSteps = 0;
+	std::size_t m_gcFreedBytes = 0;
+	typename Clock::duration m_gcTime = Clock::duration::zero();
+	unsigned int m_compactions = 0;
+
+	/**
+	 * Internal helper to add a callback used by a single task.
+	 */
+	CallbackId newCallback(const TaskFn& func,
+						   const TaskFn& cleanup,
+						   int batchRef);
+
+	/**
+	 * Internal helper to drop a reference to a callback, releasing it once
+	 * it has none left.
+	 */
+	void releaseCallback(CallbackId callback);
+
+	/**
+	 * Internal helper to free the callbacks released during a tick, so their
+	 * slots can be reused.
+	 */
+	void reclaimCallbacks();
+
+	/**
+	 * Internal helper to create an active task using a callback, without a
+	 * deadline.
+	 */
+	Task newTask(CallbackId callback);
+
+	/**
+	 * Internal helper to get the extra fields of a task, adding them if it
+	 * has none.
+	 */
+	TaskExtra& taskExtra(Task& task);
+
+	/**
+	 * Internal helper to get the extra fields of a task.
+	 * @return The extra fields, or null if it has none.
+	 */
+	const TaskExtra* findTaskExtra(const Task& task) const;
+
+	/**
+	 * Internal helper to convert a time to ms since the epoch, rounded up.
+	 * Both deadlines and the current time are rounded up, so tasks are due
+	 * from the millisecond their deadline falls in.
+	 */
+	EpochMs toEpochMs(const TimePoint& time) const;
+
+	/**
+	 * Internal helper to convert ms since the epoch to a time.
+	 */
+	TimePoint fromEpochMs(std::int64_t ms) const {
+		return m_epoch + DurationMs(ms);
+	}
+
+	/**
+	 * Internal helper to move the epoch up to now, once times relative to it
+	 * get close to the end of their range.
+	 */
+	void rebaseEpoch(const TimePoint& now);
+
+	/**
+	 * Internal helper to set the deadline of a task.
+	 */
+	void setDeadline(Task& task, const TimePoint& deadline);
+
+	/**
+	 * Internal helper to set the deadline of a task in ms since the epoch.
+	 */
+	void setNextRun(Task& task, std::int64_t nextRun);
+
+	/**
+	 * Internal helper to get the deadline of a task.
+	 */
+	TimePoint taskDeadline(const Task& task) const;
+
+	/**
+	 * Internal helper to get the deadline a task will run at, which a touch
+	 * moves back without rearming the task.
+	 */
+	TimePoint effectiveDeadline(const Task& task) const;
+
+	/**
+	 * Internal helper to set the interval or delay of a task.
+	 */
+	void setDuration(Task& task, const DurationMs& duration);
+
+	/**
+	 * Internal helper to get the interval or delay of a task.
+	 */
+	DurationMs taskDuration(const Task& task) const;
+
+	/**
+	 * Internal helper to store a new task, in the timer list for its duration
+	 * if that duration is shared.
+	 * @param task The task.
+	 * @param duration The delay or interval the task was armed with, zero if
+	 * none.
+	 */
+	TaskId addTask(Task&& task, const DurationMs& duration);
+
+	/**
+	 * Internal helper to append a task to a timer list, or to its deadline
+	 * bucket if it is due before the tail of the list.
+	 */
+	void insertOrdered(TaskList& list, Task&& task);
+
+	/**
+	 * Internal helper to add a task to the bucket for its deadline.
+	 */
+	void bucketTask(Task&& task);
+
+	/**
+	 * Internal helper to get the number of stored tasks, including
+	 * tombstones.
+	 */
+	std::size_t storedTaskCount() const;
+
+	/**
+	 * Internal helper to remove tombstones from all storage.
+	 */
+	void compactTasks();
+
+	/**
+	 * Internal helper to remove tombstones from a list of tasks, keeping the
+	 * order of the others.
+	 */
+	template <typename List>
+	void compactList(List& list);
+
+	/**
+	 * Internal helper to find an active task by ID.
+	 */
+	Task* findTask(TaskId id);
+
+	/**
+	 * Internal helper to call a function with every stored task, including
+	 * inactive ones.
+	 */
+	template <typename Self, typename Fn>
+	static void forEachTask(Self& self, Fn&& fn);
+
+	/**
+	 * Internal helper to run a due task, noting metrics.
+	 */
+	void runTask(Task& task);
+
+	/**
+	 * Internal helper to move a recurring task's next run past its interval.
+	 */
+	void advanceTask(Task& task, EpochMs now);
+
+	/**
+	 * Internal helper to rearm a retried task after a failed attempt, so it
+	 * is advanced to its next attempt when the attempt returns.
+	 */
+	void rearmRetry(Task& task, const DurationMs& delay);
+
+	/**
+	 * Internal helper to rearm a due task that isn't really due yet, because
+	 * it was touched since it was armed or only the end of the range of its
+	 * deadline was reached.
+	 * @return True if the task was rearmed and shouldn't run yet.
+	 */
+	bool rearmEarly(Task& task, EpochMs now);
+
+	/**
+	 * Internal helper to deactivate a task that has completed or was
+	 * cancelled, calling its cleanup function.
+	 */
+	void finishTask(Task& task);
+
+	/**
+	 * Internal helper to arm the tasks held on a completed task that have no
+	 * other predecessors left.
+	 */
+	void releaseDependents(TaskId id);
+
+	/**
+	 * Internal helper to cancel the tasks held on a cancelled task.
+	 */
+	void cancelDependents(TaskId id);
+
+	/**
+	 * Internal helper to cancel a held task, calling its cleanup function.
+	 * @return True if the task was held.
+	 */
+	bool cancelHeldTask(TaskId id);
+
+	/**
+	 * Internal helper to add a due task to the batch. One-shot tasks are
+	 * moved out to be completed after the dispatch.
+	 * @return True if the task was moved out.
+	 */
+	bool batchTask(Task& task, EpochMs now);
+
+	/**
+	 * Internal helper to run the due tasks at the head of a timer list.
+	 */
+	void runTimerList(TaskList& list, EpochMs now);
+
+	/**
+	 * Internal helper to run a due task from a timer list or bucket.
+	 * @return True if the task was rearmed and must be placed again, false
+	 * if it finished, cancelled itself or was moved out to the batch.
+	 */
+	bool runListedTask(Task& task, EpochMs now);
+
+	/**
+	 * Internal helper to move the buckets due by `now` out to run.
+	 */
+	void takeDueBuckets(EpochMs now);
+
+	/**
+	 * Internal helper to run the tasks of the due buckets, placing the
+	 * rearmed ones back in their timer lists.
+	 */
+	void runDueBuckets(EpochMs now);
+
+	/**
+	 * Internal helper to run idle callbacks if the deadline is beyond the
+	 * idle horizon, within the idle budget.
+	 * @param deadline The time the next task is due.
+	 */
+	void runIdleCallbacks(const TimePoint& deadline);
+
+	/**
+	 * Internal helper to remove a cancelled idle callback, or only mark it
+	 * inactive while idle callbacks are running.
+	 * @param index The position of the callback in `m_idleCallbacks`.
+	 */
+	void removeIdleCallback(std::size_t index);
+
+	/**
+	 * Internal helper to run idle garbage collection steps until the
+	 * deadline approaches.
+	 * @param deadline The time the next task is due.
+	 */
+	void runIdleGc(const TimePoint& deadline);
 
 	/**
 	 * Internal helper to note a task run for metrics.
@@ -139,4 +1223,21 @@ class Scheduler {
 	 * @param wasLate Whether the task run was late.
 	 */
 	void noteTaskRun(const DurationMs& runTime, bool wasLate);
+
+	/**
+	 * Internal helper to add time spent running tasks for metrics.
+	 * @param runTime The duration the tasks took to run.
+	 */
+	void noteRunTime(const DurationMs& runTime);
+
+	/**
+	 * Internal helper to run the collected batch through the dispatcher and
+	 * complete the one-shot tasks in it.
+	 */
+	void dispatchBatch();
 };
+
+// The default scheduler is instantiated in scheduler.cpp
+extern template class BasicScheduler<DefaultSchedulerPolicy>;
+
+using Scheduler = BasicScheduler<DefaultSchedulerPolicy>;
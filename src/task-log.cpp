@@ -0,0 +1,413 @@
+#include "task-log.hpp"
+
+#ifdef RHYTHM_TASK_LOG
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+// Log file header: magic followed by the format version
+constexpr char LogMagic[4] = {'R', 'H', 'Y', 'L'};
+constexpr std::uint32_t LogVersion = 1;
+constexpr std::size_t LogHeaderSize = 8;
+
+// The log file grows in chunks of at least this size
+constexpr std::size_t LogInitialCapacity = 1024 * 1024;
+
+// Record layout:
+//   [0]      type
+//   [1]      reserved
+//   [2..3]   key length
+//   [4..7]   checksum of the type, key length, and bytes from 8 onwards
+//   [8..15]  task ID
+//   [16..23] deadline in wall clock ms
+//   [24..]   key, padded to a multiple of 8 bytes
+constexpr std::size_t RecordHeaderSize = 24;
+constexpr std::uint8_t RecordNone = 0;	// Unwritten space
+constexpr std::uint8_t RecordSchedule = 1;
+constexpr std::uint8_t RecordDone = 2;
+
+std::size_t recordSize(std::size_t keyLength) {
+	return (RecordHeaderSize + keyLength + 7) & ~std::size_t(7);
+}
+
+// FNV-1a, enough to catch records that were cut short
+std::uint32_t checksum(std::uint8_t type,
+					   std::uint16_t keyLength,
+					   const unsigned char* body,
+					   std::size_t length) {
+	std::uint32_t hash = 2166136261u;
+	auto mix = [&hash](unsigned char byte) {
+		hash ^= byte;
+		hash *= 16777619u;
+	};
+	mix(type);
+	mix(static_cast<unsigned char>(keyLength & 0xff));
+	mix(static_cast<unsigned char>(keyLength >> 8));
+	for (std::size_t i = 0; i < length; i++) {
+		mix(body[i]);
+	}
+	return hash;
+}
+
+// Encodes a record into dest, which must have room for recordSize() bytes.
+// The type is written last so a record is never seen half written.
+void encodeRecord(unsigned char* dest,
+				  std::uint8_t type,
+				  std::uint64_t id,
+				  std::int64_t deadlineMs,
+				  const std::string& key) {
+	std::uint16_t keyLength = static_cast<std::uint16_t>(key.size());
+	std::size_t size = recordSize(keyLength);
+
+	std::memset(dest + 1, 0, size - 1);
+	std::memcpy(dest + 2, &keyLength, sizeof(keyLength));
+	std::memcpy(dest + 8, &id, sizeof(id));
+	std::memcpy(dest + 16, &deadlineMs, sizeof(deadlineMs));
+	std::memcpy(dest + RecordHeaderSize, key.data(), keyLength);
+
+	std::uint32_t sum = checksum(type, keyLength, dest + 8,
+								 RecordHeaderSize - 8 + keyLength);
+	std::memcpy(dest + 4, &sum, sizeof(sum));
+
+	std::atomic_signal_fence(std::memory_order_release);
+	dest[0] = type;
+}
+
+void encodeHeader(unsigned char* dest) {
+	std::memcpy(dest, LogMagic, sizeof(LogMagic));
+	std::memcpy(dest + sizeof(LogMagic), &LogVersion, sizeof(LogVersion));
+}
+
+// Grows the file to `size` bytes with its blocks allocated. The file is
+// mapped, and a store into a page the filesystem can't allocate raises
+// SIGBUS, so running out of space must be found out here instead.
+bool allocateFile(int fd, std::size_t size) {
+	int error;
+	do {
+		error = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+	} while (error == EINTR);
+	return error == 0;
+}
+
+// Syncs the directory containing `path`, making a rename into it durable
+bool syncParentDirectory(const std::string& path) {
+	std::size_t slash = path.rfind('/');
+	std::string dir = ".";
+	if (slash == 0) {
+		dir = "/";
+	} else if (slash != std::string::npos) {
+		dir = path.substr(0, slash);
+	}
+	int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = ::fsync(fd) == 0;
+	::close(fd);
+	return ok;
+}
+
+}  // namespace
+
+TaskLog::~TaskLog() {
+	close();
+}
+
+bool TaskLog::open(const std::string& path, std::vector<Entry>& pending) {
+	close();
+
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	// Only one process may append to a log
+	if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	bool isNew = st.st_size == 0;
+	std::size_t capacity = static_cast<std::size_t>(st.st_size);
+	if (capacity < LogInitialCapacity) {
+		capacity = LogInitialCapacity;
+	}
+	// Also allocates the blocks of an existing file that is sparse
+	if (!allocateFile(fd, capacity)) {
+		::close(fd);
+		return false;
+	}
+
+	if (!map(fd, capacity)) {
+		::close(fd);
+		return false;
+	}
+	m_fd = fd;
+	m_path = path;
+
+	if (isNew) {
+		encodeHeader(m_data);
+	} else if (std::memcmp(m_data, LogMagic, sizeof(LogMagic)) != 0 ||
+			   std::memcmp(m_data + sizeof(LogMagic), &LogVersion,
+						   sizeof(LogVersion)) != 0) {
+		// Not a log we understand, don't touch it
+		close();
+		return false;
+	}
+
+	// Replay the records, keeping only tasks that haven't completed
+	std::unordered_map<std::uint64_t, Entry> live;
+	std::size_t offset = LogHeaderSize;
+	bool torn = false;
+	m_recordCount = 0;
+	m_nextId = 1;
+	while (offset + RecordHeaderSize <= m_capacity) {
+		const unsigned char* record = m_data + offset;
+		std::uint8_t type = record[0];
+		if (type == RecordNone) {
+			break;
+		}
+
+		std::uint16_t keyLength;
+		std::uint32_t sum;
+		std::memcpy(&keyLength, record + 2, sizeof(keyLength));
+		std::memcpy(&sum, record + 4, sizeof(sum));
+
+		std::size_t size = recordSize(keyLength);
+		if (offset + size > m_capacity ||
+			(type != RecordSchedule && type != RecordDone) ||
+			sum != checksum(type, keyLength, record + 8,
+							RecordHeaderSize - 8 + keyLength)) {
+			torn = true;
+			break;
+		}
+
+		Entry entry;
+		std::memcpy(&entry.id, record + 8, sizeof(entry.id));
+		std::memcpy(&entry.deadlineMs, record + 16, sizeof(entry.deadlineMs));
+
+		if (entry.id >= m_nextId) {
+			m_nextId = entry.id + 1;
+		}
+
+		if (type == RecordSchedule) {
+			entry.key.assign(
+				reinterpret_cast<const char*>(record + RecordHeaderSize),
+				keyLength);
+			std::uint64_t id = entry.id;
+			live[id] = std::move(entry);
+		} else {
+			live.erase(entry.id);
+		}
+
+		m_recordCount++;
+		offset += size;
+	}
+
+	// Clear anything left by an interrupted append so it can't be mistaken
+	// for a record later
+	if (torn) {
+		std::memset(m_data + offset, 0, m_capacity - offset);
+	}
+
+	m_used = offset;
+	m_committed = isNew || torn ? LogHeaderSize : m_used;
+	if (!commit()) {
+		close();
+		return false;
+	}
+
+	pending.clear();
+	pending.reserve(live.size());
+	for (auto& item : live) {
+		pending.push_back(std::move(item.second));
+	}
+
+	return true;
+}
+
+void TaskLog::close() {
+	if (m_data) {
+		commit();
+		unmap();
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_used = 0;
+	m_committed = 0;
+	m_recordCount = 0;
+}
+
+bool TaskLog::appendSchedule(std::uint64_t id,
+							 std::int64_t deadlineMs,
+							 const std::string& key) {
+	return append(RecordSchedule, id, deadlineMs, key);
+}
+
+bool TaskLog::appendDone(std::uint64_t id) {
+	return append(RecordDone, id, 0, std::string());
+}
+
+bool TaskLog::commit() {
+	if (!m_data || m_committed >= m_used) {
+		return true;
+	}
+
+	// msync needs a page aligned start address
+	std::size_t pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+	std::size_t start = m_committed - m_committed % pageSize;
+	if (::msync(m_data + start, m_used - start, MS_SYNC) != 0) {
+		return false;
+	}
+
+	m_committed = m_used;
+	return true;
+}
+
+bool TaskLog::compact(const std::vector<Entry>& live) {
+	if (!m_data) {
+		return false;
+	}
+
+	// Build the compacted log in memory
+	std::size_t size = LogHeaderSize;
+	for (const Entry& entry : live) {
+		size += recordSize(entry.key.size());
+	}
+	std::size_t capacity = LogInitialCapacity;
+	while (capacity < size * 2) {
+		capacity *= 2;
+	}
+
+	std::vector<unsigned char> buffer(size);
+	encodeHeader(buffer.data());
+	std::size_t offset = LogHeaderSize;
+	for (const Entry& entry : live) {
+		encodeRecord(buffer.data() + offset, RecordSchedule, entry.id,
+					 entry.deadlineMs, entry.key);
+		offset += recordSize(entry.key.size());
+	}
+
+	// Write it next to the log, then atomically replace the log with it
+	std::string tmpPath = m_path + ".tmp";
+	int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+					0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	bool ok = ::flock(fd, LOCK_EX | LOCK_NB) == 0 && allocateFile(fd, capacity);
+	for (std::size_t written = 0; ok && written < size;) {
+		ssize_t n = ::pwrite(fd, buffer.data() + written, size - written,
+							 static_cast<off_t>(written));
+		ok = n > 0;
+		written += ok ? static_cast<std::size_t>(n) : 0;
+	}
+	ok = ok && ::fsync(fd) == 0 &&
+		 ::rename(tmpPath.c_str(), m_path.c_str()) == 0;
+	if (!ok) {
+		::close(fd);
+		::unlink(tmpPath.c_str());
+		return false;
+	}
+
+	// The rename is only durable once the directory is synced. The new file
+	// is the log either way, so switch over to it even if that fails.
+	ok = syncParentDirectory(m_path);
+
+	// Switch over to the new file
+	unmap();
+	::close(m_fd);
+	m_fd = fd;
+	if (!map(fd, capacity)) {
+		close();
+		return false;
+	}
+
+	m_used = size;
+	m_committed = size;
+	m_recordCount = live.size();
+	return ok;
+}
+
+bool TaskLog::map(int fd, std::size_t capacity) {
+	void* data = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+						fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	m_data = static_cast<unsigned char*>(data);
+	m_capacity = capacity;
+	return true;
+}
+
+void TaskLog::unmap() {
+	if (m_data) {
+		::munmap(m_data, m_capacity);
+		m_data = nullptr;
+		m_capacity = 0;
+	}
+}
+
+bool TaskLog::reserve(std::size_t bytes) {
+	if (m_used + bytes <= m_capacity) {
+		return true;
+	}
+
+	std::size_t capacity = m_capacity;
+	while (m_used + bytes > capacity) {
+		capacity *= 2;
+	}
+
+	// Appended records stay in the page cache across the remap, they're
+	// synced by the next commit as usual
+	if (!allocateFile(m_fd, capacity)) {
+		return false;
+	}
+	unmap();
+	if (!map(m_fd, capacity)) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool TaskLog::append(std::uint8_t type,
+					 std::uint64_t id,
+					 std::int64_t deadlineMs,
+					 const std::string& key) {
+	if (!m_data || key.size() > UINT16_MAX) {
+		return false;
+	}
+
+	std::size_t size = recordSize(key.size());
+	if (!reserve(size)) {
+		return false;
+	}
+
+	encodeRecord(m_data + m_used, type, id, deadlineMs, key);
+	m_used += size;
+	m_recordCount++;
+	return true;
+}
+
+#endif	// RHYTHM_TASK_LOG
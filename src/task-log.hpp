@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "rhythm-config.hpp"
+
+#ifdef RHYTHM_TASK_LOG
+
+/**
+ * Append-only, memory-mapped write-ahead log of one-shot task schedules.
+ *
+ * Appending a record is a copy into the mapping; records only become durable
+ * when `commit()` syncs them, so several operations share the cost of one
+ * sync (group commit). Records that are cut short or fail their checksum end
+ * the replay, so a crash mid-append loses at most the uncommitted tail.
+ *
+ * The file is grown with its blocks allocated up front, so a full filesystem
+ * makes `append()` or `compact()` fail instead of faulting on a store into
+ * the mapping.
+ */
+class TaskLog {
+   public:
+	/** A task that is still pending according to the log. */
+	struct Entry {
+		/** Log-wide ID of the task, stable across restarts */
+		std::uint64_t id = 0;
+		/** Deadline in wall clock milliseconds since the epoch */
+		std::int64_t deadlineMs = 0;
+		/** Key identifying the task's callback */
+		std::string key;
+	};
+
+	TaskLog() = default;
+	TaskLog(const TaskLog&) = delete;
+	TaskLog& operator=(const TaskLog&) = delete;
+	~TaskLog();
+
+	/**
+	 * Open or create the log file and replay it.
+	 * @param path The path of the log file.
+	 * @param pending Receives the tasks that are still pending.
+	 * @return True if the log was opened successfully.
+	 */
+	bool open(const std::string& path, std::vector<Entry>& pending);
+
+	/**
+	 * Commit any outstanding records and close the log.
+	 */
+	void close();
+
+	bool isOpen() const { return m_data != nullptr; }
+
+	/**
+	 * Allocate a new log-wide task ID.
+	 */
+	std::uint64_t allocateId() { return m_nextId++; }
+
+	/**
+	 * Append a record that a task is scheduled, replacing any earlier
+	 * schedule record with the same ID.
+	 * @return False if the log isn't open or couldn't grow for the record.
+	 */
+	bool appendSchedule(std::uint64_t id,
+						std::int64_t deadlineMs,
+						const std::string& key);
+
+	/**
+	 * Append a record that a task has fired or was cancelled.
+	 * @return False if the log isn't open or couldn't grow for the record.
+	 */
+	bool appendDone(std::uint64_t id);
+
+	/**
+	 * Make all appended records durable.
+	 * @return True if there was nothing to commit or the sync succeeded.
+	 */
+	bool commit();
+
+	/**
+	 * Rewrite the log so that it only contains the given live tasks.
+	 * @param live The tasks that are still pending.
+	 * @return True if the log was compacted successfully. False if the
+	 * compacted file couldn't be written, in which case the log is unchanged,
+	 * or if the directory couldn't be synced after replacing the log.
+	 */
+	bool compact(const std::vector<Entry>& live);
+
+	/** Number of records in the log since it was opened or compacted. */
+	std::size_t recordCount() const { return m_recordCount; }
+
+   private:
+	std::string m_path;
+	int m_fd = -1;
+	unsigned char* m_data = nullptr;
+	std::size_t m_capacity = 0;	 // Size of the file and mapping
+	std::size_t m_used = 0;		 // Bytes of valid records, including header
+	std::size_t m_committed = 0;  // Bytes known to be synced
+	std::size_t m_recordCount = 0;
+	std::uint64_t m_nextId = 1;
+
+	bool map(int fd, std::size_t capacity);
+	void unmap();
+	bool reserve(std::size_t bytes);
+	bool append(std::uint8_t type,
+				std::uint64_t id,
+				std::int64_t deadlineMs,
+				const std::string& key);
+};
+
+#endif	// RHYTHM_TASK_LOG
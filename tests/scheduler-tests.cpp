@@ -0,0 +1,360 @@
+// Regression tests for the scheduler core. The scheduler is instantiated
+// with a manual clock, so each test sets the time explicitly instead of
+// sleeping.
+//
+// Usage: scheduler-tests
+
+#include <cstdio>
+#include <thread>
+#include "scheduler-impl.hpp"
+
+#ifdef RHYTHM_PATH_WATCH
+#include <sys/inotify.h>
+#endif	// RHYTHM_PATH_WATCH
+
+// Clock advanced only by the tests. It and the policy have external linkage,
+// so the scheduler instantiated with them does too and its unused members
+// don't warn.
+struct ManualClock {
+	using rep = std::chrono::steady_clock::rep;
+	using period = std::chrono::steady_clock::period;
+	using duration = std::chrono::steady_clock::duration;
+	using time_point = std::chrono::time_point<ManualClock>;
+	static constexpr bool is_steady = true;
+
+	static time_point now() { return s_now; }
+	static void advance(std::chrono::milliseconds ms) { s_now += ms; }
+
+	static inline time_point s_now{};
+};
+
+struct TestPolicy : DefaultSchedulerPolicy {
+	using Clock = ManualClock;
+};
+
+namespace {
+
+using TestScheduler = BasicScheduler<TestPolicy>;
+using Ms = std::chrono::milliseconds;
+
+int g_failures = 0;
+
+#define CHECK(expr)                                                      \
+	do {                                                                 \
+		if (!(expr)) {                                                   \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+						 __LINE__, #expr);                               \
+			g_failures++;                                                \
+		}                                                                \
+	} while (false)
+
+// A cancelled task passed by a touched task moving back to its place must
+// stay cancelled
+void testCancelledTaskStaysCancelledAfterTouch() {
+	TestScheduler scheduler;
+	int runsA = 0;
+
+	// The duration repeats from the second task on, putting A and B in the
+	// same timer list
+	auto warmUp = scheduler.scheduleEvery(Ms(100), [](int) {});
+	CHECK(scheduler.cancelTask(warmUp));
+
+	auto a = scheduler.scheduleEvery(Ms(100), [&](int) { runsA++; });
+	ManualClock::advance(Ms(40));
+	CHECK(scheduler.touchTask(a));
+	ManualClock::advance(Ms(10));
+	auto b = scheduler.scheduleEvery(Ms(100), [](int) {});
+	CHECK(scheduler.cancelTask(b));
+
+	// A is rearmed to 140 and passes B, still queued at 150
+	ManualClock::advance(Ms(50));
+	scheduler.tick();
+	CHECK(runsA == 0);
+
+	CHECK(!scheduler.cancelTask(b));
+	CHECK(!scheduler.touchTask(b));
+	CHECK(scheduler.taskCount() == 1);
+
+	ManualClock::advance(Ms(40));
+	scheduler.tick();
+	CHECK(runsA == 1);
+	CHECK(scheduler.cancelTask(a));
+	CHECK(scheduler.taskCount() == 0);
+}
+
+// Debouncers share one callback, touch their pending one-shot task on each
+// trigger and cancel it when dropped
+void testDebouncedCallsCancelledAfterTouch() {
+	TestScheduler scheduler;
+	int runs = 0;
+	auto callback = scheduler.addTaskCallback([&](int) { runs++; });
+
+	auto first = scheduler.scheduleAfter(Ms(100), callback);
+	auto pending = scheduler.scheduleAfter(Ms(100), callback);
+	ManualClock::advance(Ms(5));
+	CHECK(scheduler.touchTask(pending));
+	ManualClock::advance(Ms(5));
+	auto cancelled = scheduler.scheduleAfter(Ms(100), callback);
+	CHECK(scheduler.cancelTask(cancelled));
+
+	// The pending call is pushed back to 105, passing the cancelled one
+	ManualClock::advance(Ms(90));
+	scheduler.tick();
+	CHECK(runs == 1);
+	CHECK(!scheduler.cancelTask(first));
+	CHECK(!scheduler.cancelTask(cancelled));
+	CHECK(!scheduler.touchTask(cancelled));
+	CHECK(scheduler.taskCount() == 1);
+
+	ManualClock::advance(Ms(5));
+	scheduler.tick();
+	CHECK(runs == 2);
+	CHECK(scheduler.taskCount() == 0);
+
+	// A touched call cancelled before it is due never runs
+	auto dropped = scheduler.scheduleAfter(Ms(100), callback);
+	ManualClock::advance(Ms(50));
+	CHECK(scheduler.touchTask(dropped));
+	CHECK(scheduler.cancelTask(dropped));
+	ManualClock::advance(Ms(200));
+	scheduler.tick();
+	CHECK(runs == 2);
+	CHECK(!scheduler.cancelTask(dropped));
+	CHECK(scheduler.taskCount() == 0);
+
+	scheduler.removeTaskCallback(callback);
+}
+
+// Tasks touched back before the tail of their timer list wait for their new
+// deadline out of the list, and return to it once rearmed past the tail
+void testTouchedTasksWaitOutOfList() {
+	TestScheduler scheduler;
+	int runsA = 0;
+	int runsB = 0;
+	int runsC = 0;
+
+	auto warmUp = scheduler.scheduleAfter(Ms(100), [](int) {});
+	CHECK(scheduler.cancelTask(warmUp));
+
+	auto a = scheduler.scheduleEvery(Ms(100), [&](int) { runsA++; });
+	auto b = scheduler.scheduleAfter(Ms(100), [&](int) { runsB++; });
+	auto dropped = scheduler.scheduleAfter(Ms(100), [&](int) { runsC++; });
+	ManualClock::advance(Ms(30));
+	CHECK(scheduler.touchTask(a));
+	CHECK(scheduler.touchTask(b));
+	CHECK(scheduler.touchTask(dropped));
+	ManualClock::advance(Ms(20));
+	auto c = scheduler.scheduleAfter(Ms(100), [&](int) { runsC++; });
+
+	// All three are rearmed to 130, before C at 150
+	ManualClock::advance(Ms(50));
+	scheduler.tick();
+	CHECK(runsA == 0 && runsB == 0 && runsC == 0);
+	CHECK(scheduler.nextTaskTime() == ManualClock::now() + Ms(30));
+
+	// Touching and cancelling still find them
+	ManualClock::advance(Ms(10));
+	CHECK(scheduler.touchTask(b));
+	CHECK(scheduler.cancelTask(dropped));
+	CHECK(scheduler.taskCount() == 3);
+
+	// A runs and B is rearmed to 210, past C
+	ManualClock::advance(Ms(20));
+	scheduler.tick();
+	CHECK(runsA == 1 && runsB == 0 && runsC == 0);
+
+	ManualClock::advance(Ms(20));
+	scheduler.tick();
+	CHECK(runsA == 1 && runsB == 0 && runsC == 1);
+	CHECK(!scheduler.cancelTask(c));
+
+	ManualClock::advance(Ms(60));
+	scheduler.tick();
+	CHECK(runsA == 1 && runsB == 1 && runsC == 1);
+
+	ManualClock::advance(Ms(20));
+	scheduler.tick();
+	CHECK(runsA == 2);
+	CHECK(scheduler.cancelTask(a));
+	CHECK(scheduler.taskCount() == 0);
+}
+
+// Idle callbacks run without any task scheduled, and cancelling one removes
+// it right away, also from a running idle callback
+void testIdleCallbacks() {
+	TestScheduler scheduler;
+	int runsA = 0;
+	int runsB = 0;
+	int cleanups = 0;
+	int b = 0;
+	auto a = scheduler.addIdleCallback([&](int) {
+		runsA++;
+		scheduler.cancelTask(b);
+	});
+	b = scheduler.addIdleCallback([&](int) { runsB++; },
+								  [&](int) { cleanups++; });
+	auto c = scheduler.addIdleCallback([](int) {});
+	CHECK(scheduler.idleCallbackCount() == 3);
+
+	scheduler.loop();
+	CHECK(runsA == 1);
+	CHECK(runsB == 0);
+	CHECK(cleanups == 1);
+	CHECK(scheduler.idleCallbackCount() == 2);
+	CHECK(!scheduler.cancelTask(b));
+
+	CHECK(scheduler.cancelTask(a));
+	CHECK(scheduler.idleCallbackCount() == 1);
+	CHECK(!scheduler.cancelTask(a));
+	CHECK(scheduler.cancelTask(c));
+	CHECK(scheduler.idleCallbackCount() == 0);
+	CHECK(cleanups == 1);
+}
+
+// Keys too long for snapshots are rejected instead of being truncated
+void testOverlongTaskKeys() {
+	TestScheduler scheduler;
+	auto id = scheduler.scheduleAfter(Ms(100), [](int) {});
+	std::string longest(TestScheduler::MaxKeyLength, 'k');
+	CHECK(scheduler.setTaskKey(id, longest));
+	CHECK(!scheduler.setTaskKey(id, longest + "k"));
+
+	TestScheduler::SnapshotEntry entry;
+	entry.key = longest + "k";
+	entry.nextRun = ManualClock::now() + Ms(100);
+	scheduler.restoreTask(entry, [](int) {});
+	CHECK(!scheduler.saveSnapshot("scheduler-tests.snapshot"));
+	CHECK(!std::ifstream("scheduler-tests.snapshot"));
+}
+
+// Whether a restored deadline is the given time from now, allowing for the
+// conversion through the wall clock
+template <typename SchedulerType>
+bool isDueIn(const typename SchedulerType::SnapshotEntry& entry, Ms delay) {
+	auto offset = entry.nextRun - (SchedulerType::Clock::now() + delay);
+	return offset < Ms(50) && offset > Ms(-50);
+}
+
+// Snapshots and the task log record the deadline a touch moved back to
+void testTouchedDeadlinesPersist() {
+	TestScheduler scheduler;
+	auto id = scheduler.scheduleAfter(Ms(1000), [](int) {});
+	CHECK(scheduler.setTaskKey(id, "touched"));
+	ManualClock::advance(Ms(400));
+	CHECK(scheduler.touchTask(id));
+
+	std::vector<TestScheduler::SnapshotEntry> entries;
+	CHECK(scheduler.saveSnapshot("scheduler-tests.snapshot"));
+	CHECK(TestScheduler::loadSnapshot("scheduler-tests.snapshot", entries));
+	CHECK(entries.size() == 1 && isDueIn<TestScheduler>(entries[0], Ms(1000)));
+	std::remove("scheduler-tests.snapshot");
+}
+
+#ifdef RHYTHM_TASK_LOG
+// Runs on the real clock, since the log stores wall clock deadlines that a
+// manual clock doesn't move
+void testTouchedDeadlinesLogged() {
+	std::vector<Scheduler::SnapshotEntry> entries;
+	std::remove("scheduler-tests.log");
+	{
+		Scheduler scheduler;
+		CHECK(scheduler.openTaskLog("scheduler-tests.log", entries));
+		auto id = scheduler.scheduleAfter(Ms(1000), [](int) {});
+		CHECK(scheduler.setTaskKey(id, "touched"));
+		scheduler.tick();
+
+		// Touched twice before the commit, recorded once
+		std::this_thread::sleep_for(Ms(150));
+		CHECK(scheduler.touchTask(id));
+		std::this_thread::sleep_for(Ms(150));
+		CHECK(scheduler.touchTask(id));
+		scheduler.tick();
+		scheduler.closeTaskLog();
+	}
+
+	Scheduler scheduler;
+	CHECK(scheduler.openTaskLog("scheduler-tests.log", entries));
+	CHECK(entries.size() == 1 && isDueIn<Scheduler>(entries[0], Ms(1000)));
+	scheduler.closeTaskLog();
+	std::remove("scheduler-tests.log");
+}
+#endif	// RHYTHM_TASK_LOG
+
+// A function posted from another thread ends a wait for a distant task
+// right away. Runs on the real clock, since the wait is what is tested.
+void checkPostWakesWait(Scheduler& scheduler) {
+	auto task = scheduler.scheduleAfter(Ms(10000), [](int) {});
+	bool ran = false;
+
+	auto start = std::chrono::steady_clock::now();
+	std::thread poster([&] {
+		std::this_thread::sleep_for(Ms(50));
+		scheduler.post([&] { ran = true; });
+	});
+	// Other wakeups may end a wait first, like I/O completions
+	while (!ran && std::chrono::steady_clock::now() - start < Ms(2000)) {
+		scheduler.runOnce(Ms(5000));
+	}
+	poster.join();
+	CHECK(ran);
+	CHECK(std::chrono::steady_clock::now() - start < Ms(2000));
+
+	// Also for a function posted by one that runs before the loop waits
+	ran = false;
+	start = std::chrono::steady_clock::now();
+	scheduler.post([&] {
+		scheduler.post([&] {
+			ran = true;
+			scheduler.stopLoop();
+		});
+	});
+	scheduler.loop();
+	CHECK(ran);
+	CHECK(std::chrono::steady_clock::now() - start < Ms(2000));
+
+	scheduler.cancelTask(task);
+}
+
+void testPostWakesWait() {
+	Scheduler scheduler;
+	checkPostWakesWait(scheduler);
+
+#ifdef RHYTHM_PATH_WATCH
+	// While polling the inotify descriptor
+	int watch = scheduler.watchPath(".", IN_CREATE, Ms(10),
+									[](int, const PathWatcher::Events&) {});
+	checkPostWakesWait(scheduler);
+	scheduler.unwatchPath(watch);
+#endif	// RHYTHM_PATH_WATCH
+
+#ifdef RHYTHM_IO_URING
+	// While waiting in the ring
+	if (scheduler.ioRing()) {
+		checkPostWakesWait(scheduler);
+	}
+#endif	// RHYTHM_IO_URING
+}
+
+}  // namespace
+
+template class BasicScheduler<TestPolicy>;
+
+int main() {
+	testCancelledTaskStaysCancelledAfterTouch();
+	testDebouncedCallsCancelledAfterTouch();
+	testTouchedTasksWaitOutOfList();
+	testIdleCallbacks();
+	testOverlongTaskKeys();
+	testTouchedDeadlinesPersist();
+#ifdef RHYTHM_TASK_LOG
+	testTouchedDeadlinesLogged();
+#endif	// RHYTHM_TASK_LOG
+	testPostWakesWait();
+
+	if (g_failures > 0) {
+		std::fprintf(stderr, "%d check(s) failed\n", g_failures);
+		return 1;
+	}
+	std::printf("All scheduler tests passed\n");
+	return 0;
+}